@@ -0,0 +1,200 @@
+/* This file is in public domain */
+
+/* The coarse clock page (T2P_COARSE=1).  A ticker thread wakes at every
+   posix second (a timerfd, so that setting the clock wakes it too) and
+   stores the converted time in the page, so time() is a load of it.
+   The time is converted at the tick as any other, so it steps (or
+   stands, or is smeared) over a leap second as t2p_time2posix does,
+   up to the wake up latency of the ticker.  CLOCK_REALTIME_COARSE
+   keeps its resolution: it is read from the vDSO and shifted by the
+   offset of the span the ticker stored with the time, outside of the
+   span it is converted as before.  */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+#include "time2posix.h"
+
+struct t2p_coarse_page t2p_coarse;
+
+static int coarse_fd = -1;
+
+/* set in the child after fork, whose ticker is started by its first
+   reader */
+int t2p_coarse_stale = 0;
+
+/* convert the time now and publish it */
+static void
+coarse_tick (struct timespec *right, struct timespec *posix)
+{
+  struct t2p_offset_cache span;
+
+  if (t2p_vdso_clock_gettime != NULL)
+    t2p_vdso_clock_gettime (CLOCK_REALTIME, right);
+  else
+    t2p_orig_clock_gettime (CLOCK_REALTIME, right);
+
+  *posix = *right;
+  t2p_time2posix_timespec (posix);
+  t2p_span_get (&span);
+
+  __atomic_store_n (&t2p_coarse.seq, t2p_coarse.seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  t2p_coarse.right_start = span.right_start;
+  t2p_coarse.right_end = span.right_end;
+  t2p_coarse.change = span.change;
+  __atomic_store_n (&t2p_coarse.sec, posix->tv_sec, __ATOMIC_RELAXED);
+  __atomic_store_n (&t2p_coarse.seq, t2p_coarse.seq + 1, __ATOMIC_RELEASE);
+}
+
+static void *
+coarse_ticker (void *arg)
+{
+  struct itimerspec its;
+  struct timespec right, posix;
+  u_int64_t expirations;
+
+  memset (&its, 0, sizeof its);
+  for (;;)
+    {
+      coarse_tick (&right, &posix);
+
+      /* the next posix second, in right time (at least the next right
+         one, whatever the table says) */
+      its.it_value.tv_sec = posix.tv_sec + 1;
+      its.it_value.tv_nsec = 0;
+      t2p_posix2time_timespec (&its.it_value);
+      if (its.it_value.tv_sec <= right.tv_sec)
+        {
+          its.it_value.tv_sec = right.tv_sec + 1;
+          its.it_value.tv_nsec = 0;
+        }
+
+      if (t2p_orig_timerfd_settime (coarse_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                                    &its, NULL))
+        sleep (1);
+      else
+        /* (ECANCELED if the clock was set) */
+        while (read (coarse_fd, &expirations, sizeof expirations) < 0 && errno == EINTR)
+          ;
+    }
+
+  return arg;
+}
+
+static void
+coarse_start (void)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
+
+  coarse_fd = t2p_orig_timerfd_create (CLOCK_REALTIME, TFD_CLOEXEC);
+  if (coarse_fd < 0)
+    {
+      fprintf (stderr, "time2posix warning: Cannot create the coarse clock timer!\n");
+      return;
+    }
+
+  /* signals are for the application threads */
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create (&thread, &attr, coarse_ticker, NULL))
+    fprintf (stderr, "time2posix warning: Cannot start the coarse clock ticker!\n");
+  pthread_attr_destroy (&attr);
+
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+}
+
+/* the page of the parent stops with its ticker (and the timer is
+   shared with it), no threads are started here, the child may only
+   exec */
+static void
+coarse_fork_child (void)
+{
+  __atomic_store_n (&t2p_coarse.sec, 0, __ATOMIC_RELAXED);
+  if (coarse_fd >= 0)
+    t2p_orig_close (coarse_fd);
+  coarse_fd = -1;
+  __atomic_store_n (&t2p_coarse_stale, 1, __ATOMIC_RELEASE);
+}
+
+/* start the ticker of the child, the readers convert meanwhile */
+void
+t2p_coarse_restart (void)
+{
+  int stale = 1;
+
+  if (__atomic_compare_exchange_n (&t2p_coarse_stale, &stale, 0, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    coarse_start ();
+}
+
+/* called once, when the table is set up */
+void
+t2p_coarse_init (void)
+{
+  const char *env = secure_getenv ("T2P_COARSE");
+
+  if (env == NULL || atoi (env) <= 0 || t2p_orig_timerfd_create == NULL
+      || t2p_orig_timerfd_settime == NULL)
+    return;
+
+  coarse_start ();
+  pthread_atfork (NULL, NULL, coarse_fork_child);
+}
+
+/* CLOCK_REALTIME_COARSE through the page, as clock_gettime, or returns
+   1 if it is not ticking */
+int
+t2p_coarse_gettime (struct timespec *ts)
+{
+  time_t start, end;
+  unsigned seq;
+  int change, res;
+
+  if (__atomic_load_n (&t2p_coarse.sec, __ATOMIC_RELAXED) == 0)
+    {
+      if (__builtin_expect (__atomic_load_n (&t2p_coarse_stale, __ATOMIC_RELAXED), 0))
+        t2p_coarse_restart ();
+      return 1;
+    }
+
+  if (t2p_vdso_clock_gettime != NULL)
+    {
+      res = t2p_vdso_clock_gettime (CLOCK_REALTIME_COARSE, ts);
+      if (res < 0)
+        {
+          errno = -res;
+          return -1;
+        }
+    }
+  else if (t2p_orig_clock_gettime (CLOCK_REALTIME_COARSE, ts))
+    return -1;
+
+  do
+    {
+      seq = __atomic_load_n (&t2p_coarse.seq, __ATOMIC_ACQUIRE);
+      start = t2p_coarse.right_start;
+      end = t2p_coarse.right_end;
+      change = t2p_coarse.change;
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+  while ((seq & 1) || seq != __atomic_load_n (&t2p_coarse.seq, __ATOMIC_RELAXED));
+
+  if (ts->tv_sec >= start && ts->tv_sec < end)
+    ts->tv_sec -= change;
+  else
+    t2p_time2posix_timespec (ts);
+  return 0;
+}
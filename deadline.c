@@ -0,0 +1,625 @@
+/* This file is in public domain */
+
+/* Absolute deadlines on the realtime clock.  The program computes them
+   from the posix time it reads, the kernel waits for them in right time,
+   so they are converted (by the current span, a subtraction) on the way
+   in.  The timeouts and timer values read back (the old values of the
+   settime calls, timerfd_gettime, timer_gettime) are relative and pass
+   as they are.
+
+   The clock of a timerfd is kept in the fd state of socket.c (asked in
+   /proc for those not created here), that of a POSIX timer in a table of
+   the realtime ones, and that of a condition variable is read from the
+   condition itself (in glibc's private layout).  */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "time2posix.h"
+
+#if defined (__has_include)
+# if __has_include (<liburing.h>)
+#  include <liburing.h>
+#  define T2P_URING 1
+# endif
+#endif
+
+#define NS_PER_SEC 1000000000L
+
+/* realtime POSIX timers tracked, at most */
+#define TIMERS_MAX 1024
+
+/* io_uring timeouts converted in thread-local copies per submit, the
+   copies of more are allocated */
+#define URING_COPIES 32
+
+int (*t2p_orig_clock_nanosleep) (clockid_t, int, const struct timespec *, struct timespec *);
+int (*t2p_orig_timerfd_create) (int, int);
+int (*t2p_orig_timerfd_settime) (int, int, const struct itimerspec *, struct itimerspec *);
+int (*t2p_orig_timer_create) (clockid_t, struct sigevent *, timer_t *);
+int (*t2p_orig_timer_settime) (timer_t, int, const struct itimerspec *, struct itimerspec *);
+int (*t2p_orig_timer_delete) (timer_t);
+
+int (*t2p_orig_pthread_cond_timedwait) (pthread_cond_t *, pthread_mutex_t *, const struct timespec *);
+int (*t2p_orig_pthread_mutex_timedlock) (pthread_mutex_t *, const struct timespec *);
+int (*t2p_orig_pthread_rwlock_timedrdlock) (pthread_rwlock_t *, const struct timespec *);
+int (*t2p_orig_pthread_rwlock_timedwrlock) (pthread_rwlock_t *, const struct timespec *);
+int (*t2p_orig_pthread_timedjoin_np) (pthread_t, void **, const struct timespec *);
+int (*t2p_orig_sem_timedwait) (sem_t *, const struct timespec *);
+ssize_t (*t2p_orig_mq_timedreceive) (mqd_t, char *, size_t, unsigned int *, const struct timespec *);
+int (*t2p_orig_mq_timedsend) (mqd_t, const char *, size_t, unsigned int, const struct timespec *);
+
+int (*t2p_orig_pthread_cond_clockwait) (pthread_cond_t *, pthread_mutex_t *, clockid_t, const struct timespec *);
+int (*t2p_orig_pthread_mutex_clocklock) (pthread_mutex_t *, clockid_t, const struct timespec *);
+int (*t2p_orig_pthread_rwlock_clockrdlock) (pthread_rwlock_t *, clockid_t, const struct timespec *);
+int (*t2p_orig_pthread_rwlock_clockwrlock) (pthread_rwlock_t *, clockid_t, const struct timespec *);
+int (*t2p_orig_pthread_clockjoin_np) (pthread_t, void **, clockid_t, const struct timespec *);
+int (*t2p_orig_sem_clockwait) (sem_t *, clockid_t, const struct timespec *);
+
+int (*t2p_orig_io_uring_submit) (struct io_uring *);
+int (*t2p_orig_io_uring_submit_and_wait) (struct io_uring *, unsigned);
+
+/* the right time of the posix deadline abstime, in right (invalid ones
+   are passed for the kernel to refuse them) */
+static inline const struct timespec *
+deadline (const struct timespec *abstime, struct timespec *right)
+{
+  if (abstime == NULL || abstime->tv_nsec < 0 || abstime->tv_nsec >= NS_PER_SEC)
+    return abstime;
+
+  *right = *abstime;
+  t2p_posix2time_timespec (right);
+  if (__builtin_expect (t2p_fake_clock, 0))
+    t2p_fake_clock_unmap (right);
+  return right;
+}
+
+static inline int
+clock_realtime (clockid_t clkid)
+{
+  return clkid == CLOCK_REALTIME || clkid == CLOCK_REALTIME_ALARM;
+}
+
+/* a missing original function (one of the newer ones) */
+#define deadline_missing(fn)						\
+  do									\
+    {									\
+      if (fn == NULL)							\
+        return ENOSYS;							\
+    }									\
+  while (0)
+
+int
+clock_nanosleep (clockid_t clkid, int flags, const struct timespec *req,
+                 struct timespec *rem)
+{
+  struct timespec right;
+
+  T2P_BIND ();
+  T2P_STAT (clock_nanosleep);
+  if ((flags & TIMER_ABSTIME) && clock_realtime (clkid))
+    req = deadline (req, &right);
+  return t2p_orig_clock_nanosleep (clkid, flags, req, rem);
+}
+
+int
+timerfd_create (int clkid, int flags)
+{
+  int fd;
+
+  T2P_BIND ();
+  fd = t2p_orig_timerfd_create (clkid, flags);
+  if (fd >= 0)
+    t2p_fd_set_state (fd, clock_realtime (clkid) ? T2P_FD_REALTIME : T2P_FD_KNOWN);
+  return fd;
+}
+
+/* whether fd is a timerfd on a realtime clock */
+static int
+timerfd_realtime (int fd)
+{
+  char path[64], buf[512], *p;
+  unsigned long state;
+  ssize_t len;
+  int pfd, realtime = 0;
+
+  if ((unsigned) fd >= T2P_FD_MAX)
+    return 0;
+
+  state = __atomic_load_n (&t2p_fd_state[fd / (4 * sizeof (unsigned long))], __ATOMIC_RELAXED)
+          >> fd % (4 * sizeof (unsigned long)) * 2 & T2P_FD_STAMPING;
+  if (__builtin_expect (state != 0, 1))
+    return state == T2P_FD_REALTIME;
+
+  /* inherited or duplicated */
+  snprintf (path, sizeof (path), "/proc/self/fdinfo/%d", fd);
+  pfd = open (path, O_RDONLY | O_CLOEXEC);
+  if (pfd < 0)
+    return 0;
+  len = read (pfd, buf, sizeof (buf) - 1);
+  t2p_orig_close (pfd);
+  if (len <= 0)
+    return 0;
+  buf[len] = '\0';
+
+  p = strstr (buf, "clockid:");
+  if (p != NULL)
+    realtime = clock_realtime (atoi (p + 8));
+  t2p_fd_set_state (fd, realtime ? T2P_FD_REALTIME : T2P_FD_KNOWN);
+  return realtime;
+}
+
+int
+timerfd_settime (int fd, int flags, const struct itimerspec *new, struct itimerspec *old)
+{
+  struct itimerspec right;
+
+  T2P_BIND ();
+  T2P_STAT (timerfd_settime);
+  if ((flags & TFD_TIMER_ABSTIME) && new != NULL && timerfd_realtime (fd)
+      && (new->it_value.tv_sec || new->it_value.tv_nsec))
+    {
+      right.it_interval = new->it_interval;
+      right.it_value = *deadline (&new->it_value, &right.it_value);
+      new = &right;
+    }
+  return t2p_orig_timerfd_settime (fd, flags, new, old);
+}
+
+/* The realtime POSIX timers, open addressed by timer_t.  Nobody has many
+   of them, or sets them often.  */
+enum { TIMER_FREE, TIMER_REALTIME, TIMER_GONE };
+
+static struct
+{
+  timer_t timer;
+  int state;
+} t2p_timers[TIMERS_MAX];
+
+static pthread_mutex_t t2p_timers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the slot of timer, or a free one, must be called with t2p_timers_lock
+   held */
+static int
+timer_slot (timer_t timer, int for_new)
+{
+  size_t i, h = ((uintptr_t) timer * 0x9e3779b97f4a7c15ULL >> 32) % TIMERS_MAX;
+  int slot;
+
+  for (i = 0; i < TIMERS_MAX; i++)
+    {
+      slot = (h + i) % TIMERS_MAX;
+      if (t2p_timers[slot].state == TIMER_FREE
+          || (for_new && t2p_timers[slot].state == TIMER_GONE)
+          || (t2p_timers[slot].state == TIMER_REALTIME && t2p_timers[slot].timer == timer))
+        return slot;
+    }
+  return -1;
+}
+
+/* mark timer as one on a realtime clock or not */
+static void
+timer_set (timer_t timer, int realtime)
+{
+  static int warned = 0;
+  int slot;
+
+  pthread_mutex_lock (&t2p_timers_lock);
+  slot = timer_slot (timer, 0);
+  if (slot >= 0 && t2p_timers[slot].state == TIMER_REALTIME)
+    t2p_timers[slot].state = TIMER_GONE;
+  if (realtime)
+    {
+      slot = timer_slot (timer, 1);
+      if (slot >= 0)
+        {
+          t2p_timers[slot].timer = timer;
+          t2p_timers[slot].state = TIMER_REALTIME;
+        }
+      else if (!warned)
+        {
+          warned = 1;
+          fprintf (stderr, "time2posix warning: Too many realtime timers, their deadlines won't be converted!\n");
+        }
+    }
+  pthread_mutex_unlock (&t2p_timers_lock);
+}
+
+static int
+timer_realtime (timer_t timer)
+{
+  int slot, realtime;
+
+  pthread_mutex_lock (&t2p_timers_lock);
+  slot = timer_slot (timer, 0);
+  realtime = slot >= 0 && t2p_timers[slot].state == TIMER_REALTIME;
+  pthread_mutex_unlock (&t2p_timers_lock);
+  return realtime;
+}
+
+int
+timer_create (clockid_t clkid, struct sigevent *sev, timer_t *timer)
+{
+  int res;
+
+  T2P_BIND ();
+  res = t2p_orig_timer_create (clkid, sev, timer);
+
+  /* (the ids of deleted timers are reused) */
+  if (res == 0)
+    timer_set (*timer, clock_realtime (clkid));
+  return res;
+}
+
+int
+timer_delete (timer_t timer)
+{
+  T2P_BIND ();
+  timer_set (timer, 0);
+  return t2p_orig_timer_delete (timer);
+}
+
+int
+timer_settime (timer_t timer, int flags, const struct itimerspec *new, struct itimerspec *old)
+{
+  struct itimerspec right;
+
+  T2P_BIND ();
+  T2P_STAT (timer_settime);
+  if ((flags & TIMER_ABSTIME) && new != NULL
+      && (new->it_value.tv_sec || new->it_value.tv_nsec) && timer_realtime (timer))
+    {
+      right.it_interval = new->it_interval;
+      right.it_value = *deadline (&new->it_value, &right.it_value);
+      new = &right;
+    }
+  return t2p_orig_timer_settime (timer, flags, new, old);
+}
+
+/* Whether the condition waits on the realtime clock.  No call tells
+   the clock of a condition, so this reads glibc's private layout: since
+   glibc 2.25 bit 1 of __wrefs is set for CLOCK_MONOTONIC (see
+   pthread_condattr_setclock).  With another libc, or an older glibc,
+   every condition is taken as a realtime one.  */
+#ifdef __GLIBC__
+# if __GLIBC_PREREQ (2, 25)
+#  define T2P_COND_CLOCK 1
+# endif
+#endif
+
+static inline int
+cond_realtime (pthread_cond_t *cond __attribute__ ((unused)))
+{
+#ifdef T2P_COND_CLOCK
+  return !(__atomic_load_n (&cond->__data.__wrefs, __ATOMIC_RELAXED) & 2);
+#else
+  return 1;
+#endif
+}
+
+int
+pthread_cond_timedwait (pthread_cond_t *cond, pthread_mutex_t *mutex,
+                        const struct timespec *abstime)
+{
+  struct timespec right;
+
+  T2P_BIND ();
+  T2P_STAT (timedwait);
+  if (cond_realtime (cond))
+    abstime = deadline (abstime, &right);
+  return t2p_orig_pthread_cond_timedwait (cond, mutex, abstime);
+}
+
+/* the waits on the realtime clock only */
+#define def_timed(name, type)						\
+int									\
+name (type *obj, const struct timespec *abstime)			\
+{									\
+  struct timespec right;						\
+  T2P_BIND ();								\
+  T2P_STAT (timedwait);							\
+  return t2p_orig_##name (obj, deadline (abstime, &right));		\
+}
+
+def_timed(pthread_mutex_timedlock, pthread_mutex_t)
+def_timed(pthread_rwlock_timedrdlock, pthread_rwlock_t)
+def_timed(pthread_rwlock_timedwrlock, pthread_rwlock_t)
+def_timed(sem_timedwait, sem_t)
+
+/* the waits with an explicit clock */
+#define def_clock(name, type)						\
+int									\
+name (type *obj, clockid_t clkid, const struct timespec *abstime)	\
+{									\
+  struct timespec right;						\
+  T2P_BIND ();								\
+  T2P_STAT (timedwait);							\
+  deadline_missing (t2p_orig_##name);					\
+  if (clock_realtime (clkid))						\
+    abstime = deadline (abstime, &right);				\
+  return t2p_orig_##name (obj, clkid, abstime);				\
+}
+
+def_clock(pthread_mutex_clocklock, pthread_mutex_t)
+def_clock(pthread_rwlock_clockrdlock, pthread_rwlock_t)
+def_clock(pthread_rwlock_clockwrlock, pthread_rwlock_t)
+def_clock(sem_clockwait, sem_t)
+
+int
+pthread_cond_clockwait (pthread_cond_t *cond, pthread_mutex_t *mutex, clockid_t clkid,
+                        const struct timespec *abstime)
+{
+  struct timespec right;
+
+  T2P_BIND ();
+  T2P_STAT (timedwait);
+  deadline_missing (t2p_orig_pthread_cond_clockwait);
+  if (clock_realtime (clkid))
+    abstime = deadline (abstime, &right);
+  return t2p_orig_pthread_cond_clockwait (cond, mutex, clkid, abstime);
+}
+
+int
+pthread_timedjoin_np (pthread_t thread, void **ret, const struct timespec *abstime)
+{
+  struct timespec right;
+
+  T2P_BIND ();
+  T2P_STAT (timedwait);
+  return t2p_orig_pthread_timedjoin_np (thread, ret, deadline (abstime, &right));
+}
+
+int
+pthread_clockjoin_np (pthread_t thread, void **ret, clockid_t clkid,
+                      const struct timespec *abstime)
+{
+  struct timespec right;
+
+  T2P_BIND ();
+  T2P_STAT (timedwait);
+  deadline_missing (t2p_orig_pthread_clockjoin_np);
+  if (clock_realtime (clkid))
+    abstime = deadline (abstime, &right);
+  return t2p_orig_pthread_clockjoin_np (thread, ret, clkid, abstime);
+}
+
+ssize_t
+mq_timedreceive (mqd_t mq, char *msg, size_t len, unsigned int *prio,
+                 const struct timespec *abstime)
+{
+  struct timespec right;
+
+  T2P_BIND ();
+  T2P_STAT (timedwait);
+  if (t2p_orig_mq_timedreceive == NULL)
+    {
+      errno = ENOSYS;
+      return -1;
+    }
+  return t2p_orig_mq_timedreceive (mq, msg, len, prio, deadline (abstime, &right));
+}
+
+int
+mq_timedsend (mqd_t mq, const char *msg, size_t len, unsigned int prio,
+              const struct timespec *abstime)
+{
+  struct timespec right;
+
+  T2P_BIND ();
+  T2P_STAT (timedwait);
+  if (t2p_orig_mq_timedsend == NULL)
+    {
+      errno = ENOSYS;
+      return -1;
+    }
+  return t2p_orig_mq_timedsend (mq, msg, len, prio, deadline (abstime, &right));
+}
+
+#ifdef T2P_URING
+
+/* The absolute realtime timeouts of the SQEs not submitted yet.  The
+   kernel reads the timespec when it takes the SQE, which is in the
+   submit, so they are converted in copies and the SQEs it has taken are
+   pointed back to the originals afterwards.  The copies are on the heap
+   beyond URING_COPIES of them.  liburing hands all of the SQEs over to
+   the kernel even if it takes only some (the rest stay in the ring for
+   the next submit), the copies of those are kept on the heap until it
+   has taken them.  With a kernel thread polling the ring the SQE may be
+   taken at any time after the submit, and the caller's own timespec
+   must not be changed under it either, so the timeouts of those rings
+   are not converted (they expire late or early by the offset).  */
+struct uring_copy
+{
+  u_int64_t *addr;
+  u_int64_t orig;
+  unsigned index;
+  struct __kernel_timespec ts;
+};
+
+/* the copies of SQEs the kernel had not taken when the submit returned,
+   until the head of the ring has passed end */
+struct uring_pending
+{
+  struct uring_pending *next;
+  struct io_uring *ring;
+  unsigned end;
+  size_t n;
+  struct uring_copy copies[];
+};
+
+static __thread struct uring_copy t2p_uring_copies[URING_COPIES];
+
+static struct uring_pending *t2p_uring_pending = NULL;
+static pthread_mutex_t t2p_uring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the field with the address of the absolute realtime timeout of the
+   SQE, NULL if it has none */
+static u_int64_t *
+uring_timeout (struct io_uring_sqe *sqe)
+{
+  if ((sqe->timeout_flags & (IORING_TIMEOUT_ABS | IORING_TIMEOUT_REALTIME))
+      != (IORING_TIMEOUT_ABS | IORING_TIMEOUT_REALTIME))
+    return NULL;
+
+  if (sqe->opcode == IORING_OP_TIMEOUT || sqe->opcode == IORING_OP_LINK_TIMEOUT)
+    return (u_int64_t *) &sqe->addr;
+  if (sqe->opcode == IORING_OP_TIMEOUT_REMOVE && (sqe->timeout_flags & IORING_TIMEOUT_UPDATE))
+    return (u_int64_t *) &sqe->addr2;
+  return NULL;
+}
+
+static size_t
+uring_convert (struct io_uring *ring, struct uring_copy **copies)
+{
+  struct io_uring_sq *sq = &ring->sq;
+  unsigned mask = *sq->kring_mask, shift = 0, i;
+  struct __kernel_timespec *kts;
+  struct timespec ts, right;
+  u_int64_t *addr;
+  size_t n = 0, max = 0;
+
+  *copies = t2p_uring_copies;
+  if (ring->flags & IORING_SETUP_SQPOLL)
+    return 0;
+
+#ifdef IORING_SETUP_SQE128
+  if (ring->flags & IORING_SETUP_SQE128)
+    shift = 1;
+#endif
+
+  for (i = sq->sqe_head; i != sq->sqe_tail; i++)
+    max += uring_timeout (&sq->sqes[(i & mask) << shift]) != NULL;
+  if (max > URING_COPIES)
+    {
+      *copies = malloc (max * sizeof (struct uring_copy));
+      if (*copies == NULL)
+        return 0;
+    }
+
+  for (i = sq->sqe_head; i != sq->sqe_tail; i++)
+    {
+      addr = uring_timeout (&sq->sqes[(i & mask) << shift]);
+      if (addr == NULL || *addr == 0)
+        continue;
+
+      kts = (struct __kernel_timespec *) (uintptr_t) *addr;
+      ts.tv_sec = kts->tv_sec;
+      ts.tv_nsec = kts->tv_nsec;
+      deadline (&ts, &right);
+
+      (*copies)[n].addr = addr;
+      (*copies)[n].orig = *addr;
+      (*copies)[n].index = i;
+      (*copies)[n].ts.tv_sec = right.tv_sec;
+      (*copies)[n].ts.tv_nsec = right.tv_nsec;
+      *addr = (uintptr_t) &(*copies)[n++].ts;
+    }
+
+  return n;
+}
+
+/* the kernel has taken the SQE at index, head is that of the ring */
+static inline int
+uring_taken (unsigned index, unsigned head)
+{
+  return (int) (index - head) < 0;
+}
+
+/* keep the copies of the n SQEs the kernel has not taken (their SQEs
+   are not handed out again until it has), or if they cannot be kept
+   restore them, and free the kept ones it has taken meanwhile */
+static void
+uring_keep (struct io_uring *ring, unsigned head, struct uring_copy *copies, size_t n)
+{
+  struct uring_pending *p, **pp;
+  size_t i;
+
+  p = n ? malloc (sizeof (struct uring_pending) + n * sizeof (struct uring_copy)) : NULL;
+  if (p != NULL)
+    {
+      p->ring = ring;
+      p->end = copies[n-1].index + 1;
+      p->n = n;
+      memcpy (p->copies, copies, n * sizeof (struct uring_copy));
+      for (i = 0; i < n; i++)
+        *p->copies[i].addr = (uintptr_t) &p->copies[i].ts;
+    }
+  else
+    for (i = 0; i < n; i++)
+      *copies[i].addr = copies[i].orig;
+
+  pthread_mutex_lock (&t2p_uring_lock);
+  for (pp = &t2p_uring_pending; *pp != NULL; )
+    if ((*pp)->ring == ring && uring_taken ((*pp)->end - 1, head))
+      {
+        struct uring_pending *done = *pp;
+
+        *pp = done->next;
+        free (done);
+      }
+    else
+      pp = &(*pp)->next;
+
+  if (p != NULL)
+    {
+      p->next = t2p_uring_pending;
+      __atomic_store_n (&t2p_uring_pending, p, __ATOMIC_RELEASE);
+    }
+  pthread_mutex_unlock (&t2p_uring_lock);
+}
+
+static void
+uring_restore (struct io_uring *ring, struct uring_copy *copies, size_t n)
+{
+  unsigned head = __atomic_load_n (ring->sq.khead, __ATOMIC_ACQUIRE);
+  size_t i;
+
+  for (i = 0; i < n && uring_taken (copies[i].index, head); i++)
+    *copies[i].addr = copies[i].orig;
+
+  if (i < n || __atomic_load_n (&t2p_uring_pending, __ATOMIC_ACQUIRE) != NULL)
+    uring_keep (ring, head, copies + i, n - i);
+
+  if (copies != t2p_uring_copies)
+    free (copies);
+}
+
+int
+io_uring_submit (struct io_uring *ring)
+{
+  struct uring_copy *copies;
+  size_t n;
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (io_uring_submit);
+  n = uring_convert (ring, &copies);
+  res = t2p_orig_io_uring_submit (ring);
+  uring_restore (ring, copies, n);
+  return res;
+}
+
+int
+io_uring_submit_and_wait (struct io_uring *ring, unsigned wait_nr)
+{
+  struct uring_copy *copies;
+  size_t n;
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (io_uring_submit);
+  n = uring_convert (ring, &copies);
+  res = t2p_orig_io_uring_submit_and_wait (ring, wait_nr);
+  uring_restore (ring, copies, n);
+  return res;
+}
+
+#endif /* T2P_URING */
@@ -0,0 +1,345 @@
+/* This file is in public domain */
+
+/* The fake clock (see t2p_fake_clock_set).  It replaces the original
+   realtime functions behind the wrappers, so everything above them (the
+   conversions, the statistics, the tracer) runs as with the real one.
+   The fake right time is an affine function of the real realtime clock,
+
+     fake = base + (real - real_base) * rate
+
+   so the socket timestamps of the kernel are moved the same way.  */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "time2posix.h"
+
+#define NS_PER_SEC 1000000000LL
+
+int t2p_fake_clock = 0;
+
+/* read like the latch (odd seq while it is being written) */
+static struct
+{
+  unsigned seq;
+  int64_t base;
+  int64_t real_base;
+
+  /* 32.32 fixed point */
+  u_int64_t rate;
+} fake;
+
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int (*real_vdso_clock_gettime) (clockid_t, struct timespec *);
+static int (*real_clock_gettime) (clockid_t, struct timespec *);
+static int (*real_gettimeofday) (struct timeval *, struct timezone *);
+static int (*real_clock_adjtime) (clockid_t, struct timex *);
+
+static int
+real_gettime (clockid_t clkid, struct timespec *ts)
+{
+  int res;
+
+  if (real_vdso_clock_gettime == NULL)
+    return real_clock_gettime (clkid, ts);
+
+  res = real_vdso_clock_gettime (clkid, ts);
+  if (res < 0)
+    {
+      errno = -res;
+      return -1;
+    }
+  return res;
+}
+
+static int64_t
+real_now (void)
+{
+  struct timespec ts;
+
+  real_gettime (CLOCK_REALTIME, &ts);
+  return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static int64_t
+fake_at (int64_t real)
+{
+  int64_t res;
+  unsigned seq;
+
+  do
+    {
+      seq = __atomic_load_n (&fake.seq, __ATOMIC_ACQUIRE);
+      res = fake.base + (int64_t) (((__int128) (real - fake.real_base) * fake.rate) >> 32);
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+  while ((seq & 1) || seq != __atomic_load_n (&fake.seq, __ATOMIC_RELAXED));
+
+  return res;
+}
+
+static void
+fake_ns_timespec (int64_t ns, struct timespec *ts)
+{
+  ts->tv_sec = ns / NS_PER_SEC;
+  ts->tv_nsec = ns % NS_PER_SEC;
+  if (ts->tv_nsec < 0)
+    {
+      ts->tv_sec--;
+      ts->tv_nsec += NS_PER_SEC;
+    }
+}
+
+/* restart at base, must be called with fake_lock held */
+static void
+fake_reset (int64_t base, u_int64_t rate)
+{
+  int64_t real = real_now ();
+
+  __atomic_store_n (&fake.seq, fake.seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  fake.base = base;
+  fake.real_base = real;
+  fake.rate = rate;
+  __atomic_store_n (&fake.seq, fake.seq + 1, __ATOMIC_RELEASE);
+}
+
+static void
+fake_set (const struct timespec *ts)
+{
+  pthread_mutex_lock (&fake_lock);
+  fake_reset (ts->tv_sec * NS_PER_SEC + ts->tv_nsec, fake.rate);
+  pthread_mutex_unlock (&fake_lock);
+}
+
+static time_t
+fake_time (time_t *t)
+{
+  struct timespec ts;
+
+  fake_ns_timespec (fake_at (real_now ()), &ts);
+  if (t != NULL)
+    *t = ts.tv_sec;
+  return ts.tv_sec;
+}
+
+static int
+fake_clock_gettime (clockid_t clkid, struct timespec *ts)
+{
+  if (clkid != CLOCK_REALTIME && clkid != CLOCK_REALTIME_COARSE)
+    return real_gettime (clkid, ts);
+
+  fake_ns_timespec (fake_at (real_now ()), ts);
+  return 0;
+}
+
+static int
+fake_clock_settime (clockid_t clkid, const struct timespec *ts)
+{
+  if (clkid != CLOCK_REALTIME || ts->tv_nsec < 0 || ts->tv_nsec >= NS_PER_SEC)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  fake_set (ts);
+  return 0;
+}
+
+static int
+fake_gettimeofday (struct timeval *tv, struct timezone *tz)
+{
+  struct timespec ts;
+
+  if (tz != NULL)
+    real_gettimeofday (NULL, tz);
+  if (tv != NULL)
+    {
+      fake_ns_timespec (fake_at (real_now ()), &ts);
+      tv->tv_sec = ts.tv_sec;
+      tv->tv_usec = ts.tv_nsec / 1000;
+    }
+  return 0;
+}
+
+static int
+fake_settimeofday (const struct timeval *tv, const struct timezone *tz __attribute__ ((unused)))
+{
+  struct timespec ts;
+
+  if (tv == NULL)
+    return 0;
+
+  ts.tv_sec = tv->tv_sec;
+  ts.tv_nsec = tv->tv_usec * 1000;
+  return fake_clock_settime (CLOCK_REALTIME, &ts);
+}
+
+/* a synchronized clock, which can only be stepped (by ADJ_SETOFFSET) */
+static int
+fake_adjtimex (struct timex *buf)
+{
+  struct timespec ts;
+  int64_t offset;
+
+  if (buf->modes & ADJ_SETOFFSET)
+    {
+      offset = buf->time.tv_sec * NS_PER_SEC
+               + buf->time.tv_usec * (buf->modes & ADJ_NANO ? 1 : 1000);
+      t2p_fake_clock_step (offset);
+    }
+
+  fake_ns_timespec (fake_at (real_now ()), &ts);
+  memset (buf, 0, sizeof (struct timex));
+  buf->time.tv_sec = ts.tv_sec;
+  buf->time.tv_usec = ts.tv_nsec / 1000;
+  buf->tick = 10000;
+  buf->precision = 1;
+  buf->tolerance = 32768000;
+  return TIME_OK;
+}
+
+static int
+fake_clock_adjtime (clockid_t clkid, struct timex *buf)
+{
+  if (clkid == CLOCK_REALTIME)
+    return fake_adjtimex (buf);
+  return real_clock_adjtime (clkid, buf);
+}
+
+static int
+fake_ntp_gettime (struct ntptimeval *buf)
+{
+  struct timespec ts;
+
+  fake_ns_timespec (fake_at (real_now ()), &ts);
+  memset (buf, 0, sizeof (struct ntptimeval));
+  buf->time.tv_sec = ts.tv_sec;
+  buf->time.tv_usec = ts.tv_nsec / 1000;
+  return TIME_OK;
+}
+
+/* move a timestamp of the real clock to the fake one */
+void
+t2p_fake_clock_map (struct timespec *ts)
+{
+  fake_ns_timespec (fake_at (ts->tv_sec * NS_PER_SEC + ts->tv_nsec), ts);
+}
+
+/* move a time of the fake clock to the real one (standing still, as if
+   it ran at the real rate) */
+void
+t2p_fake_clock_unmap (struct timespec *ts)
+{
+  int64_t res, t = ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+  u_int64_t rate;
+  unsigned seq;
+
+  do
+    {
+      seq = __atomic_load_n (&fake.seq, __ATOMIC_ACQUIRE);
+      rate = fake.rate ? fake.rate : 1ULL << 32;
+      res = fake.real_base + (int64_t) (((__int128) (t - fake.base) << 32) / rate);
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+  while ((seq & 1) || seq != __atomic_load_n (&fake.seq, __ATOMIC_RELAXED));
+
+  fake_ns_timespec (res, ts);
+}
+
+/* replace the original functions, must be called with fake_lock held */
+static void
+fake_install (void)
+{
+  if (t2p_fake_clock)
+    return;
+
+  real_vdso_clock_gettime = t2p_vdso_clock_gettime;
+  real_clock_gettime = t2p_orig_clock_gettime;
+  real_gettimeofday = t2p_orig_gettimeofday;
+  real_clock_adjtime = t2p_orig_clock_adjtime;
+
+  t2p_orig_time = fake_time;
+  t2p_orig_stime = NULL;
+  t2p_orig_clock_gettime = fake_clock_gettime;
+  t2p_orig_clock_settime = fake_clock_settime;
+  t2p_orig_clock_adjtime = fake_clock_adjtime;
+  t2p_orig_gettimeofday = fake_gettimeofday;
+  t2p_orig_settimeofday = fake_settimeofday;
+  t2p_orig_adjtimex = fake_adjtimex;
+  t2p_orig_ntp_adjtime = fake_adjtimex;
+  t2p_orig_ntp_gettime = fake_ntp_gettime;
+
+  t2p_vdso_time = NULL;
+  t2p_vdso_clock_gettime = NULL;
+  t2p_vdso_gettimeofday = NULL;
+
+  __atomic_store_n (&t2p_fake_clock, 1, __ATOMIC_RELEASE);
+}
+
+/* Start the fake clock at right, running rate times as fast as the real
+   one.  The first call switches the clock functions, it should be made
+   before other threads read the clock.  */
+int
+t2p_fake_clock_set (const struct timespec *right, double rate)
+{
+  if (right->tv_nsec < 0 || right->tv_nsec >= NS_PER_SEC || rate < 0 || rate > 1e9)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  T2P_BIND ();
+  pthread_mutex_lock (&fake_lock);
+  fake_install ();
+  fake_reset (right->tv_sec * NS_PER_SEC + right->tv_nsec, (u_int64_t) (rate * 4294967296.0));
+  pthread_mutex_unlock (&fake_lock);
+  return 0;
+}
+
+/* move the fake clock by ns */
+void
+t2p_fake_clock_step (int64_t ns)
+{
+  pthread_mutex_lock (&fake_lock);
+  if (t2p_fake_clock)
+    fake_reset (fake_at (real_now ()) + ns, fake.rate);
+  pthread_mutex_unlock (&fake_lock);
+}
+
+/* called once, when the original functions are bound */
+void
+t2p_fake_clock_init (void)
+{
+  const char *env = secure_getenv ("T2P_FAKE_CLOCK");
+  struct timespec ts;
+  double rate = 1, frac = 0;
+  char *end;
+
+  if (env == NULL || *env == '\0')
+    return;
+
+  ts.tv_sec = strtoll (env, &end, 10);
+  if (*end == '.')
+    frac = strtod (end, &end);
+  if (*end == 'x')
+    rate = strtod (end + 1, &end);
+  ts.tv_nsec = frac * NS_PER_SEC;
+
+  if (end == env || *end != '\0' || rate < 0 || rate > 1e9)
+    {
+      fprintf (stderr, "time2posix warning: Invalid T2P_FAKE_CLOCK %s, using the real clock!\n", env);
+      return;
+    }
+
+  pthread_mutex_lock (&fake_lock);
+  fake_install ();
+  fake_reset (ts.tv_sec * NS_PER_SEC + ts.tv_nsec, (u_int64_t) (rate * 4294967296.0));
+  pthread_mutex_unlock (&fake_lock);
+}
@@ -0,0 +1,178 @@
+/* This file is in public domain */
+
+/* The kernel as a source of the offset (T2P_OFFSET=kernel).  The time
+   daemons keep the TAI - UTC offset in the kernel (ADJ_TAI), and those
+   which let the kernel handle the leap seconds announce them there
+   (STA_INS, STA_DEL) on the day they happen.  The writers read both
+   every KERNEL_POLL seconds and adjust the table read from the files
+   to them: an announced leap second is added at the next midnight
+   (and kept until the files have it), and if the offset disagrees
+   with the table, the missing leap second is added at the last
+   midnight, or else the table is replaced by the offset alone (right
+   for the current span only, but that is where the clock reads).  */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "time2posix.h"
+
+/* TAI - UTC when right and posix time were the same (1972) */
+#define TAI_BASE 10
+
+/* the daemons set the offset some time after the leap second, the
+   table is trusted until then */
+#define KERNEL_LAG 86400
+
+static int kernel_on = -1;
+
+/* the kernel state the table was last adjusted to */
+static int kernel_tai = -1;
+static int kernel_status = -1;
+
+/* the leap second announced by the kernel, until the files have it */
+static time_t kernel_leap;
+static int kernel_leap_change;
+
+static int kernel_warned = 0;
+
+int
+t2p_kernel_on (void)
+{
+  const char *env;
+
+  if (kernel_on < 0)
+    {
+      env = secure_getenv ("T2P_OFFSET");
+      kernel_on = env != NULL && !strcmp (env, "kernel");
+      if (env != NULL && !kernel_on && strcmp (env, "table"))
+        fprintf (stderr, "time2posix warning: Unknown T2P_OFFSET source %s, using the table!\n", env);
+    }
+  return kernel_on;
+}
+
+static int
+kernel_read (int *tai, int *status)
+{
+  struct timex tx;
+
+  T2P_BIND ();
+  memset (&tx, 0, sizeof tx);
+  if (t2p_orig_adjtimex (&tx) < 0)
+    return -1;
+
+  *tai = tx.tai;
+  *status = tx.status & (STA_INS | STA_DEL);
+  return 0;
+}
+
+/* whether the kernel state changed since the table was adjusted */
+int
+t2p_kernel_changed (void)
+{
+  int tai, status;
+
+  if (kernel_read (&tai, &status))
+    return 0;
+  return tai != kernel_tai || status != kernel_status;
+}
+
+/* the change at right time now */
+static int
+leaps_change (const struct t2p_leaps *leaps, time_t now)
+{
+  size_t i;
+
+  for (i = 0; i < leaps->num && leaps->transition[i] <= now; i++)
+    ;
+  return i ? leaps->change[i-1] : 0;
+}
+
+/* add a leap second at the posix midnight, after which the change is
+   change, returns -1 if it does not follow the last one */
+static int
+leaps_append (struct t2p_leaps *leaps, time_t midnight, int change)
+{
+  int prev = leaps->num ? leaps->change[leaps->num-1] : 0;
+  time_t transition = midnight + prev - (change < prev);
+
+  if (leaps->num == T2P_LEAPS_MAX || (change != prev + 1 && change != prev - 1)
+      || (leaps->num && transition <= leaps->transition[leaps->num-1]))
+    return -1;
+
+  leaps->transition[leaps->num] = transition;
+  leaps->change[leaps->num] = change;
+  leaps->num++;
+  return 0;
+}
+
+static void
+kernel_warn (int change, int table)
+{
+  if (!kernel_warned)
+    fprintf (stderr, "time2posix warning: The kernel TAI offset (%d) disagrees with the leap seconds table (%d), using the kernel's!\n",
+             change + TAI_BASE, table + TAI_BASE);
+  kernel_warned = 1;
+}
+
+/* adjust the table to the kernel at right time now */
+void
+t2p_kernel_apply (struct t2p_leaps *leaps, time_t now)
+{
+  int tai, status, change, table;
+  time_t last;
+
+  if (kernel_read (&tai, &status))
+    return;
+  kernel_tai = tai;
+  kernel_status = status;
+
+  table = leaps_change (leaps, now);
+  last = leaps->num ? leaps->transition[leaps->num-1] : 0;
+
+  /* announced for the end of today, if the table has nothing to come */
+  if (status && (leaps->num == 0 || last <= now))
+    {
+      kernel_leap_change = table + (status & STA_INS ? 1 : -1);
+      kernel_leap = ((now - table) / 86400 + 1) * 86400;
+    }
+
+  if (kernel_leap)
+    {
+      if (leaps->num && last >= kernel_leap + table - 1)
+        kernel_leap = 0;
+      else
+        leaps_append (leaps, kernel_leap, kernel_leap_change);
+      table = leaps_change (leaps, now);
+      last = leaps->num ? leaps->transition[leaps->num-1] : 0;
+    }
+
+  /* (not set by any daemon) */
+  if (tai < TAI_BASE)
+    return;
+
+  change = tai - TAI_BASE;
+  if (change == table)
+    return;
+
+  /* the daemon has not caught up with the last one yet */
+  if (leaps->num && last <= now && now - last < KERNEL_LAG
+      && change == (leaps->num > 1 ? leaps->change[leaps->num-2] : 0))
+    return;
+
+  kernel_warn (change, table);
+
+  /* missed, at the last midnight */
+  if (leaps->num && last <= now
+      && !leaps_append (leaps, (now - change) / 86400 * 86400, change))
+    return;
+
+  memset (leaps, 0, sizeof (struct t2p_leaps));
+  if (change)
+    {
+      leaps->num = 1;
+      leaps->change[0] = change;
+    }
+}
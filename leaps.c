@@ -0,0 +1,477 @@
+/* This file is in public domain */
+
+/* The leap seconds sources.  The table is read from the file in
+   T2P_LEAPS, or else from the first of LEAPS_SOURCES which has one,
+   each either a TZif file (any version, the 64-bit data of version 2
+   and later is preferred) or an IETF leap-seconds.list.  The binary
+   cache (see t2p_leaps -c) stands in for the file it was made from for
+   as long as that is not changed, so the table is not parsed then.
+   This file does not depend on the rest of the library, t2p_leaps is
+   built from it before the library to generate the embedded table.  */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#include "time2posix.h"
+
+/* no leap seconds file is bigger */
+#define LEAPS_FILE_MAX (1 << 20)
+
+/* seconds from the NTP epoch (1900) to the posix one */
+#define NTP_EPOCH_OFFSET 2208988800LL
+
+#define CACHE_MAGIC "T2PLEAP1"
+
+static const char *const leaps_sources[] =
+{
+  "/usr/share/zoneinfo-leaps/UTC",
+  "/usr/share/zoneinfo/right/UTC",
+  "/usr/share/zoneinfo/leap-seconds.list",
+  NULL
+};
+
+/* the cache file, native endian (it is only read on the same host) */
+struct leaps_cache
+{
+  char magic[8];
+  u_int32_t size;
+  u_int32_t num;
+  int64_t expires;
+
+  /* the file the table was read from, as it was then */
+  char source[256];
+  struct t2p_leaps_stat st;
+
+  struct
+  {
+    int64_t transition;
+    int32_t change;
+    int32_t pad;
+  } leaps[T2P_LEAPS_MAX];
+};
+
+/* the file in T2P_LEAPS (in one), or else the default ones */
+static const char *const *
+leaps_paths (const char **one)
+{
+  one[0] = secure_getenv ("T2P_LEAPS");
+  one[1] = NULL;
+  return one[0] != NULL && *one[0] ? one : leaps_sources;
+}
+
+static u_int32_t
+get32 (const unsigned char *p)
+{
+  return (u_int32_t) p[0] << 24 | (u_int32_t) p[1] << 16 | (u_int32_t) p[2] << 8 | p[3];
+}
+
+static u_int64_t
+get64 (const unsigned char *p)
+{
+  return (u_int64_t) get32 (p) << 32 | get32 (p + 4);
+}
+
+/* add a leap second to the table, after which the total change is
+   change (which must differ by one from the previous) */
+static const char *
+leaps_add (struct t2p_leaps *leaps, time_t transition, int change)
+{
+  int prev = leaps->num ? leaps->change[leaps->num-1] : 0;
+
+  if (change != prev + 1 && change != prev - 1)
+    return "Invalid leap second in";
+  if (leaps->num && transition <= leaps->transition[leaps->num-1])
+    return "Unordered leap seconds in";
+  if (leaps->num == T2P_LEAPS_MAX)
+    return "Too many leap seconds in";
+
+  leaps->transition[leaps->num] = transition;
+  leaps->change[leaps->num] = change;
+  leaps->num++;
+  return NULL;
+}
+
+static const char *
+parse_tzif (const unsigned char *buf, size_t size, struct t2p_leaps *leaps)
+{
+  u_int64_t isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt, off, i;
+  size_t tsize = 4;
+  const unsigned char *rec;
+  const char *err;
+  int64_t transition;
+  int32_t change;
+
+  if (size < 44)
+    return "Truncated";
+
+  /* version 2 and later repeat the data with 64-bit times after the
+     32-bit ones (which may be empty) */
+  if (buf[4] >= '2')
+    {
+      off = 44 + get32 (buf + 32) * 5ULL + get32 (buf + 36) * 6ULL + get32 (buf + 40)
+            + get32 (buf + 28) * 8ULL + get32 (buf + 24) + get32 (buf + 20);
+      if (off + 44 > size || memcmp (buf + off, "TZif", 4))
+        return "Invalid header of";
+      buf += off;
+      size -= off;
+      tsize = 8;
+    }
+
+  isutcnt = get32 (buf + 20);
+  isstdcnt = get32 (buf + 24);
+  leapcnt = get32 (buf + 28);
+  timecnt = get32 (buf + 32);
+  typecnt = get32 (buf + 36);
+  charcnt = get32 (buf + 40);
+
+  off = 44 + timecnt * (tsize + 1) + typecnt * 6 + charcnt;
+  if (off + leapcnt * (tsize + 4) + isstdcnt + isutcnt > size)
+    return "Truncated";
+
+  for (i = 0, rec = buf + off; i < leapcnt; i++, rec += tsize + 4)
+    {
+      transition = tsize == 8 ? (int64_t) get64 (rec) : (int32_t) get32 (rec);
+      change = get32 (rec + tsize);
+
+      /* (version 4: the last one repeating the change is the expiry) */
+      if (i == leapcnt - 1 && i > 0 && change == leaps->change[leaps->num-1])
+        {
+          leaps->expires = transition - change;
+          break;
+        }
+
+      err = leaps_add (leaps, transition, change);
+      if (err != NULL)
+        return err;
+    }
+
+  return NULL;
+}
+
+/* the number at *p, which is moved after it */
+static int
+parse_number (const unsigned char **p, const unsigned char *end, int64_t *res)
+{
+  const unsigned char *s = *p;
+
+  while (s < end && (*s == ' ' || *s == '\t'))
+    s++;
+  if (s == end || *s < '0' || *s > '9')
+    return -1;
+
+  for (*res = 0; s < end && *s >= '0' && *s <= '9' && *res < (1LL << 40); s++)
+    *res = *res * 10 + (*s - '0');
+
+  *p = s;
+  return 0;
+}
+
+/* the lines are "<NTP time> <TAI - UTC>" from the start of the day after
+   the leap second, the first one (1972) is no leap second */
+static const char *
+parse_list (const unsigned char *buf, size_t size, struct t2p_leaps *leaps)
+{
+  const unsigned char *p = buf, *end = buf + size, *eol;
+  int64_t ntp, tai, base = -1;
+  time_t midnight;
+  int change, prev;
+  const char *err;
+
+  for (; p < end; p = eol + 1)
+    {
+      eol = memchr (p, '\n', end - p);
+      if (eol == NULL)
+        eol = end;
+
+      if (eol - p > 2 && p[0] == '#' && p[1] == '@')
+        {
+          p += 2;
+          if (parse_number (&p, eol, &ntp))
+            return "Invalid expiry in";
+          leaps->expires = ntp - NTP_EPOCH_OFFSET;
+          continue;
+        }
+
+      if (p == eol || *p == '#')
+        continue;
+
+      if (parse_number (&p, eol, &ntp) || parse_number (&p, eol, &tai))
+        return "Invalid line in";
+
+      if (base < 0)
+        {
+          base = tai;
+          continue;
+        }
+
+      change = tai - base;
+      prev = leaps->num ? leaps->change[leaps->num-1] : 0;
+      if (change == prev)
+        continue;
+
+      midnight = ntp - NTP_EPOCH_OFFSET;
+      err = leaps_add (leaps, midnight + prev - (change < prev), change);
+      if (err != NULL)
+        return err;
+    }
+
+  return NULL;
+}
+
+/* Parse a TZif file or a leap-seconds.list of size bytes.  Returns NULL
+   or the reason why it failed (to be followed by the file name).  */
+const char *
+t2p_leaps_parse (const char *buf, size_t size, struct t2p_leaps *leaps)
+{
+  const char *err;
+
+  memset (leaps, 0, sizeof (struct t2p_leaps));
+
+  if (size >= 4 && !memcmp (buf, "TZif", 4))
+    err = parse_tzif ((const unsigned char *) buf, size, leaps);
+  else
+    err = parse_list ((const unsigned char *) buf, size, leaps);
+
+  if (err == NULL && leaps->num == 0)
+    err = "No leap seconds in";
+  return err;
+}
+
+/* statx by the system call, the wrappers of the library would convert
+   the times, and so read the table being read */
+static int
+leaps_stat (int fd, const char *path, int flags, struct t2p_leaps_stat *st)
+{
+  struct statx stx;
+
+  if (syscall (SYS_statx, fd, path, flags, STATX_BASIC_STATS, &stx))
+    return -1;
+  if (!S_ISREG (stx.stx_mode))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  st->dev = makedev (stx.stx_dev_major, stx.stx_dev_minor);
+  st->ino = stx.stx_ino;
+  st->size = stx.stx_size;
+  st->mtime_sec = stx.stx_mtime.tv_sec;
+  st->mtime_nsec = stx.stx_mtime.tv_nsec;
+  return 0;
+}
+
+static const char *
+leaps_read_file (const char *path, struct t2p_leaps *leaps, struct t2p_leaps_stat *st)
+{
+  const char *err;
+  void *buf;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+    return "Cannot open";
+
+  if (leaps_stat (fd, "", AT_EMPTY_PATH, st))
+    {
+      close (fd);
+      return "Cannot read";
+    }
+  if (st->size == 0 || st->size > LEAPS_FILE_MAX)
+    {
+      close (fd);
+      return "Invalid size of";
+    }
+
+  buf = mmap (NULL, st->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (buf == MAP_FAILED)
+    return "Cannot mmap";
+
+  err = t2p_leaps_parse (buf, st->size, leaps);
+  munmap (buf, st->size);
+  return err;
+}
+
+static const char *
+leaps_cache_path (void)
+{
+  const char *path = secure_getenv ("T2P_LEAPS_CACHE");
+
+  return path != NULL && *path ? path : T2P_LEAPS_CACHE_FILE;
+}
+
+/* read the cache, if it was made from path as it is now */
+static int
+leaps_read_cache (const char *path, const struct t2p_leaps_stat *st, struct t2p_leaps *leaps)
+{
+  struct leaps_cache cache;
+  size_t i;
+  int fd;
+
+  fd = open (leaps_cache_path (), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  i = read (fd, &cache, sizeof cache);
+  close (fd);
+
+  if (i != sizeof cache || memcmp (cache.magic, CACHE_MAGIC, 8)
+      || cache.size != sizeof cache || cache.num == 0 || cache.num > T2P_LEAPS_MAX
+      || strncmp (cache.source, path, sizeof (cache.source))
+      || memcmp (&cache.st, st, sizeof (struct t2p_leaps_stat)))
+    return -1;
+
+  leaps->num = cache.num;
+  leaps->expires = cache.expires;
+  for (i = 0; i < cache.num; i++)
+    {
+      leaps->transition[i] = cache.leaps[i].transition;
+      leaps->change[i] = cache.leaps[i].change;
+    }
+  return 0;
+}
+
+/* Read the table from the sources, through the cache if use_cache.
+   Returns 0, or -1 and the reason in src (of the last file tried).  */
+int
+t2p_leaps_load (struct t2p_leaps *leaps, struct t2p_leaps_source *src, int use_cache)
+{
+  const char *one[2];
+  const char *const *path;
+
+  src->path = leaps_sources[0];
+  src->error = "Cannot open";
+  src->cached = 0;
+
+  for (path = leaps_paths (one); *path != NULL; path++)
+    {
+      src->path = *path;
+      if (leaps_stat (AT_FDCWD, *path, 0, &src->st))
+        {
+          src->error = "Cannot open";
+          continue;
+        }
+
+      if (use_cache && !leaps_read_cache (*path, &src->st, leaps))
+        {
+          src->cached = 1;
+          return 0;
+        }
+
+      src->error = leaps_read_file (*path, leaps, &src->st);
+      if (src->error == NULL)
+        return 0;
+    }
+
+  return -1;
+}
+
+/* write the table read from src to the cache */
+int
+t2p_leaps_cache_write (const struct t2p_leaps *leaps, const struct t2p_leaps_source *src)
+{
+  const char *path = leaps_cache_path ();
+  struct leaps_cache cache;
+  char tmp[PATH_MAX];
+  size_t i;
+  int fd;
+
+  if (strlen (src->path) >= sizeof (cache.source)
+      || snprintf (tmp, sizeof tmp, "%s.%d", path, (int) getpid ()) >= (int) sizeof tmp)
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+  memset (&cache, 0, sizeof cache);
+  memcpy (cache.magic, CACHE_MAGIC, 8);
+  cache.size = sizeof cache;
+  cache.num = leaps->num;
+  cache.expires = leaps->expires;
+  strcpy (cache.source, src->path);
+  cache.st = src->st;
+  for (i = 0; i < leaps->num; i++)
+    {
+      cache.leaps[i].transition = leaps->transition[i];
+      cache.leaps[i].change = leaps->change[i];
+    }
+
+  /* (the readers see the old one or the new one) */
+  fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  if (write (fd, &cache, sizeof cache) != sizeof cache || fsync (fd))
+    {
+      close (fd);
+      unlink (tmp);
+      return -1;
+    }
+  close (fd);
+
+  if (rename (tmp, path))
+    {
+      unlink (tmp);
+      return -1;
+    }
+  return 0;
+}
+
+/* watch the directories of the sources (the files are usually replaced
+   by rename), returns the number of directories watched */
+int
+t2p_leaps_watch_add (int fd)
+{
+  const char *one[2];
+  const char *const *path;
+  char dir[PATH_MAX];
+  const char *slash;
+  int n = 0;
+
+  for (path = leaps_paths (one); *path != NULL; path++)
+    {
+      slash = strrchr (*path, '/');
+      if (slash == NULL)
+        strcpy (dir, ".");
+      else if ((size_t) (slash - *path) < sizeof dir)
+        {
+          memcpy (dir, *path, slash - *path);
+          dir[slash - *path] = '\0';
+        }
+      else
+        continue;
+
+      if (inotify_add_watch (fd, *dir ? dir : "/", IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) >= 0)
+        n++;
+    }
+
+  return n;
+}
+
+/* whether a file named name in a watched directory may be a source */
+int
+t2p_leaps_watched (const char *name)
+{
+  const char *one[2];
+  const char *const *path;
+  const char *base;
+
+  for (path = leaps_paths (one); *path != NULL; path++)
+    {
+      base = strrchr (*path, '/');
+      if (!strcmp (base != NULL ? base + 1 : *path, name))
+        return 1;
+    }
+
+  return 0;
+}
@@ -0,0 +1,266 @@
+/* This file is in public domain */
+
+/* Tracks which sockets have timestamping enabled, so that the receive
+   wrappers walk the control messages only on those.  Sockets created
+   here start as known without timestamping, the timestamping options
+   and closing or replacing an fd make it unknown again, and unknown fds
+   (e.g. inherited ones) are asked with getsockopt on their first
+   receive.  An fd closed behind the wrappers (a raw close system call,
+   or within libc) keeps its state, but a socket which reuses its number
+   has to set one of the timestamping options to get timestamps, and
+   that is where it is asked again.  */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "time2posix.h"
+
+#define FD_BITS (4 * sizeof (unsigned long))
+
+unsigned long t2p_fd_state[T2P_FD_MAX / FD_BITS];
+
+int (*t2p_orig_socket) (int, int, int);
+int (*t2p_orig_socketpair) (int, int, int, int *);
+int (*t2p_orig_accept) (int, __SOCKADDR_ARG, socklen_t *);
+int (*t2p_orig_accept4) (int, __SOCKADDR_ARG, socklen_t *, int);
+int (*t2p_orig_setsockopt) (int, int, int, const void *, socklen_t);
+int (*t2p_orig_close) (int);
+int (*t2p_orig_dup) (int);
+int (*t2p_orig_dup2) (int, int);
+int (*t2p_orig_dup3) (int, int, int);
+int (*t2p_orig_fcntl) (int, int, ...);
+int (*t2p_orig_close_range) (unsigned int, unsigned int, int);
+void (*t2p_orig_closefrom) (int);
+
+/* a new socket has no timestamping */
+static inline void
+fd_new (int fd)
+{
+  if (fd >= 0)
+    t2p_fd_set_state (fd, T2P_FD_KNOWN);
+}
+
+static inline void
+fd_forget (int fd)
+{
+  if (fd >= 0)
+    t2p_fd_set_state (fd, 0);
+}
+
+static void
+fd_forget_range (unsigned int first, unsigned int last)
+{
+  unsigned int fd;
+
+  if (last >= T2P_FD_MAX)
+    last = T2P_FD_MAX - 1;
+
+  for (fd = first; fd <= last; )
+    if (fd % FD_BITS == 0 && last - fd >= FD_BITS - 1)
+      {
+        __atomic_store_n (&t2p_fd_state[fd / FD_BITS], 0, __ATOMIC_RELAXED);
+        fd += FD_BITS;
+      }
+    else
+      t2p_fd_set_state (fd++, 0);
+}
+
+static int
+sockopt_set (int fd, int name)
+{
+  int val = 0;
+  socklen_t len = sizeof (val);
+
+  return !getsockopt (fd, SOL_SOCKET, name, &val, &len) && val;
+}
+
+/* Called by t2p_fd_stamping for fds not known yet.  Every variant is
+   asked, the kernel reports each of them only if it was the one set.  */
+int
+t2p_fd_probe (int fd)
+{
+  int stamping;
+
+  stamping = sockopt_set (fd, SO_TIMESTAMP_OLD)
+             || sockopt_set (fd, SO_TIMESTAMPNS_OLD)
+             || sockopt_set (fd, SO_TIMESTAMPING_OLD)
+#ifdef SO_TIMESTAMP_NEW
+             || sockopt_set (fd, SO_TIMESTAMP_NEW)
+             || sockopt_set (fd, SO_TIMESTAMPNS_NEW)
+             || sockopt_set (fd, SO_TIMESTAMPING_NEW)
+#endif
+             ;
+
+  t2p_fd_set_state (fd, stamping ? T2P_FD_STAMPING : T2P_FD_KNOWN);
+  return stamping;
+}
+
+int
+socket (int domain, int type, int protocol)
+{
+  int fd;
+
+  T2P_BIND ();
+  fd = t2p_orig_socket (domain, type, protocol);
+  fd_new (fd);
+  return fd;
+}
+
+int
+socketpair (int domain, int type, int protocol, int sv[2])
+{
+  int res;
+
+  T2P_BIND ();
+  res = t2p_orig_socketpair (domain, type, protocol, sv);
+  if (res == 0)
+    {
+      fd_new (sv[0]);
+      fd_new (sv[1]);
+    }
+  return res;
+}
+
+/* (accepted sockets do inherit the timestamping options, so these are
+   asked again) */
+int
+accept (int fd, __SOCKADDR_ARG addr, socklen_t *len)
+{
+  int res;
+
+  T2P_BIND ();
+  res = t2p_orig_accept (fd, addr, len);
+  fd_forget (res);
+  return res;
+}
+
+int
+accept4 (int fd, __SOCKADDR_ARG addr, socklen_t *len, int flags)
+{
+  int res;
+
+  T2P_BIND ();
+  res = t2p_orig_accept4 (fd, addr, len, flags);
+  fd_forget (res);
+  return res;
+}
+
+int
+setsockopt (int fd, int level, int name, const void *val, socklen_t len)
+{
+  int res;
+
+  T2P_BIND ();
+  res = t2p_orig_setsockopt (fd, level, name, val, len);
+  if (res == 0 && level == SOL_SOCKET)
+    switch (name)
+      {
+      case SO_TIMESTAMP_OLD:
+      case SO_TIMESTAMPNS_OLD:
+      case SO_TIMESTAMPING_OLD:
+#ifdef SO_TIMESTAMP_NEW
+      case SO_TIMESTAMP_NEW:
+      case SO_TIMESTAMPNS_NEW:
+      case SO_TIMESTAMPING_NEW:
+#endif
+        /* (switching one of them off need not switch off the others) */
+        fd_forget (fd);
+        break;
+      }
+  return res;
+}
+
+int
+close (int fd)
+{
+  T2P_BIND ();
+  fd_forget (fd);
+  return t2p_orig_close (fd);
+}
+
+int
+close_range (unsigned int first, unsigned int last, int flags)
+{
+  int res;
+
+  T2P_BIND ();
+  if (t2p_orig_close_range == NULL)
+    {
+      errno = ENOSYS;
+      return -1;
+    }
+
+  res = t2p_orig_close_range (first, last, flags);
+#ifdef CLOSE_RANGE_CLOEXEC
+  if (flags & CLOSE_RANGE_CLOEXEC)
+    return res;
+#endif
+  if (res == 0)
+    fd_forget_range (first, last);
+  return res;
+}
+
+void
+closefrom (int fd)
+{
+  T2P_BIND ();
+  if (t2p_orig_closefrom != NULL)
+    t2p_orig_closefrom (fd);
+  if (fd >= 0)
+    fd_forget_range (fd, ~0U);
+}
+
+int
+dup (int fd)
+{
+  int res;
+
+  T2P_BIND ();
+  res = t2p_orig_dup (fd);
+  fd_forget (res);
+  return res;
+}
+
+int
+dup2 (int fd, int fd2)
+{
+  int res;
+
+  T2P_BIND ();
+  res = t2p_orig_dup2 (fd, fd2);
+  fd_forget (res);
+  return res;
+}
+
+int
+dup3 (int fd, int fd2, int flags)
+{
+  int res;
+
+  T2P_BIND ();
+  res = t2p_orig_dup3 (fd, fd2, flags);
+  fd_forget (res);
+  return res;
+}
+
+int
+fcntl (int fd, int cmd, ...)
+{
+  va_list ap;
+  void *arg;
+  int res;
+
+  va_start (ap, cmd);
+  arg = va_arg (ap, void *);
+  va_end (ap);
+
+  T2P_BIND ();
+  res = t2p_orig_fcntl (fd, cmd, arg);
+  if (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC)
+    fd_forget (res);
+  return res;
+}
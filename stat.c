@@ -0,0 +1,445 @@
+/* This file is in public domain */
+
+/* The file times, which the kernel keeps in right time as well.  A stat
+   converts all the timestamps it returns under one read of the table, and
+   those newer than the last leap second (in fact all of the current span)
+   are a single subtraction each.  They only load the table, the threads
+   which keep it up to date are started by the first clock read.  */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+
+#include "time2posix.h"
+
+int (*t2p_orig_stat) (const char *, struct stat *);
+int (*t2p_orig_fstat) (int, struct stat *);
+int (*t2p_orig_lstat) (const char *, struct stat *);
+int (*t2p_orig_fstatat) (int, const char *, struct stat *, int);
+int (*t2p_orig_stat64) (const char *, struct stat64 *);
+int (*t2p_orig_fstat64) (int, struct stat64 *);
+int (*t2p_orig_lstat64) (const char *, struct stat64 *);
+int (*t2p_orig_fstatat64) (int, const char *, struct stat64 *, int);
+int (*t2p_orig_statx) (int, const char *, int, unsigned int, struct statx *);
+
+int (*t2p_orig___xstat) (int, const char *, struct stat *);
+int (*t2p_orig___fxstat) (int, int, struct stat *);
+int (*t2p_orig___lxstat) (int, const char *, struct stat *);
+int (*t2p_orig___fxstatat) (int, int, const char *, struct stat *, int);
+int (*t2p_orig___xstat64) (int, const char *, struct stat64 *);
+int (*t2p_orig___fxstat64) (int, int, struct stat64 *);
+int (*t2p_orig___lxstat64) (int, const char *, struct stat64 *);
+int (*t2p_orig___fxstatat64) (int, int, const char *, struct stat64 *, int);
+
+int (*t2p_orig_utime) (const char *, const struct utimbuf *);
+int (*t2p_orig_utimes) (const char *, const struct timeval [2]);
+int (*t2p_orig_lutimes) (const char *, const struct timeval [2]);
+int (*t2p_orig_futimes) (int, const struct timeval [2]);
+int (*t2p_orig_futimesat) (int, const char *, const struct timeval [2]);
+int (*t2p_orig_utimensat) (int, const char *, const struct timespec [2], int);
+int (*t2p_orig_futimens) (int, const struct timespec [2]);
+
+/* (newer headers do not declare these anymore) */
+int __xstat (int, const char *, struct stat *);
+int __fxstat (int, int, struct stat *);
+int __lxstat (int, const char *, struct stat *);
+int __fxstatat (int, int, const char *, struct stat *, int);
+int __xstat64 (int, const char *, struct stat64 *);
+int __fxstat64 (int, int, struct stat64 *);
+int __lxstat64 (int, const char *, struct stat64 *);
+int __fxstatat64 (int, int, const char *, struct stat64 *, int);
+
+/* convert the times of a successful stat */
+#define stat_times(res, buf)						\
+  do									\
+    {									\
+      if ((res) == 0)							\
+        {								\
+          struct timespec *const ts[] =					\
+            { &(buf)->st_atim, &(buf)->st_mtim, &(buf)->st_ctim };	\
+          t2p_time2posix_timespecs (ts, 3);				\
+        }								\
+    }									\
+  while (0)
+
+/* a missing original function (statx or the old ones, depending on libc) */
+#define stat_missing(fn)						\
+  do									\
+    {									\
+      if (fn == NULL)							\
+        {								\
+          errno = ENOSYS;						\
+          return -1;							\
+        }								\
+    }									\
+  while (0)
+
+int
+stat (const char *path, struct stat *buf)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  res = t2p_orig_stat (path, buf);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+fstat (int fd, struct stat *buf)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  res = t2p_orig_fstat (fd, buf);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+lstat (const char *path, struct stat *buf)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  res = t2p_orig_lstat (path, buf);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+fstatat (int dirfd, const char *path, struct stat *buf, int flags)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  res = t2p_orig_fstatat (dirfd, path, buf, flags);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+stat64 (const char *path, struct stat64 *buf)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  res = t2p_orig_stat64 (path, buf);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+fstat64 (int fd, struct stat64 *buf)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  res = t2p_orig_fstat64 (fd, buf);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+lstat64 (const char *path, struct stat64 *buf)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  res = t2p_orig_lstat64 (path, buf);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+fstatat64 (int dirfd, const char *path, struct stat64 *buf, int flags)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  res = t2p_orig_fstatat64 (dirfd, path, buf, flags);
+  stat_times (res, buf);
+  return res;
+}
+
+#ifdef STATX_TYPE
+/* only the times the kernel filled in */
+int
+statx (int dirfd, const char *path, int flags, unsigned int mask, struct statx *buf)
+{
+  struct statx_timestamp *const stx[] =
+    { &buf->stx_atime, &buf->stx_mtime, &buf->stx_ctime, &buf->stx_btime };
+  const unsigned int bits[] = { STATX_ATIME, STATX_MTIME, STATX_CTIME, STATX_BTIME };
+  struct timespec times[T2P_STAMPS_MAX], *ts[T2P_STAMPS_MAX];
+  size_t i, n;
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (statx);
+  stat_missing (t2p_orig_statx);
+  res = t2p_orig_statx (dirfd, path, flags, mask, buf);
+  if (res != 0)
+    return res;
+
+  for (i = 0, n = 0; i < T2P_STAMPS_MAX; i++)
+    if (buf->stx_mask & bits[i])
+      {
+        times[n].tv_sec = stx[i]->tv_sec;
+        times[n].tv_nsec = stx[i]->tv_nsec;
+        ts[n] = &times[n];
+        n++;
+      }
+  t2p_time2posix_timespecs (ts, n);
+
+  for (i = 0, n = 0; i < T2P_STAMPS_MAX; i++)
+    if (buf->stx_mask & bits[i])
+      {
+        stx[i]->tv_sec = times[n].tv_sec;
+        stx[i]->tv_nsec = times[n++].tv_nsec;
+      }
+
+  return res;
+}
+#endif
+
+int
+__xstat (int ver, const char *path, struct stat *buf)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  stat_missing (t2p_orig___xstat);
+  res = t2p_orig___xstat (ver, path, buf);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+__fxstat (int ver, int fd, struct stat *buf)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  stat_missing (t2p_orig___fxstat);
+  res = t2p_orig___fxstat (ver, fd, buf);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+__lxstat (int ver, const char *path, struct stat *buf)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  stat_missing (t2p_orig___lxstat);
+  res = t2p_orig___lxstat (ver, path, buf);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+__fxstatat (int ver, int dirfd, const char *path, struct stat *buf, int flags)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  stat_missing (t2p_orig___fxstatat);
+  res = t2p_orig___fxstatat (ver, dirfd, path, buf, flags);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+__xstat64 (int ver, const char *path, struct stat64 *buf)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  stat_missing (t2p_orig___xstat64);
+  res = t2p_orig___xstat64 (ver, path, buf);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+__fxstat64 (int ver, int fd, struct stat64 *buf)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  stat_missing (t2p_orig___fxstat64);
+  res = t2p_orig___fxstat64 (ver, fd, buf);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+__lxstat64 (int ver, const char *path, struct stat64 *buf)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  stat_missing (t2p_orig___lxstat64);
+  res = t2p_orig___lxstat64 (ver, path, buf);
+  stat_times (res, buf);
+  return res;
+}
+
+int
+__fxstatat64 (int ver, int dirfd, const char *path, struct stat64 *buf, int flags)
+{
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (stat);
+  stat_missing (t2p_orig___fxstatat64);
+  res = t2p_orig___fxstatat64 (ver, dirfd, path, buf, flags);
+  stat_times (res, buf);
+  return res;
+}
+
+/* The times to set, converted to right time, NULL stays NULL (the current
+   time) and UTIME_NOW and UTIME_OMIT stay as they are.  */
+static const struct timespec *
+set_times_ts (struct timespec *dst, const struct timespec *src)
+{
+  struct timespec *ts[2];
+  size_t i, n;
+
+  if (src == NULL)
+    return NULL;
+
+  for (i = 0, n = 0; i < 2; i++)
+    {
+      dst[i] = src[i];
+      if (src[i].tv_nsec != UTIME_NOW && src[i].tv_nsec != UTIME_OMIT)
+        ts[n++] = &dst[i];
+    }
+  t2p_posix2time_timespecs (ts, n);
+
+  return dst;
+}
+
+/* (through timespecs, which come out the same in whole microseconds) */
+static const struct timeval *
+set_times_tv (struct timeval *dst, const struct timeval *src)
+{
+  struct timespec myts[2];
+  struct timespec *ts[2] = { &myts[0], &myts[1] };
+  size_t i;
+
+  if (src == NULL)
+    return NULL;
+
+  for (i = 0; i < 2; i++)
+    {
+      myts[i].tv_sec = src[i].tv_sec;
+      myts[i].tv_nsec = src[i].tv_usec * 1000;
+    }
+  t2p_posix2time_timespecs (ts, 2);
+  for (i = 0; i < 2; i++)
+    {
+      dst[i].tv_sec = myts[i].tv_sec;
+      dst[i].tv_usec = myts[i].tv_nsec / 1000;
+    }
+
+  return dst;
+}
+
+int
+utime (const char *path, const struct utimbuf *times)
+{
+  struct utimbuf mytimes;
+  struct timespec myts[2];
+  struct timespec *ts[2] = { &myts[0], &myts[1] };
+
+  T2P_BIND ();
+  T2P_STAT (utimes);
+  if (times == NULL)
+    return t2p_orig_utime (path, times);
+
+  myts[0].tv_sec = times->actime;
+  myts[1].tv_sec = times->modtime;
+  myts[0].tv_nsec = myts[1].tv_nsec = 0;
+  t2p_posix2time_timespecs (ts, 2);
+  mytimes.actime = myts[0].tv_sec;
+  mytimes.modtime = myts[1].tv_sec;
+  return t2p_orig_utime (path, &mytimes);
+}
+
+int
+utimes (const char *path, const struct timeval tv[2])
+{
+  struct timeval mytv[2];
+
+  T2P_BIND ();
+  T2P_STAT (utimes);
+  return t2p_orig_utimes (path, set_times_tv (mytv, tv));
+}
+
+int
+lutimes (const char *path, const struct timeval tv[2])
+{
+  struct timeval mytv[2];
+
+  T2P_BIND ();
+  T2P_STAT (utimes);
+  return t2p_orig_lutimes (path, set_times_tv (mytv, tv));
+}
+
+int
+futimes (int fd, const struct timeval tv[2])
+{
+  struct timeval mytv[2];
+
+  T2P_BIND ();
+  T2P_STAT (utimes);
+  return t2p_orig_futimes (fd, set_times_tv (mytv, tv));
+}
+
+int
+futimesat (int dirfd, const char *path, const struct timeval tv[2])
+{
+  struct timeval mytv[2];
+
+  T2P_BIND ();
+  T2P_STAT (utimes);
+  return t2p_orig_futimesat (dirfd, path, set_times_tv (mytv, tv));
+}
+
+int
+utimensat (int dirfd, const char *path, const struct timespec ts[2], int flags)
+{
+  struct timespec myts[2];
+
+  T2P_BIND ();
+  T2P_STAT (utimes);
+  return t2p_orig_utimensat (dirfd, path, set_times_ts (myts, ts), flags);
+}
+
+int
+futimens (int fd, const struct timespec ts[2])
+{
+  struct timespec myts[2];
+
+  T2P_BIND ();
+  T2P_STAT (utimes);
+  return t2p_orig_futimens (fd, set_times_ts (myts, ts));
+}
@@ -0,0 +1,161 @@
+/* This file is in public domain */
+
+/* The statistics counters (see T2P_STATS_FILE).  Off, every wrapper and
+   conversion only tests t2p_stats for NULL.  */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "time2posix.h"
+
+struct t2p_stats *t2p_stats = NULL;
+
+/* the shard of the thread (1-based, 0 until its first call) */
+static __thread int t2p_stats_shard __attribute__ ((tls_model ("initial-exec")));
+__thread int t2p_stat_fn __attribute__ ((tls_model ("initial-exec")));
+
+static unsigned t2p_stats_next_shard = 0;
+static int t2p_stats_keep = 0;
+static char t2p_stats_path[64];
+
+/* Create the file of this process, a new one (the directory is world
+   writable).  One left by an earlier process of ours with the same pid
+   is removed, anybody else's (or a link) is not followed.  (Through
+   statx, the stat wrappers would convert the times with the table.)  */
+static int
+stats_open (const char *path)
+{
+  struct statx stx;
+  int fd;
+
+  fd = open (path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+  if (fd >= 0 || errno != EEXIST)
+    return fd;
+
+  if (syscall (SYS_statx, AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_UID, &stx)
+      || !S_ISREG (stx.stx_mode) || stx.stx_uid != geteuid () || unlink (path))
+    return -1;
+
+  return open (path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+}
+
+/* create and map the file of this process */
+static struct t2p_stats *
+stats_create (void)
+{
+  struct t2p_stats *stats;
+  int fd;
+
+  snprintf (t2p_stats_path, sizeof (t2p_stats_path), "%s.%d", T2P_STATS_FILE, (int) getpid ());
+  fd = stats_open (t2p_stats_path);
+  if (fd < 0 || ftruncate (fd, sizeof (struct t2p_stats)))
+    {
+      fprintf (stderr, "time2posix warning: Cannot create %s, no statistics!\n", t2p_stats_path);
+      if (fd >= 0)
+        close (fd);
+      return NULL;
+    }
+
+  stats = mmap (NULL, sizeof (struct t2p_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (stats == MAP_FAILED)
+    {
+      unlink (t2p_stats_path);
+      return NULL;
+    }
+
+  stats->pid = getpid ();
+  stats->size = sizeof (struct t2p_stats);
+  __atomic_store_n (&stats->magic, T2P_STATS_MAGIC, __ATOMIC_RELEASE);
+  return stats;
+}
+
+static void
+stats_exit (void)
+{
+  if (t2p_stats != NULL && !t2p_stats_keep)
+    unlink (t2p_stats_path);
+}
+
+/* the child counts in a file of its own */
+static void
+stats_fork_child (void)
+{
+  struct t2p_stats *old = t2p_stats;
+
+  t2p_stats = stats_create ();
+  munmap (old, sizeof (struct t2p_stats));
+}
+
+/* called once, when the original functions are bound */
+void
+t2p_stats_init (void)
+{
+  const char *env = secure_getenv ("T2P_STATS");
+
+  if (env == NULL || *env == '\0')
+    return;
+
+  t2p_stats_keep = !strcmp (env, "keep");
+  t2p_stats = stats_create ();
+  if (t2p_stats == NULL)
+    return;
+
+  atexit (stats_exit);
+  pthread_atfork (NULL, NULL, stats_fork_child);
+}
+
+static inline struct t2p_stat_counters *
+stats_counters (int fn)
+{
+  if (__builtin_expect (t2p_stats_shard == 0, 0))
+    t2p_stats_shard = __atomic_fetch_add (&t2p_stats_next_shard, 1, __ATOMIC_RELAXED)
+                      % T2P_STATS_SHARDS + 1;
+  return &t2p_stats->shards[t2p_stats_shard - 1].fn[fn];
+}
+
+void
+t2p_stat_call (int fn)
+{
+  t2p_stat_fn = fn;
+  if (t2p_stats != NULL)
+    __atomic_fetch_add (&stats_counters (fn)->calls, 1, __ATOMIC_RELAXED);
+}
+
+u_int64_t
+t2p_stat_clock (void)
+{
+  struct timespec ts;
+
+  if (t2p_vdso_clock_gettime != NULL)
+    t2p_vdso_clock_gettime (CLOCK_MONOTONIC, &ts);
+  else
+    t2p_orig_clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* n conversions (leaps of them in leap seconds) which began at start */
+void
+t2p_stat_conversions (u_int64_t n, u_int64_t leaps, u_int64_t start)
+{
+  struct t2p_stat_counters *c;
+
+  /* (the statistics were turned on meanwhile) */
+  if (t2p_stats == NULL || start == 0)
+    return;
+
+  c = stats_counters (t2p_stat_fn);
+  __atomic_fetch_add (&c->conversions, n, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&c->leaps, leaps, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&c->ns, t2p_stat_clock () - start, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,242 @@
+/* This file is in public domain */
+
+/* Microbenchmarks of the interposed functions and of the conversions.
+
+   Run it once as is and once with time2posix.so preloaded (make bench).
+   Every result is printed as one tab separated line
+
+     name  mode  ns/call  calls/s
+
+   where mode is the first argument (plain or preload).  The raw libc and
+   vDSO clock readers are looked up directly, so they bypass the preload,
+   and the conversions are only measured if time2posix.so is loaded.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <utmpx.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "time2posix.h"
+
+/* approximate duration of one measurement in seconds */
+#define BENCH_TIME 0.2
+
+static const char *mode;
+static int (*raw_clock_gettime) (clockid_t, struct timespec *);
+static volatile long sink;
+
+static double
+now (void)
+{
+  struct timespec ts;
+  raw_clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+report (const char *name, long calls, double secs)
+{
+  printf ("%s\t%s\t%.2f\t%.0f\n", name, mode, secs * 1e9 / calls, calls / secs);
+  fflush (stdout);
+}
+
+/* Run body in batches of 1000 until BENCH_TIME has passed. */
+#define BENCH(name, body)					\
+  do								\
+    {								\
+      long calls = 0;						\
+      int j;							\
+      double start = now (), end;				\
+      do							\
+        {							\
+          for (j = 0; j < 1000; j++)				\
+            {							\
+              body;						\
+            }							\
+          calls += 1000;					\
+        }							\
+      while ((end = now ()) - start < BENCH_TIME);		\
+      report (name, calls, end - start);			\
+    }								\
+  while (0)
+
+static void
+bench_clocks (void)
+{
+  int (*vdso_clock_gettime) (clockid_t, struct timespec *) = NULL;
+  void *libc, *vdso;
+  struct timespec ts;
+  struct timeval tv;
+  struct ntptimeval ntv;
+  struct timex tx;
+
+  BENCH ("time", sink += time (NULL));
+  BENCH ("clock_gettime_realtime", clock_gettime (CLOCK_REALTIME, &ts); sink += ts.tv_nsec);
+  BENCH ("clock_gettime_realtime_coarse", clock_gettime (CLOCK_REALTIME_COARSE, &ts); sink += ts.tv_nsec);
+  BENCH ("clock_gettime_monotonic", clock_gettime (CLOCK_MONOTONIC, &ts); sink += ts.tv_nsec);
+  BENCH ("gettimeofday", gettimeofday (&tv, NULL); sink += tv.tv_usec);
+  BENCH ("ntp_gettime", ntp_gettime (&ntv); sink += ntv.time.tv_usec);
+  BENCH ("adjtimex", memset (&tx, 0, sizeof tx); sink += adjtimex (&tx));
+
+  libc = dlopen ("libc.so.6", RTLD_LAZY);
+  if (libc != NULL)
+    {
+      int (*libc_clock_gettime) (clockid_t, struct timespec *) = dlsym (libc, "clock_gettime");
+      time_t (*libc_time) (time_t *) = dlsym (libc, "time");
+
+      BENCH ("raw_libc_time", sink += libc_time (NULL));
+      BENCH ("raw_libc_clock_gettime_realtime", libc_clock_gettime (CLOCK_REALTIME, &ts); sink += ts.tv_nsec);
+    }
+
+  vdso = dlopen ("linux-vdso.so.1", RTLD_LAZY | RTLD_NOLOAD);
+  if (vdso != NULL)
+    vdso_clock_gettime = dlsym (vdso, "__vdso_clock_gettime");
+  if (vdso_clock_gettime != NULL)
+    BENCH ("raw_vdso_clock_gettime_realtime", vdso_clock_gettime (CLOCK_REALTIME, &ts); sink += ts.tv_nsec);
+}
+
+static void
+bench_recvmsg (void)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof addr;
+  char data, control[256];
+  struct iovec iov = { &data, 1 };
+  struct msghdr msg;
+  int fd, on = 1;
+
+  fd = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (fd < 0 || bind (fd, (struct sockaddr *) &addr, sizeof addr)
+      || getsockname (fd, (struct sockaddr *) &addr, &len)
+      || connect (fd, (struct sockaddr *) &addr, sizeof addr))
+    {
+      perror ("t2p_bench: socket");
+      return;
+    }
+
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+#define RECV								\
+  send (fd, "x", 1, 0);							\
+  msg.msg_control = control;						\
+  msg.msg_controllen = sizeof control;					\
+  sink += recvmsg (fd, &msg, 0)
+
+  BENCH ("send_recvmsg", RECV);
+  setsockopt (fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof on);
+  BENCH ("send_recvmsg_timestampns", RECV);
+  setsockopt (fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof on);
+  BENCH ("send_recvmsg_timestamp", RECV);
+
+#undef RECV
+  close (fd);
+}
+
+static void
+bench_utmp (void)
+{
+  struct utmpx *ut;
+
+  setutxent ();
+  BENCH ("getutxent",
+         if ((ut = getutxent ()) == NULL)
+           setutxent ();
+         else
+           sink += ut->ut_tv.tv_sec);
+  endutxent ();
+}
+
+static void
+bench_stat (void)
+{
+  struct stat st;
+  int fd = open ("/", O_RDONLY | O_CLOEXEC);
+
+  BENCH ("stat", stat ("/", &st); sink += st.st_mtim.tv_nsec);
+  if (fd >= 0)
+    BENCH ("fstat", fstat (fd, &st); sink += st.st_mtim.tv_nsec);
+  close (fd);
+}
+
+/* the conversions, if time2posix.so is loaded */
+static void
+bench_conversions (void)
+{
+  typeof (t2p_time2posix) *time2posix = dlsym (RTLD_DEFAULT, "t2p_time2posix");
+  typeof (t2p_posix2time) *posix2time = dlsym (RTLD_DEFAULT, "t2p_posix2time");
+  typeof (t2p_time2posix_timespec) *time2posix_ts = dlsym (RTLD_DEFAULT, "t2p_time2posix_timespec");
+  typeof (t2p_timestatus) *timestatus = dlsym (RTLD_DEFAULT, "t2p_timestatus");
+  typeof (t2p_time2posix_array) *time2posix_array = dlsym (RTLD_DEFAULT, "t2p_time2posix_array");
+  typeof (t2p_table_get) *table_get = dlsym (RTLD_DEFAULT, "t2p_table_get");
+  static time_t src[4096], dst[4096];
+  struct t2p_table tab;
+  struct timespec ts;
+  time_t cur, old, leap;
+  int state, i;
+
+  if (time2posix == NULL || table_get == NULL)
+    return;
+
+  table_get (&tab);
+  if (tab.num == 0)
+    return;
+
+  cur = tab.cache.right_start + 86400;
+  old = tab.leapsecs[tab.num / 2].transition + 86400;
+  leap = tab.leapsecs[tab.num - 1].transition;
+
+  BENCH ("t2p_time2posix_current", sink += time2posix (cur + (j & 1), &state));
+  BENCH ("t2p_time2posix_historical", sink += time2posix (old + (j & 1), &state));
+  BENCH ("t2p_time2posix_leap", sink += time2posix (leap + (j & 1), &state));
+  BENCH ("t2p_posix2time_current", sink += posix2time (cur + (j & 1), &state));
+  BENCH ("t2p_posix2time_historical", sink += posix2time (old + (j & 1), &state));
+  BENCH ("t2p_time2posix_timespec_leap",
+         ts.tv_sec = leap + (j & 1); ts.tv_nsec = j; time2posix_ts (&ts); sink += ts.tv_nsec);
+  BENCH ("t2p_timestatus_current", sink += timestatus (cur + (j & 1)));
+  BENCH ("t2p_timestatus_historical", sink += timestatus (old + (j & 1)));
+
+  /* per element */
+  for (i = 0; i < 4096; i++)
+    src[i] = cur + i;
+  {
+    long calls = 0;
+    double start = now (), end;
+    do
+      {
+        time2posix_array (dst, src, 4096, NULL);
+        calls += 4096;
+      }
+    while ((end = now ()) - start < BENCH_TIME);
+    report ("t2p_time2posix_array_current", calls, end - start);
+  }
+}
+
+int
+main (int argc, char **argv)
+{
+  void *libc = dlopen ("libc.so.6", RTLD_LAZY);
+
+  mode = argc > 1 ? argv[1] : "plain";
+  raw_clock_gettime = libc ? dlsym (libc, "clock_gettime") : NULL;
+  if (raw_clock_gettime == NULL)
+    raw_clock_gettime = clock_gettime;
+
+  printf ("# name\tmode\tns/call\tcalls/s\n");
+  bench_clocks ();
+  bench_recvmsg ();
+  bench_utmp ();
+  bench_stat ();
+  bench_conversions ();
+
+  exit (0);
+}
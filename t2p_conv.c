@@ -0,0 +1,759 @@
+/* This file is in public domain */
+
+/* Converts the epoch timestamps in text files (logs, CSV) between right
+   and posix time.
+
+   Usage: t2p_conv [-r] [-u s|ms|us|ns] [-c cols [-d delim] | -e regex]
+                   [-j threads] [-o output] [-v] [file...]
+
+   -r          convert posix to right time (default right to posix)
+   -u unit     the fields are epoch seconds (default), ms, us or ns,
+               optionally with a fraction up to the ns ("1341100823.250")
+   -c cols     convert these fields (1-based, comma separated, default 1),
+               separated by runs of blanks or by the character given with -d
+               (CSV fields may be quoted)
+   -e regex    convert every match of the extended regex, or of its first
+               subexpression if it has one, instead
+   -j threads  number of converting threads (default all online CPUs)
+   -o output   write there instead of to the standard output
+   -v          report the throughput of each file on the standard error
+
+   Fields which are no numbers are left as they are.  Regular files are
+   mapped, anything else (or -) is read as a stream.  The input is cut at
+   line ends into chunks, which the threads convert in parallel, each
+   chunk with one batch conversion (t2p_time2posix_timespec_array), and
+   the chunks are written in order as they are done.  Times in leap
+   seconds are converted as t2p_time2posix_timespec does.  The output may
+   not be one of the input files.  */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <regex.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "time2posix.h"
+
+#define NS_PER_SEC 1000000000LL
+
+/* input per chunk (a chunk ends at the first line end after that) */
+#define CHUNK (4 << 20)
+
+/* the longest number printed, sign, 20 digits, point and 9 digits */
+#define FIELD_MAX 32
+
+/* the highest column -c accepts */
+#define COLS_MAX 4096
+
+/* a number in a chunk: [start, end) with frac fraction digits */
+struct field
+{
+  size_t start, end;
+  int frac;
+};
+
+/* a chunk being converted, there are slots for 2 per thread */
+struct slot
+{
+  const char *in;
+  size_t len;
+
+  /* (stream input is read here) */
+  char *buf;
+  size_t bufcap;
+
+  char *out;
+  size_t outlen, outcap;
+
+  struct field *fields;
+  struct timespec *ts;
+  int *states;
+  size_t nfields, fieldcap, leaps;
+
+  int done;
+};
+
+/* the file being converted */
+struct job
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  /* mapped file, or stream fd */
+  const char *map;
+  size_t size, pos;
+  int fd;
+
+  /* the incomplete last line of the previous stream chunk */
+  char *carry;
+  size_t carrylen, carrycap;
+
+  struct slot *slots;
+  size_t nslots;
+
+  /* chunks handed out and written, their number after the end */
+  size_t next, written, end;
+  int eof, error;
+
+  size_t values, leaps;
+};
+
+static int reverse;
+static long long unit_ns = NS_PER_SEC;
+static int frac_max = 9;
+static unsigned char cols[COLS_MAX / 8 + 1];
+static int delim;
+static const char *pattern;
+static int nthreads;
+
+static const long long pow10[] =
+  { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+
+static void *
+xrealloc (void *ptr, size_t size)
+{
+  ptr = realloc (ptr, size);
+  if (ptr == NULL)
+    {
+      fprintf (stderr, "t2p_conv: Out of memory\n");
+      exit (1);
+    }
+  return ptr;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "Usage: t2p_conv [-r] [-u s|ms|us|ns] [-c cols [-d delim] | -e regex]\n"
+                   "                [-j threads] [-o output] [-v] [file...]\n");
+  exit (2);
+}
+
+/* Parse [p, end) as [-]digits[.digits] in the unit into ts.
+   Returns -1 if it is no number (or one with more than the ns).  */
+static int
+parse_value (const char *p, const char *end, struct timespec *ts, int *frac)
+{
+  unsigned long long v = 0, f = 0;
+  __int128 ns;
+  int neg = 0, digits = 0, fd = 0;
+
+  if (p < end && *p == '-')
+    {
+      neg = 1;
+      p++;
+    }
+
+  for (; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+      if (++digits > 19)
+        return -1;
+      v = v*10 + (*p - '0');
+    }
+  if (digits == 0)
+    return -1;
+
+  if (p < end && *p == '.')
+    {
+      for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+        {
+          if (++fd > frac_max)
+            return -1;
+          f = f*10 + (*p - '0');
+        }
+      if (fd == 0)
+        return -1;
+    }
+  if (p != end)
+    return -1;
+
+  ns = (__int128) v * unit_ns + f * (unit_ns / pow10[fd]);
+  if (neg)
+    ns = -ns;
+
+  ts->tv_sec = ns / NS_PER_SEC;
+  ts->tv_nsec = ns % NS_PER_SEC;
+  if (ts->tv_nsec < 0)
+    {
+      ts->tv_nsec += NS_PER_SEC;
+      ts->tv_sec--;
+    }
+  *frac = fd;
+  return 0;
+}
+
+/* print ts in the unit with frac fraction digits, returns the length */
+static size_t
+format_value (char *out, const struct timespec *ts, int frac)
+{
+  __int128 ns = (__int128) ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+  unsigned __int128 mag = ns < 0 ? -ns : ns;
+  unsigned long long ip = mag / unit_ns, rem = mag % unit_ns, f;
+  char tmp[24], *p = out;
+  int n = 0, i;
+
+  if (ns < 0)
+    *p++ = '-';
+
+  do
+    {
+      tmp[n++] = '0' + ip % 10;
+      ip /= 10;
+    }
+  while (ip);
+  while (n)
+    *p++ = tmp[--n];
+
+  if (frac)
+    {
+      *p++ = '.';
+      f = rem / (unit_ns / pow10[frac]);
+      for (i = frac - 1; i >= 0; i--, f /= 10)
+        p[i] = '0' + f % 10;
+      p += frac;
+    }
+
+  return p - out;
+}
+
+/* remember [start, end) of the chunk if it is a number */
+static void
+add_field (struct slot *s, size_t start, size_t end)
+{
+  struct field *f;
+
+  /* (quoted CSV fields) */
+  if (end - start >= 2 && s->in[start] == '"' && s->in[end-1] == '"')
+    {
+      start++;
+      end--;
+    }
+
+  if (s->nfields == s->fieldcap)
+    {
+      s->fieldcap = s->fieldcap ? s->fieldcap * 2 : 4096;
+      s->fields = xrealloc (s->fields, s->fieldcap * sizeof (struct field));
+      s->ts = xrealloc (s->ts, s->fieldcap * sizeof (struct timespec));
+      s->states = xrealloc (s->states, s->fieldcap * sizeof (int));
+    }
+
+  f = s->fields + s->nfields;
+  if (parse_value (s->in + start, s->in + end, s->ts + s->nfields, &f->frac))
+    return;
+  f->start = start;
+  f->end = end;
+  s->nfields++;
+}
+
+/* the selected columns of the line [start, end) */
+static void
+find_columns (struct slot *s, size_t start, size_t end)
+{
+  size_t i = start, fstart;
+  unsigned col = 1;
+
+  while (i < end && col < COLS_MAX)
+    {
+      if (!delim)
+        {
+          while (i < end && (s->in[i] == ' ' || s->in[i] == '\t'))
+            i++;
+          if (i == end)
+            break;
+        }
+
+      fstart = i;
+      if (delim)
+        while (i < end && s->in[i] != delim)
+          i++;
+      else
+        while (i < end && s->in[i] != ' ' && s->in[i] != '\t')
+          i++;
+
+      if (cols[col / 8] & 1 << col % 8)
+        add_field (s, fstart, i);
+
+      /* (past the delimiter) */
+      if (delim && i++ == end)
+        break;
+      col++;
+    }
+}
+
+/* the matches of re in the line [start, end) */
+static void
+find_matches (struct slot *s, const regex_t *re, size_t start, size_t end)
+{
+  regmatch_t m[2];
+  size_t pos = start;
+  int flags = REG_STARTEND;
+
+  while (pos <= end)
+    {
+      m[0].rm_so = 0;
+      m[0].rm_eo = end - pos;
+      if (regexec (re, s->in + pos, 2, m, flags))
+        break;
+
+      if (re->re_nsub > 0 && m[1].rm_so >= 0)
+        add_field (s, pos + m[1].rm_so, pos + m[1].rm_eo);
+      else
+        add_field (s, pos + m[0].rm_so, pos + m[0].rm_eo);
+
+      pos += m[0].rm_eo > m[0].rm_so ? m[0].rm_eo : m[0].rm_eo + 1;
+      flags |= REG_NOTBOL;
+    }
+}
+
+static void
+convert (struct slot *s, const regex_t *re)
+{
+  size_t i, end, next, prev;
+  char *p;
+
+  /* find the numbers */
+  s->nfields = 0;
+  for (i = 0; i < s->len; i = next)
+    {
+      p = memchr (s->in + i, '\n', s->len - i);
+      end = p ? (size_t) (p - s->in) : s->len;
+      next = end + 1;
+
+      /* (CRLF line ends) */
+      if (end > i && s->in[end-1] == '\r')
+        end--;
+
+      if (re != NULL)
+        find_matches (s, re, i, end);
+      else
+        find_columns (s, i, end);
+    }
+
+  if (reverse)
+    t2p_posix2time_timespec_array (s->ts, s->ts, s->nfields, s->states);
+  else
+    t2p_time2posix_timespec_array (s->ts, s->ts, s->nfields, s->states);
+
+  s->leaps = 0;
+  for (i = 0; i < s->nfields; i++)
+    s->leaps += s->states[i] != 0;
+
+  /* (a converted number may be longer, but never more than FIELD_MAX) */
+  if (s->outcap < s->len + FIELD_MAX*s->nfields)
+    {
+      s->outcap = s->len + FIELD_MAX*s->nfields + s->len / 8;
+      s->out = xrealloc (s->out, s->outcap);
+    }
+
+  /* copy the rest, print the converted numbers */
+  p = s->out;
+  prev = 0;
+  for (i = 0; i < s->nfields; i++)
+    {
+      memcpy (p, s->in + prev, s->fields[i].start - prev);
+      p += s->fields[i].start - prev;
+      p += format_value (p, s->ts + i, s->fields[i].frac);
+      prev = s->fields[i].end;
+    }
+  memcpy (p, s->in + prev, s->len - prev);
+  s->outlen = p + (s->len - prev) - s->out;
+}
+
+/* Read the next chunk into s, called with the lock held.
+   Returns 0 at the end of the input.  */
+static int
+next_chunk (struct job *job, struct slot *s)
+{
+  size_t len, want;
+  ssize_t res;
+  char *nl;
+
+  if (job->map != NULL)
+    {
+      if (job->pos >= job->size)
+        return 0;
+
+      len = job->size - job->pos < CHUNK ? job->size - job->pos : CHUNK;
+      nl = memchr (job->map + job->pos + len, '\n', job->size - job->pos - len);
+      len = nl ? (size_t) (nl + 1 - job->map) - job->pos : job->size - job->pos;
+
+      s->in = job->map + job->pos;
+      s->len = len;
+      job->pos += len;
+      return 1;
+    }
+
+  /* stream: the carried over line, then at least CHUNK more bytes up to
+     a line end */
+  len = job->carrylen;
+  want = len + CHUNK;
+  if (s->bufcap < want)
+    {
+      s->bufcap = want;
+      s->buf = xrealloc (s->buf, s->bufcap);
+    }
+  memcpy (s->buf, job->carry, len);
+
+  for (;;)
+    {
+      while (len < want)
+        {
+          res = read (job->fd, s->buf + len, want - len);
+          if (res < 0 && errno == EINTR)
+            continue;
+          if (res < 0)
+            {
+              perror ("t2p_conv: read");
+              job->error = 1;
+            }
+          if (res <= 0)
+            break;
+          len += res;
+        }
+
+      nl = memrchr (s->buf, '\n', len);
+      if (nl != NULL || len < want)
+        break;
+
+      /* a line longer than the buffer */
+      want *= 2;
+      s->bufcap = want;
+      s->buf = xrealloc (s->buf, s->bufcap);
+    }
+
+  if (len == 0)
+    return 0;
+
+  /* at the end of the input all of it, otherwise up to the last line end */
+  job->carrylen = 0;
+  if (len == want)
+    {
+      job->carrylen = s->buf + len - (nl + 1);
+      if (job->carrycap < job->carrylen)
+        {
+          job->carrycap = job->carrylen * 2;
+          job->carry = xrealloc (job->carry, job->carrycap);
+        }
+      memcpy (job->carry, nl + 1, job->carrylen);
+      len -= job->carrylen;
+    }
+
+  s->in = s->buf;
+  s->len = len;
+  job->pos += len;
+  return 1;
+}
+
+static void *
+worker (void *arg)
+{
+  struct job *job = arg;
+  regex_t re;
+  struct slot *s;
+  size_t k;
+
+  /* (regexec serializes the callers of one regex) */
+  if (pattern != NULL)
+    regcomp (&re, pattern, REG_EXTENDED);
+
+  pthread_mutex_lock (&job->lock);
+  for (;;)
+    {
+      while (!job->eof && job->next - job->written >= job->nslots)
+        pthread_cond_wait (&job->cond, &job->lock);
+      if (job->eof)
+        break;
+
+      k = job->next++;
+      s = job->slots + k % job->nslots;
+      if (!next_chunk (job, s))
+        {
+          job->end = k;
+          job->eof = 1;
+          pthread_cond_broadcast (&job->cond);
+          break;
+        }
+      pthread_mutex_unlock (&job->lock);
+
+      convert (s, pattern != NULL ? &re : NULL);
+
+      pthread_mutex_lock (&job->lock);
+      s->done = 1;
+      job->values += s->nfields;
+      job->leaps += s->leaps;
+      pthread_cond_broadcast (&job->cond);
+    }
+  pthread_mutex_unlock (&job->lock);
+
+  if (pattern != NULL)
+    regfree (&re);
+  return NULL;
+}
+
+static int
+write_all (int fd, const char *buf, size_t len)
+{
+  ssize_t res;
+
+  while (len)
+    {
+      res = write (fd, buf, len);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res < 0)
+        return -1;
+      buf += res;
+      len -= res;
+    }
+  return 0;
+}
+
+/* Convert the file, the workers take the chunks in order and this thread
+   writes them out in the same order as they are done.  */
+static int
+convert_file (struct job *job, int out)
+{
+  pthread_t threads[nthreads];
+  struct slot *s;
+  size_t k;
+  int i, res = 0;
+
+  job->pos = job->next = job->written = job->carrylen = 0;
+  job->values = job->leaps = 0;
+  job->eof = job->error = 0;
+  for (k = 0; k < job->nslots; k++)
+    job->slots[k].done = 0;
+
+  for (i = 0; i < nthreads; i++)
+    if (pthread_create (&threads[i], NULL, worker, job))
+      {
+        fprintf (stderr, "t2p_conv: Cannot start thread\n");
+        exit (1);
+      }
+
+  for (k = 0;; k++)
+    {
+      s = job->slots + k % job->nslots;
+
+      pthread_mutex_lock (&job->lock);
+      while (!s->done && !(job->eof && k >= job->end))
+        pthread_cond_wait (&job->cond, &job->lock);
+      pthread_mutex_unlock (&job->lock);
+      if (!s->done)
+        break;
+
+      if (!res && write_all (out, s->out, s->outlen))
+        {
+          perror ("t2p_conv: write");
+          res = -1;
+        }
+
+      pthread_mutex_lock (&job->lock);
+      s->done = 0;
+      job->written++;
+      pthread_cond_broadcast (&job->cond);
+      pthread_mutex_unlock (&job->lock);
+    }
+
+  for (i = 0; i < nthreads; i++)
+    pthread_join (threads[i], NULL);
+
+  return res || job->error ? -1 : 0;
+}
+
+static int
+parse_cols (const char *arg)
+{
+  char *end;
+  long c;
+
+  memset (cols, 0, sizeof cols);
+  for (;;)
+    {
+      c = strtol (arg, &end, 10);
+      if (end == arg || c < 1 || c >= COLS_MAX)
+        return -1;
+      cols[c / 8] |= 1 << c % 8;
+      if (*end == '\0')
+        return 0;
+      if (*end != ',')
+        return -1;
+      arg = end + 1;
+    }
+}
+
+/* the first input (- is the standard input) which is the same regular
+   file as the output (path, or fd if path is NULL), so that it would be
+   truncated before it is read, or NULL */
+static const char *
+output_input (const char *path, int fd, char *const *names, int n)
+{
+  struct stat out, st;
+  const char *name;
+  int i;
+
+  if ((path != NULL ? stat (path, &out) : fstat (fd, &out)) || !S_ISREG (out.st_mode))
+    return NULL;
+
+  for (i = 0; i < n || i == 0; i++)
+    {
+      name = i < n ? names[i] : "-";
+      if (!(strcmp (name, "-") ? stat (name, &st) : fstat (0, &st))
+          && st.st_dev == out.st_dev && st.st_ino == out.st_ino)
+        return name;
+    }
+  return NULL;
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct job job;
+  struct stat st;
+  const char *output = NULL, *name;
+  double start, secs;
+  regex_t re;
+  int opt, out, verbose = 0, res = 0, i;
+
+  nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+  parse_cols ("1");
+
+  while ((opt = getopt (argc, argv, "ru:c:d:e:j:o:v")) != -1)
+    switch (opt)
+      {
+      case 'r':
+        reverse = 1;
+        break;
+      case 'u':
+        if (!strcmp (optarg, "s"))
+          unit_ns = NS_PER_SEC, frac_max = 9;
+        else if (!strcmp (optarg, "ms"))
+          unit_ns = 1000000, frac_max = 6;
+        else if (!strcmp (optarg, "us"))
+          unit_ns = 1000, frac_max = 3;
+        else if (!strcmp (optarg, "ns"))
+          unit_ns = 1, frac_max = 0;
+        else
+          usage ();
+        break;
+      case 'c':
+        if (parse_cols (optarg))
+          usage ();
+        break;
+      case 'd':
+        if (strlen (optarg) != 1 || *optarg == '\n')
+          usage ();
+        delim = *optarg;
+        break;
+      case 'e':
+        pattern = optarg;
+        break;
+      case 'j':
+        nthreads = atoi (optarg);
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      default:
+        usage ();
+      }
+
+  if (nthreads < 1)
+    nthreads = 1;
+
+  if (pattern != NULL && (i = regcomp (&re, pattern, REG_EXTENDED)))
+    {
+      char buf[256];
+      regerror (i, &re, buf, sizeof buf);
+      fprintf (stderr, "t2p_conv: %s: %s\n", pattern, buf);
+      exit (2);
+    }
+  if (pattern != NULL)
+    regfree (&re);
+
+  name = output_input (output, 1, argv + optind, argc - optind);
+  if (name != NULL)
+    {
+      fprintf (stderr, "t2p_conv: %s: The output is an input file\n", name);
+      exit (1);
+    }
+
+  out = output ? open (output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666) : 1;
+  if (out < 0)
+    {
+      perror (output);
+      exit (1);
+    }
+
+  memset (&job, 0, sizeof job);
+  pthread_mutex_init (&job.lock, NULL);
+  pthread_cond_init (&job.cond, NULL);
+  job.nslots = 2 * nthreads;
+  job.slots = xrealloc (NULL, job.nslots * sizeof (struct slot));
+  memset (job.slots, 0, job.nslots * sizeof (struct slot));
+
+  for (i = optind; i < argc || i == optind; i++)
+    {
+      name = i < argc ? argv[i] : "-";
+      job.fd = strcmp (name, "-") ? open (name, O_RDONLY | O_CLOEXEC) : 0;
+      if (job.fd < 0)
+        {
+          perror (name);
+          res = 1;
+          continue;
+        }
+
+      job.map = NULL;
+      if (!fstat (job.fd, &st) && S_ISREG (st.st_mode) && st.st_size > 0)
+        {
+          job.map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, job.fd, 0);
+          if (job.map == MAP_FAILED)
+            job.map = NULL;
+          else
+            {
+              job.size = st.st_size;
+              madvise ((void *) job.map, job.size, MADV_SEQUENTIAL);
+            }
+        }
+
+      start = now ();
+      if (convert_file (&job, out))
+        res = 1;
+      secs = now () - start;
+
+      if (verbose)
+        fprintf (stderr, "%s: %zu bytes, %zu values (%zu in leap seconds) in %.3f s, %.1f MB/s\n",
+                 name, job.pos, job.values, job.leaps, secs, job.pos / secs / 1e6);
+
+      if (job.map != NULL)
+        munmap ((void *) job.map, job.size);
+      if (job.fd != 0)
+        close (job.fd);
+    }
+
+  if (out != 1 && close (out))
+    {
+      perror (output);
+      res = 1;
+    }
+
+  exit (res);
+}
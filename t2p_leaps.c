@@ -0,0 +1,152 @@
+/* This file is in public domain */
+
+/* Reads the leap seconds table as time2posix.so does, and prints it,
+   writes the binary cache or the embedded table.
+
+   Usage: t2p_leaps [-c | -e | -x] [file]
+
+   -c    write the binary cache (T2P_LEAPS_CACHE, or T2P_LEAPS_CACHE_FILE),
+         to be run whenever the leap seconds file is updated
+   -e    print the C source of the embedded table (leaps_embedded.c),
+         an empty one if there is no file
+   -x    the same as the constexpr table of the C++ header
+         (time2posix_leaps.hpp)
+
+   The table is read from the file given, or else from the sources the
+   library reads (never from the cache), and printed as one line per leap
+   second:
+
+     posix  right  change  insert|delete
+
+   where posix is the last posix second before it (the 23:59:59 of the
+   deletion) and right its right time transition.  */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "time2posix.h"
+
+static void
+print_embedded (const struct t2p_leaps *leaps, const char *path)
+{
+  size_t i;
+
+  printf ("/* generated by t2p_leaps -e%s%s, do not edit */\n\n"
+          "#include \"time2posix.h\"\n\n"
+          "const struct t2p_leaps t2p_leaps_embedded =\n{\n"
+          "  .num = %zu,\n  .expires = %lld,\n  .transition =\n  {",
+          path ? " from " : "", path ? path : "", leaps->num, (long long) leaps->expires);
+  for (i = 0; i < leaps->num; i++)
+    printf ("%s%lld,", i % 6 ? " " : "\n    ", (long long) leaps->transition[i]);
+  printf ("\n  },\n  .change =\n  {");
+  for (i = 0; i < leaps->num; i++)
+    printf ("%s%d,", i % 12 ? " " : "\n    ", leaps->change[i]);
+  printf ("\n  },\n};\n");
+}
+
+static void
+print_cxx (const struct t2p_leaps *leaps, const char *path)
+{
+  size_t i;
+
+  printf ("/* generated by t2p_leaps -x%s%s, do not edit */\n\n"
+          "namespace t2p\n{\n\n"
+          "inline constexpr t2p_leaps embedded_leaps =\n{\n"
+          "  %zu,\n  {",
+          path ? " from " : "", path ? path : "", leaps->num);
+  for (i = 0; i < leaps->num; i++)
+    printf ("%s%lld,", i % 6 ? " " : "\n    ", (long long) leaps->transition[i]);
+  printf ("\n  },\n  {");
+  for (i = 0; i < leaps->num; i++)
+    printf ("%s%d,", i % 12 ? " " : "\n    ", leaps->change[i]);
+  printf ("\n  },\n  %lld,\n};\n\n}\n", (long long) leaps->expires);
+}
+
+static void
+print_table (const struct t2p_leaps *leaps, const struct t2p_leaps_source *src)
+{
+  int prev = 0, type;
+  size_t i;
+
+  printf ("# %s\n# posix\tright\tchange\ttype\n", src->path);
+  for (i = 0; i < leaps->num; i++)
+    {
+      type = leaps->change[i] > prev;
+      printf ("%lld\t%lld\t%d\t%s\n", (long long) (leaps->transition[i] - prev - type),
+              (long long) leaps->transition[i], leaps->change[i], type ? "insert" : "delete");
+      prev = leaps->change[i];
+    }
+  if (leaps->expires)
+    printf ("# expires %lld\n", (long long) leaps->expires);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct t2p_leaps leaps;
+  struct t2p_leaps_source src;
+  int opt, cache = 0, embedded = 0, cxx = 0;
+
+  while ((opt = getopt (argc, argv, "cex")) != -1)
+    switch (opt)
+      {
+      case 'c':
+        cache = 1;
+        break;
+      case 'e':
+        embedded = 1;
+        break;
+      case 'x':
+        cxx = 1;
+        break;
+      default:
+        fprintf (stderr, "Usage: t2p_leaps [-c | -e | -x] [file]\n");
+        exit (2);
+      }
+
+  if (cache + embedded + cxx > 1 || argc - optind > 1)
+    {
+      fprintf (stderr, "Usage: t2p_leaps [-c | -e | -x] [file]\n");
+      exit (2);
+    }
+
+  /* (read the file given as the library would read T2P_LEAPS) */
+  if (optind < argc)
+    setenv ("T2P_LEAPS", argv[optind], 1);
+
+  if (t2p_leaps_load (&leaps, &src, 0))
+    {
+      fprintf (stderr, "t2p_leaps: %s %s\n", src.error, src.path);
+      if (!embedded && !cxx)
+        exit (1);
+
+      fprintf (stderr, "t2p_leaps: The embedded table is empty\n");
+      memset (&leaps, 0, sizeof leaps);
+      if (cxx)
+        print_cxx (&leaps, NULL);
+      else
+        print_embedded (&leaps, NULL);
+      exit (0);
+    }
+
+  if (embedded)
+    print_embedded (&leaps, src.path);
+  else if (cxx)
+    print_cxx (&leaps, src.path);
+  else if (cache)
+    {
+      if (t2p_leaps_cache_write (&leaps, &src))
+        {
+          perror ("t2p_leaps: Cannot write the cache");
+          exit (1);
+        }
+    }
+  else
+    print_table (&leaps, &src);
+
+  exit (0);
+}
@@ -0,0 +1,544 @@
+/* This file is in public domain */
+
+/* Converts the packet timestamps of pcap and pcapng captures between
+   right and posix time.
+
+   Usage: t2p_pcap [-r] [-v] [file...]
+
+   -r  convert posix to right time (default right to posix)
+   -v  report the throughput of each file on the standard error
+
+   The files are rewritten in place: they are mapped and only the
+   timestamp fields are overwritten, nothing else is touched.  Without
+   files (or with -) the capture is streamed from the standard input to
+   the standard output.  Converted are the record headers of pcap (with
+   micro- or nanosecond timestamps, in either byte order) and the
+   enhanced, obsolete packet and interface statistics blocks of pcapng,
+   in the resolution (if_tsresol) and with the offset (if_tsoffset) of
+   their interface.  The timestamps are gathered in batches and converted
+   by t2p_time2posix_timespec_array, so leap seconds are handled as in
+   t2p_time2posix_timespec.  */
+
+#include <byteswap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "time2posix.h"
+
+#define NS_PER_SEC 1000000000LL
+
+/* timestamps converted at once */
+#define BATCH 4096
+
+/* input read at once when streaming */
+#define STREAM_CHUNK (1 << 20)
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_HEADER 24
+#define PCAP_RECORD 16
+
+#define NG_SHB 0x0a0d0d0a
+#define NG_IDB 1
+#define NG_OPB 2
+#define NG_ISB 5
+#define NG_EPB 6
+#define NG_BOM 0x1a2b3c4d
+#define NG_OPT_TSRESOL 9
+#define NG_OPT_TSOFFSET 14
+
+/* a timestamp waiting for the batch conversion */
+struct stamp
+{
+  /* offset of the timestamp fields in the buffer */
+  size_t off;
+
+  /* pcap: 0, or the ticks per second of the pcapng interface */
+  u_int64_t res;
+  int64_t tsoffset;
+  u_int64_t ticks;
+
+  /* pcap: nanosecond timestamps */
+  int ns;
+  int swap;
+};
+
+struct iface
+{
+  u_int64_t res;
+  int64_t tsoffset;
+};
+
+/* the capture being converted */
+struct cap
+{
+  const char *name;
+  int ng, ns, swap, started;
+
+  /* only check the structure, do not convert */
+  int dry;
+
+  /* the interfaces of the current pcapng section */
+  struct iface *ifaces;
+  size_t nifaces, ifacecap;
+
+  struct stamp stamps[BATCH];
+  struct timespec ts[BATCH];
+  int states[BATCH];
+  size_t nstamps;
+
+  size_t packets, leaps;
+};
+
+static int reverse;
+
+static u_int32_t
+get32 (const unsigned char *p, int swap)
+{
+  u_int32_t v;
+  memcpy (&v, p, 4);
+  return swap ? bswap_32 (v) : v;
+}
+
+static void
+put32 (unsigned char *p, u_int32_t v, int swap)
+{
+  if (swap)
+    v = bswap_32 (v);
+  memcpy (p, &v, 4);
+}
+
+static u_int16_t
+get16 (const unsigned char *p, int swap)
+{
+  u_int16_t v;
+  memcpy (&v, p, 2);
+  return swap ? bswap_16 (v) : v;
+}
+
+/* convert the gathered timestamps and store them back into buf */
+static void
+flush (struct cap *c, unsigned char *buf)
+{
+  struct stamp *s;
+  __int128 old, new;
+  size_t i;
+
+  for (i = 0, s = c->stamps; i < c->nstamps; i++, s++)
+    if (s->res == 0)
+      {
+        c->ts[i].tv_sec = get32 (buf + s->off, s->swap);
+        c->ts[i].tv_nsec = get32 (buf + s->off + 4, s->swap) * (s->ns ? 1 : 1000);
+      }
+    else
+      {
+        old = (__int128) s->ticks * NS_PER_SEC / s->res + (__int128) s->tsoffset * NS_PER_SEC;
+        c->ts[i].tv_sec = old / NS_PER_SEC;
+        c->ts[i].tv_nsec = old % NS_PER_SEC;
+      }
+
+  if (reverse)
+    t2p_posix2time_timespec_array (c->ts, c->ts, c->nstamps, c->states);
+  else
+    t2p_time2posix_timespec_array (c->ts, c->ts, c->nstamps, c->states);
+
+  for (i = 0, s = c->stamps; i < c->nstamps; i++, s++)
+    {
+      c->leaps += c->states[i] != 0;
+      if (s->res == 0)
+        {
+          put32 (buf + s->off, c->ts[i].tv_sec, s->swap);
+          put32 (buf + s->off + 4, c->ts[i].tv_nsec / (s->ns ? 1 : 1000), s->swap);
+        }
+      else
+        {
+          /* shifted by the difference, so that the ticks below the ns
+             survive the (usually whole second) conversion */
+          old = (__int128) s->ticks * NS_PER_SEC / s->res + (__int128) s->tsoffset * NS_PER_SEC;
+          new = (__int128) c->ts[i].tv_sec * NS_PER_SEC + c->ts[i].tv_nsec;
+          s->ticks += (new - old) * s->res / NS_PER_SEC;
+          put32 (buf + s->off, s->ticks >> 32, s->swap);
+          put32 (buf + s->off + 4, s->ticks, s->swap);
+        }
+    }
+
+  c->nstamps = 0;
+}
+
+static void
+add_stamp (struct cap *c, unsigned char *buf, size_t off, const struct iface *ifc)
+{
+  struct stamp *s = c->stamps + c->nstamps;
+
+  if (c->dry)
+    return;
+
+  s->off = off;
+  s->swap = c->swap;
+  s->ns = c->ns;
+  s->res = 0;
+  if (ifc != NULL)
+    {
+      s->res = ifc->res;
+      s->tsoffset = ifc->tsoffset;
+      s->ticks = (u_int64_t) get32 (buf + off, c->swap) << 32 | get32 (buf + off + 4, c->swap);
+    }
+
+  c->packets++;
+  if (++c->nstamps == BATCH)
+    flush (c, buf);
+}
+
+/* the resolution and offset options of an interface description block */
+static int
+parse_idb (struct cap *c, const unsigned char *blk, size_t len)
+{
+  struct iface *ifc;
+  size_t pos = 16;
+  u_int16_t code, olen;
+  int v, i;
+
+  if (c->nifaces == c->ifacecap)
+    {
+      c->ifacecap = c->ifacecap ? c->ifacecap * 2 : 16;
+      c->ifaces = realloc (c->ifaces, c->ifacecap * sizeof (struct iface));
+      if (c->ifaces == NULL)
+        {
+          fprintf (stderr, "t2p_pcap: Out of memory\n");
+          exit (1);
+        }
+    }
+
+  ifc = c->ifaces + c->nifaces++;
+  ifc->res = 1000000;
+  ifc->tsoffset = 0;
+
+  while (pos + 4 <= len - 4)
+    {
+      code = get16 (blk + pos, c->swap);
+      olen = get16 (blk + pos + 2, c->swap);
+      pos += 4;
+      if (code == 0 || pos + olen > len - 4)
+        break;
+
+      if (code == NG_OPT_TSRESOL && olen >= 1)
+        {
+          v = blk[pos] & 0x7f;
+          if ((blk[pos] & 0x80) ? v > 63 : v > 19)
+            {
+              fprintf (stderr, "t2p_pcap: %s: Unsupported if_tsresol %#x\n", c->name, blk[pos]);
+              return -1;
+            }
+          if (blk[pos] & 0x80)
+            ifc->res = (u_int64_t) 1 << v;
+          else
+            for (ifc->res = 1, i = 0; i < v; i++)
+              ifc->res *= 10;
+        }
+      else if (code == NG_OPT_TSOFFSET && olen == 8)
+        {
+          memcpy (&ifc->tsoffset, blk + pos, 8);
+          if (c->swap)
+            ifc->tsoffset = bswap_64 (ifc->tsoffset);
+        }
+
+      pos += (olen + 3) & ~3;
+    }
+
+  return 0;
+}
+
+/* Convert the complete records (or blocks) in buf[0, len).  Returns the
+   number of bytes they take, -1 on a malformed capture.  */
+static ssize_t
+convert (struct cap *c, unsigned char *buf, size_t len)
+{
+  size_t pos = 0, blen;
+  u_int32_t type, magic, ifid;
+
+  if (!c->started)
+    {
+      if (len < 12)
+        return 0;
+
+      memcpy (&magic, buf, 4);
+      if (magic == NG_SHB)
+        c->ng = 1;
+      else if (magic == PCAP_MAGIC_US || magic == bswap_32 (PCAP_MAGIC_US)
+               || magic == PCAP_MAGIC_NS || magic == bswap_32 (PCAP_MAGIC_NS))
+        {
+          if (len < PCAP_HEADER)
+            return 0;
+          c->swap = magic == bswap_32 (PCAP_MAGIC_US) || magic == bswap_32 (PCAP_MAGIC_NS);
+          c->ns = magic == PCAP_MAGIC_NS || magic == bswap_32 (PCAP_MAGIC_NS);
+          pos = PCAP_HEADER;
+        }
+      else
+        {
+          fprintf (stderr, "t2p_pcap: %s: Not a pcap or pcapng capture\n", c->name);
+          return -1;
+        }
+      c->started = 1;
+    }
+
+  if (!c->ng)
+    {
+      while (pos + PCAP_RECORD <= len)
+        {
+          blen = PCAP_RECORD + get32 (buf + pos + 8, c->swap);
+          if (pos + blen > len)
+            break;
+          add_stamp (c, buf, pos, NULL);
+          pos += blen;
+        }
+      flush (c, buf);
+      return pos;
+    }
+
+  while (pos + 12 <= len)
+    {
+      memcpy (&type, buf + pos, 4);
+
+      /* a new section, possibly in the other byte order */
+      if (type == NG_SHB)
+        {
+          magic = get32 (buf + pos + 8, 0);
+          if (magic != NG_BOM && magic != bswap_32 (NG_BOM))
+            {
+              fprintf (stderr, "t2p_pcap: %s: Invalid section header\n", c->name);
+              return -1;
+            }
+          flush (c, buf);
+          c->swap = magic != NG_BOM;
+          c->nifaces = 0;
+        }
+
+      type = get32 (buf + pos, c->swap);
+      blen = get32 (buf + pos + 4, c->swap);
+      if (blen < 12 || blen % 4)
+        {
+          fprintf (stderr, "t2p_pcap: %s: Invalid block length at %zu\n", c->name, pos);
+          return -1;
+        }
+      if (pos + blen > len)
+        break;
+
+      if (type == NG_IDB)
+        {
+          if (blen < 20 || parse_idb (c, buf + pos, blen))
+            return -1;
+        }
+      else if (type == NG_EPB || type == NG_ISB || type == NG_OPB)
+        {
+          if (blen < 24)
+            {
+              fprintf (stderr, "t2p_pcap: %s: Invalid block length at %zu\n", c->name, pos);
+              return -1;
+            }
+          ifid = type == NG_OPB ? get16 (buf + pos + 8, c->swap) : get32 (buf + pos + 8, c->swap);
+          if (ifid >= c->nifaces)
+            {
+              fprintf (stderr, "t2p_pcap: %s: Unknown interface %u at %zu\n", c->name, ifid, pos);
+              return -1;
+            }
+          add_stamp (c, buf, pos + 12, c->ifaces + ifid);
+        }
+
+      pos += blen;
+    }
+
+  flush (c, buf);
+  return pos;
+}
+
+/* the capture in place */
+static int
+convert_file (struct cap *c, int fd)
+{
+  unsigned char *map;
+  struct stat st;
+  ssize_t res;
+
+  if (fstat (fd, &st) || !S_ISREG (st.st_mode))
+    {
+      fprintf (stderr, "t2p_pcap: %s: Not a regular file\n", c->name);
+      return -1;
+    }
+  if (st.st_size == 0)
+    return 0;
+
+  map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    {
+      perror (c->name);
+      return -1;
+    }
+  madvise (map, st.st_size, MADV_SEQUENTIAL);
+
+  /* nothing is written into a capture which turns out to be malformed */
+  c->dry = 1;
+  res = convert (c, map, st.st_size);
+  c->dry = 0;
+  if (res >= 0)
+    {
+      c->started = c->ng = c->ns = c->swap = 0;
+      c->nifaces = 0;
+      res = convert (c, map, st.st_size);
+    }
+  if (res >= 0 && (size_t) res < (size_t) st.st_size)
+    fprintf (stderr, "t2p_pcap: %s: Truncated at %zd, the rest is left as it is\n", c->name, res);
+
+  munmap (map, st.st_size);
+  return res < 0 ? -1 : 0;
+}
+
+static int
+write_all (int fd, const unsigned char *buf, size_t len)
+{
+  ssize_t res;
+
+  while (len)
+    {
+      res = write (fd, buf, len);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res < 0)
+        return -1;
+      buf += res;
+      len -= res;
+    }
+  return 0;
+}
+
+/* the capture from stdin to stdout, record by record as they come in */
+static int
+convert_stream (struct cap *c, size_t *bytes)
+{
+  unsigned char *buf = NULL;
+  size_t len = 0, cap = 0;
+  ssize_t res, done;
+  int eof = 0;
+
+  while (!eof)
+    {
+      /* (a record may be larger than the buffer) */
+      if (cap - len < STREAM_CHUNK / 2)
+        {
+          cap = cap ? cap * 2 : STREAM_CHUNK;
+          buf = realloc (buf, cap);
+          if (buf == NULL)
+            {
+              fprintf (stderr, "t2p_pcap: Out of memory\n");
+              exit (1);
+            }
+        }
+
+      res = read (0, buf + len, cap - len);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res < 0)
+        {
+          perror ("t2p_pcap: read");
+          return -1;
+        }
+      eof = res == 0;
+      len += res;
+
+      done = convert (c, buf, len);
+      if (done < 0)
+        return -1;
+      if (eof && (size_t) done < len)
+        {
+          fprintf (stderr, "t2p_pcap: %s: Truncated at %zu, the rest is left as it is\n",
+                   c->name, *bytes + done);
+          done = len;
+        }
+
+      if (write_all (1, buf, done))
+        {
+          perror ("t2p_pcap: write");
+          return -1;
+        }
+      *bytes += done;
+      memmove (buf, buf + done, len - done);
+      len -= done;
+    }
+
+  free (buf);
+  return 0;
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int
+main (int argc, char **argv)
+{
+  static struct cap c;
+  struct stat st;
+  double start, secs;
+  size_t bytes;
+  int opt, verbose = 0, res = 0, fd, i;
+
+  while ((opt = getopt (argc, argv, "rv")) != -1)
+    switch (opt)
+      {
+      case 'r':
+        reverse = 1;
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      default:
+        fprintf (stderr, "Usage: t2p_pcap [-r] [-v] [file...]\n");
+        exit (2);
+      }
+
+  for (i = optind; i < argc || i == optind; i++)
+    {
+      c.name = i < argc ? argv[i] : "-";
+      c.started = c.ng = c.ns = c.swap = 0;
+      c.nifaces = c.nstamps = c.packets = c.leaps = 0;
+      bytes = 0;
+
+      start = now ();
+      if (!strcmp (c.name, "-"))
+        {
+          if (convert_stream (&c, &bytes))
+            res = 1;
+        }
+      else
+        {
+          fd = open (c.name, O_RDWR | O_CLOEXEC);
+          if (fd < 0)
+            {
+              perror (c.name);
+              res = 1;
+              continue;
+            }
+          if (convert_file (&c, fd))
+            res = 1;
+          if (!fstat (fd, &st))
+            bytes = st.st_size;
+          close (fd);
+        }
+      secs = now () - start;
+
+      if (verbose)
+        fprintf (stderr, "%s: %zu bytes, %zu packets (%zu in leap seconds) in %.3f s, %.1f MB/s\n",
+                 c.name, bytes, c.packets, c.leaps, secs, bytes / secs / 1e6);
+    }
+
+  exit (res);
+}
@@ -0,0 +1,277 @@
+/* This file is in public domain */
+
+/* Replays every leap second of the table, and a synthetic deletion after
+   the last one, through the interposed clock functions on the fake clock.
+
+   Usage: ./t2p_replay [step_ms]   (make replay)
+
+   The table is replaced by the one read plus the deletion, and for every
+   leap second the fake clock is stopped 3 seconds before it and stepped
+   by step_ms (default 10) milliseconds up to 3 seconds after it.  At every
+   step clock_gettime, gettimeofday, adjtimex and the SO_TIMESTAMPNS of a
+   received packet are read, and checked that
+
+     - clock_gettime never goes backwards (but for the repeated second
+       with T2P_SMEAR=none),
+     - it goes back to the right time within ROUNDTRIP_NS (or the second
+       repeated),
+     - gettimeofday and adjtimex agree with it to the microsecond,
+     - the packet timestamp is the same as it,
+     - adjtimex passes TIME_INS (TIME_DEL), TIME_OOP, TIME_WAIT and TIME_OK
+       in this order.
+
+   One tab separated line is printed per leap second:
+
+     posix  type  steps  backwards  roundtrip_ns  mismatches  status  ns/call  leap_ns/call
+
+   where the last two are the clock_gettime calls outside of and inside
+   the leap second, and then the same checks are run once with the clock
+   running 1000 times as fast through the last leap second.  The exit
+   status is 1 if anything failed.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "time2posix.h"
+
+#define NS 1000000000LL
+
+/* allowed error of posix2time (time2posix (t)) in the smear modes */
+#define ROUNDTRIP_NS 1000
+
+/* calls per measurement */
+#define BENCH_CALLS 100000
+
+static int sock = -1;
+
+/* T2P_SMEAR=none repeats the inserted second */
+static int repeats;
+
+static long long
+ns (const struct timespec *ts)
+{
+  return ts->tv_sec * NS + ts->tv_nsec;
+}
+
+static long long
+mono (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ns (&ts);
+}
+
+static int
+sock_open (void)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof addr;
+  int on = 1;
+
+  sock = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (sock < 0 || bind (sock, (struct sockaddr *) &addr, sizeof addr)
+      || getsockname (sock, (struct sockaddr *) &addr, &len)
+      || connect (sock, (struct sockaddr *) &addr, sizeof addr)
+      || setsockopt (sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof on))
+    {
+      perror ("t2p_replay: socket");
+      return -1;
+    }
+  return 0;
+}
+
+/* the timestamp of a packet sent and received now */
+static long long
+packet_time (void)
+{
+  char data, control[256];
+  struct iovec iov = { &data, 1 };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct timespec ts;
+
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+
+  if (send (sock, "x", 1, 0) != 1 || recvmsg (sock, &msg, 0) != 1)
+    return -1;
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPNS)
+      {
+        memcpy (&ts, CMSG_DATA(cmsg), sizeof ts);
+        return ns (&ts);
+      }
+  return -1;
+}
+
+static double
+bench_at (long long right)
+{
+  struct timespec ts = { right / NS, right % NS };
+  long long start;
+  int i;
+
+  t2p_fake_clock_set (&ts, 0);
+  start = mono ();
+  for (i = 0; i < BENCH_CALLS; i++)
+    clock_gettime (CLOCK_REALTIME, &ts);
+  return (double) (mono () - start) / BENCH_CALLS;
+}
+
+/* replay the leap second at the right time transition (its TZif record)
+   of the given type, returns nonzero if a check failed */
+static int
+replay (time_t posix, time_t transition, int type, long long step, double rate)
+{
+  static const int order_ins[] = { TIME_INS, TIME_OOP, TIME_WAIT, TIME_OK };
+  static const int order_del[] = { TIME_DEL, TIME_WAIT, TIME_OK };
+  const int *order = type ? order_ins : order_del;
+  int norder = type ? 4 : 3;
+  long long right, end, cur, prev = 0, err, max_err = 0, start;
+  long steps = 0, backwards = 0, mismatches = 0;
+  struct timespec ts;
+  struct timeval tv;
+  struct timex tx;
+  int status, pos = 0, bad_order = 0, failed;
+  double outside = 0, inside = 0;
+
+  right = (transition - 3) * NS;
+  end = (transition + 3) * NS;
+  ts.tv_sec = right / NS;
+  ts.tv_nsec = 0;
+  t2p_fake_clock_set (&ts, rate);
+  start = mono ();
+
+  while (1)
+    {
+      /* (running, the right time is only known after the fact) */
+      if (rate > 0)
+        right = -1;
+
+      clock_gettime (CLOCK_REALTIME, &ts);
+      gettimeofday (&tv, NULL);
+      memset (&tx, 0, sizeof tx);
+      status = adjtimex (&tx);
+      cur = ns (&ts);
+
+      if (cur < prev - (repeats && type ? NS : 0))
+        backwards++;
+      prev = cur;
+
+      t2p_posix2time_timespec (&ts);
+      if (right >= 0)
+        {
+          err = llabs (ns (&ts) - right);
+          if (repeats && type && err == NS)
+            err = 0;
+          if (err > max_err)
+            max_err = err;
+        }
+      else
+        right = ns (&ts);
+
+      /* (running, the calls read different times) */
+      if (rate == 0
+          && (llabs (tv.tv_sec * NS + tv.tv_usec * 1000LL - cur) >= 2000
+              || llabs (tx.time.tv_sec * NS + tx.time.tv_usec * 1000LL - cur) >= 2000
+              || packet_time () != cur))
+        mismatches++;
+
+      /* the statuses only go forwards */
+      while (pos < norder && order[pos] != status)
+        pos++;
+      if (pos == norder)
+        {
+          bad_order = 1;
+          pos = 0;
+        }
+
+      steps++;
+      if (rate > 0 ? right >= end : (right += step) >= end)
+        break;
+      if (rate == 0)
+        t2p_fake_clock_step (step);
+      else if (mono () - start > 10 * NS)
+        break;
+    }
+
+  if (rate == 0)
+    {
+      outside = bench_at ((transition - 3600) * NS);
+      inside = bench_at (transition * NS + NS / 2);
+    }
+
+  failed = backwards || max_err > ROUNDTRIP_NS || mismatches || bad_order
+           || (rate > 0 && right < end);
+  printf ("%ld\t%s\t%ld\t%ld\t%lld\t%ld\t%s\t%.2f\t%.2f\n", (long) posix,
+          type ? "insert" : "delete", steps, backwards, max_err, mismatches,
+          failed ? (bad_order ? "FAIL(status)" : "FAIL") : "ok", outside, inside);
+  fflush (stdout);
+  return failed;
+}
+
+int
+main (int argc, char **argv)
+{
+  long long step = (argc > 1 ? atoll (argv[1]) : 10) * 1000000LL;
+  time_t transitions[T2P_LEAPS_MAX], posix[T2P_LEAPS_MAX];
+  int changes[T2P_LEAPS_MAX], types[T2P_LEAPS_MAX];
+  struct t2p_table tab;
+  size_t n, i;
+  int failed = 0;
+
+  t2p_table_get (&tab);
+  n = tab.num;
+  repeats = tab.smear == T2P_SMEAR_NONE;
+  if (n == 0 || n == T2P_LEAPS_MAX || step <= 0)
+    {
+      fprintf (stderr, "t2p_replay: no leap seconds table\n");
+      exit (2);
+    }
+  if (sock_open ())
+    exit (2);
+
+  /* back to the TZif records */
+  for (i = 0; i < n; i++)
+    {
+      transitions[i] = tab.leapsecs[i].transition + tab.leapsecs[i].type;
+      changes[i] = tab.leapsecs[i].change;
+    }
+
+  /* a deletion at the end of the day two years after the last one */
+  posix[n] = (tab.leapsecs[n-1].posix_transition / 86400 + 2*365) * 86400;
+  transitions[n] = posix[n] + changes[n-1] - 1;
+  changes[n] = changes[n-1] - 1;
+  n++;
+
+  if (t2p_leaps_set (transitions, changes, n))
+    {
+      perror ("t2p_replay: t2p_leaps_set");
+      exit (2);
+    }
+
+  printf ("# posix\ttype\tsteps\tbackwards\troundtrip_ns\tmismatches\tstatus\tns/call\tleap_ns/call\n");
+  for (i = 0; i < n; i++)
+    {
+      types[i] = changes[i] > (i ? changes[i-1] : 0);
+      posix[i] = transitions[i] - (i ? changes[i-1] : 0) + !types[i];
+      failed |= replay (posix[i], transitions[i], types[i], step, 0);
+    }
+
+  /* running, through the last real one */
+  failed |= replay (posix[n-2], transitions[n-2], types[n-2], step, 1000);
+
+  exit (failed);
+}
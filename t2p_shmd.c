@@ -0,0 +1,141 @@
+/* This file is in public domain */
+
+/* Publishes the leap seconds table for all processes on the host.
+
+   Usage: t2p_shmd [-1]
+
+   The table is parsed once and published in T2P_SHM_FILE, which
+   time2posix.so maps read-only at startup instead of reading the leap
+   seconds file itself.  Run it as root, so that the directory and the
+   file are root's (the library does not trust a file anybody but root
+   or the process' own user could have written).  New tables (and the
+   cached span after a leap second) are published in place by the same
+   latch protocol the library uses internally, so mapping processes pick
+   them up on their next conversion.  The table has a lease, which
+   t2p_shmd renews every minute, the processes read their own table once
+   it has expired (or when it already has at startup).  With -1 the
+   table is published once and t2p_shmd exits (so it is used for the
+   lease only), otherwise it stays in the foreground and keeps it up to
+   date.  */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "time2posix.h"
+
+/* map the existing file, if it is valid */
+static struct t2p_latch *
+shm_open_existing (void)
+{
+  struct t2p_latch *latch;
+  struct stat st;
+  int fd;
+
+  fd = open (T2P_SHM_FILE, O_RDWR | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0)
+    return NULL;
+
+  if (flock (fd, LOCK_EX | LOCK_NB))
+    {
+      fprintf (stderr, "t2p_shmd: %s is being published by another process\n", T2P_SHM_FILE);
+      exit (1);
+    }
+
+  if (fstat (fd, &st) || st.st_size != sizeof (struct t2p_latch))
+    {
+      close (fd);
+      return NULL;
+    }
+
+  latch = mmap (NULL, sizeof (struct t2p_latch), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (latch == MAP_FAILED)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  if (latch->magic != T2P_LATCH_MAGIC || latch->size != sizeof (struct t2p_latch))
+    {
+      munmap (latch, sizeof (struct t2p_latch));
+      close (fd);
+      return NULL;
+    }
+
+  /* (the lock is held as long as fd is open) */
+  return latch;
+}
+
+/* create a new file, but move it in place only when the table is in it */
+static struct t2p_latch *
+shm_create (char *tmp)
+{
+  struct t2p_latch *latch;
+  int fd;
+
+  fd = mkstemp (tmp);
+  if (fd < 0 || fchmod (fd, 0644) || flock (fd, LOCK_EX | LOCK_NB)
+      || ftruncate (fd, sizeof (struct t2p_latch)))
+    {
+      perror ("t2p_shmd: Cannot create shared memory file");
+      exit (1);
+    }
+
+  latch = mmap (NULL, sizeof (struct t2p_latch), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (latch == MAP_FAILED)
+    {
+      perror ("t2p_shmd: Cannot map shared memory file");
+      unlink (tmp);
+      exit (1);
+    }
+
+  latch->magic = T2P_LATCH_MAGIC;
+  latch->size = sizeof (struct t2p_latch);
+  latch->seq = 0;
+
+  return latch;
+}
+
+int
+main (int argc, char **argv)
+{
+  char tmp[] = T2P_SHM_FILE ".XXXXXX";
+  struct t2p_latch *latch;
+  int once = argc > 1 && !strcmp (argv[1], "-1");
+
+  if (mkdir (T2P_SHM_DIR, 0755) && errno != EEXIST)
+    {
+      perror ("t2p_shmd: Cannot create " T2P_SHM_DIR);
+      exit (1);
+    }
+
+  latch = shm_open_existing ();
+  if (latch == NULL)
+    {
+      latch = shm_create (tmp);
+      if (t2p_latch_read (latch))
+        {
+          unlink (tmp);
+          exit (1);
+        }
+      if (rename (tmp, T2P_SHM_FILE))
+        {
+          perror ("t2p_shmd: Cannot rename shared memory file");
+          unlink (tmp);
+          exit (1);
+        }
+    }
+  else if (t2p_latch_read (latch))
+    exit (1);
+
+  if (once)
+    exit (0);
+
+  t2p_leaps_watch (latch);
+}
@@ -0,0 +1,139 @@
+/* This file is in public domain */
+
+/* Prints the statistics of processes running with time2posix.so and
+   T2P_STATS set.
+
+   Usage: t2p_stats [pid...]
+
+   Without pids, those of all processes with a statistics file.  For
+   every process the counters of its shards are summed and one tab
+   separated line is printed per function which has been called
+
+     pid  function  calls  conversions  leaps  ns  ns/conversion
+
+   followed by a line with the reloads of the leap seconds table and the
+   failed ones.  */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "time2posix.h"
+
+#define T2P_STATS_NAME(name) #name,
+static const char *const names[] = { T2P_STATS_FUNCTIONS(T2P_STATS_NAME) };
+
+static int
+print_stats (const char *path)
+{
+  const struct t2p_stats *stats;
+  struct t2p_stat_counters sum;
+  struct stat st;
+  int fd, fn, i;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      perror (path);
+      return -1;
+    }
+
+  if (fstat (fd, &st) || st.st_size != sizeof (struct t2p_stats))
+    {
+      fprintf (stderr, "t2p_stats: %s: Not a statistics file of this version\n", path);
+      close (fd);
+      return -1;
+    }
+
+  stats = mmap (NULL, sizeof (struct t2p_stats), PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (stats == MAP_FAILED)
+    {
+      perror (path);
+      return -1;
+    }
+
+  if (__atomic_load_n (&stats->magic, __ATOMIC_ACQUIRE) != T2P_STATS_MAGIC
+      || stats->size != sizeof (struct t2p_stats))
+    {
+      fprintf (stderr, "t2p_stats: %s: Not a statistics file of this version\n", path);
+      munmap ((void *) stats, sizeof (struct t2p_stats));
+      return -1;
+    }
+
+  for (fn = 0; fn < T2P_FN_MAX; fn++)
+    {
+      memset (&sum, 0, sizeof sum);
+      for (i = 0; i < T2P_STATS_SHARDS; i++)
+        {
+          const struct t2p_stat_counters *c = &stats->shards[i].fn[fn];
+
+          sum.calls += __atomic_load_n (&c->calls, __ATOMIC_RELAXED);
+          sum.conversions += __atomic_load_n (&c->conversions, __ATOMIC_RELAXED);
+          sum.leaps += __atomic_load_n (&c->leaps, __ATOMIC_RELAXED);
+          sum.ns += __atomic_load_n (&c->ns, __ATOMIC_RELAXED);
+        }
+
+      if (sum.calls == 0 && sum.conversions == 0)
+        continue;
+
+      printf ("%d\t%s\t%llu\t%llu\t%llu\t%llu\t%.1f\n", stats->pid, names[fn],
+              (unsigned long long) sum.calls, (unsigned long long) sum.conversions,
+              (unsigned long long) sum.leaps, (unsigned long long) sum.ns,
+              sum.conversions ? (double) sum.ns / sum.conversions : 0.0);
+    }
+
+  printf ("%d\treloads\t%llu\tfailed\t%llu\n", stats->pid,
+          (unsigned long long) __atomic_load_n (&stats->reloads, __ATOMIC_RELAXED),
+          (unsigned long long) __atomic_load_n (&stats->reload_failures, __ATOMIC_RELAXED));
+
+  munmap ((void *) stats, sizeof (struct t2p_stats));
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *base = strrchr (T2P_STATS_FILE, '/') + 1;
+  char path[PATH_MAX];
+  struct dirent *ent;
+  DIR *dir;
+  int i, res = 0;
+
+  printf ("# pid\tfunction\tcalls\tconversions\tleaps\tns\tns/conversion\n");
+
+  if (argc > 1)
+    {
+      for (i = 1; i < argc; i++)
+        {
+          snprintf (path, sizeof path, "%s.%s", T2P_STATS_FILE, argv[i]);
+          if (print_stats (path))
+            res = 1;
+        }
+      exit (res);
+    }
+
+  dir = opendir ("/dev/shm");
+  if (dir == NULL)
+    {
+      perror ("/dev/shm");
+      exit (1);
+    }
+
+  while ((ent = readdir (dir)) != NULL)
+    if (!strncmp (ent->d_name, base, strlen (base)) && ent->d_name[strlen (base)] == '.')
+      {
+        snprintf (path, sizeof path, "/dev/shm/%s", ent->d_name);
+        if (print_stats (path))
+          res = 1;
+      }
+
+  closedir (dir);
+  exit (res);
+}
@@ -0,0 +1,182 @@
+/* This file is in public domain */
+
+/* Multi-threaded scaling and reload stress test of time2posix.so.
+
+   Usage: LD_PRELOAD=./time2posix.so ./t2p_stress [max_threads [seconds]]
+
+   For 1, 2, 4, ... max_threads threads, every thread reads the realtime
+   clock through clock_gettime, gettimeofday and time in turn, while
+   another thread keeps re-reading the leap seconds table through
+   t2p_leaps_read, so that a new table is published all the time.
+   Every result is checked against the raw clock read just before and
+   after it (a torn or stale table gives a wrong offset) and against the
+   previous result of the same thread (it must not go backwards).
+
+   One tab separated line is printed per thread count:
+
+     threads  calls/s  calls/s/thread  reloads  torn  backwards
+
+   and the exit status is 1 if anything was flagged.  Freed tables are
+   not detectable from here, for that build time2posix.so with
+   -fsanitize=address and preload libasan before it.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "time2posix.h"
+
+#define NS 1000000000LL
+
+static int (*raw_clock_gettime) (clockid_t, struct timespec *);
+static typeof (t2p_leaps_read) *leaps_read;
+static volatile int stop;
+static long change;
+
+/* (a cache line each, not to measure false sharing of the counters) */
+struct worker
+{
+  pthread_t thread;
+  long calls, torn, backwards;
+} __attribute__ ((aligned (64)));
+
+static long long
+ns (const struct timespec *ts)
+{
+  return ts->tv_sec * NS + ts->tv_nsec;
+}
+
+static void *
+worker (void *arg)
+{
+  struct worker *w = arg;
+  struct timespec before, after, ts;
+  struct timeval tv;
+  long long last[2] = { 0, 0 }, cur, gran;
+  unsigned k = 0;
+  int coarse;
+
+  while (!stop)
+    {
+      raw_clock_gettime (CLOCK_REALTIME, &before);
+      switch (k++ % 3)
+        {
+        case 0:
+          clock_gettime (CLOCK_REALTIME, &ts);
+          gran = 1;
+          coarse = 0;
+          break;
+        case 1:
+          gettimeofday (&tv, NULL);
+          ts.tv_sec = tv.tv_sec;
+          ts.tv_nsec = tv.tv_usec * 1000;
+          gran = 1000;
+          coarse = 0;
+          break;
+        default:
+          ts.tv_sec = time (NULL);
+          ts.tv_nsec = 0;
+          gran = NS;
+          coarse = 1;
+          break;
+        }
+      raw_clock_gettime (CLOCK_REALTIME, &after);
+
+      /* off by one only inside a leap second */
+      if (ts.tv_sec < before.tv_sec - change - 1
+          || ts.tv_sec > after.tv_sec - change + 1)
+        w->torn++;
+
+      /* compare in the resolution of the call, time() is checked only
+         against itself as the kernel updates it only every tick */
+      cur = ns (&ts);
+      if (cur / gran < last[coarse] / gran)
+        w->backwards++;
+      if (cur > last[coarse])
+        last[coarse] = cur;
+
+      w->calls++;
+    }
+
+  return NULL;
+}
+
+static void *
+reloader (void *arg)
+{
+  long *reloads = arg;
+
+  while (!stop)
+    if (!leaps_read ())
+      ++*reloads;
+
+  return NULL;
+}
+
+int
+main (int argc, char **argv)
+{
+  int max_threads = argc > 1 ? atoi (argv[1]) : sysconf (_SC_NPROCESSORS_ONLN);
+  int seconds = argc > 2 ? atoi (argv[2]) : 2;
+  typeof (t2p_table_get) *table_get;
+  struct t2p_table tab;
+  struct worker *w;
+  pthread_t rthread;
+  void *libc;
+  int n, i, failed = 0;
+
+  libc = dlopen ("libc.so.6", RTLD_LAZY);
+  raw_clock_gettime = libc ? dlsym (libc, "clock_gettime") : NULL;
+  leaps_read = dlsym (RTLD_DEFAULT, "t2p_leaps_read");
+  table_get = dlsym (RTLD_DEFAULT, "t2p_table_get");
+  if (raw_clock_gettime == NULL || leaps_read == NULL || table_get == NULL)
+    {
+      fprintf (stderr, "t2p_stress: run with time2posix.so preloaded\n");
+      exit (2);
+    }
+
+  table_get (&tab);
+  change = tab.cache.change;
+
+  if (max_threads < 1)
+    max_threads = 1;
+  w = aligned_alloc (64, max_threads * sizeof (struct worker));
+
+  printf ("# threads\tcalls/s\tcalls/s/thread\treloads\ttorn\tbackwards\n");
+  for (n = 1; n <= max_threads; n = n < max_threads && n*2 > max_threads ? max_threads : n*2)
+    {
+      long calls = 0, torn = 0, backwards = 0, reloads = 0;
+
+      memset (w, 0, max_threads * sizeof (struct worker));
+      stop = 0;
+      pthread_create (&rthread, NULL, reloader, &reloads);
+      for (i = 0; i < n; i++)
+        pthread_create (&w[i].thread, NULL, worker, &w[i]);
+
+      sleep (seconds);
+      stop = 1;
+
+      pthread_join (rthread, NULL);
+      for (i = 0; i < n; i++)
+        {
+          pthread_join (w[i].thread, NULL);
+          calls += w[i].calls;
+          torn += w[i].torn;
+          backwards += w[i].backwards;
+        }
+
+      printf ("%d\t%.0f\t%.0f\t%ld\t%ld\t%ld\n", n, (double) calls / seconds,
+              (double) calls / seconds / n, reloads, torn, backwards);
+      fflush (stdout);
+
+      failed |= torn || backwards;
+      if (n == max_threads)
+        break;
+    }
+
+  free (w);
+  exit (failed);
+}
@@ -11,9 +11,12 @@ main (int argc, char **argv)
 {
   time_t t, e, pt2p = 0;
   struct timeval tv;
+  struct t2p_table tab;
   int i;
 
-  t = t2p_leapsecs[t2p_leapsecs_num-1].transition-2;
+  t2p_table_get (&tab);
+
+  t = tab.leapsecs[tab.num-1].transition-2;
   e = t + 6;
   printf ("time       time2posix st posix2time st status\n");
   for (; t < e; t++)
@@ -40,7 +43,7 @@ main (int argc, char **argv)
     }
 
   printf ("\ntime         time2posix   posix2time\n");
-  tv.tv_sec = t2p_leapsecs[t2p_leapsecs_num-1].transition;
+  tv.tv_sec = tab.leapsecs[tab.num-1].transition;
   tv.tv_usec = 0;
   for (i = 0; i < 20; i++)
     {
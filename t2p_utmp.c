@@ -0,0 +1,227 @@
+/* This file is in public domain */
+
+/* Converts the record times of utmp, wtmp and btmp files between right
+   and posix time, for the tools (like last) which read them directly
+   instead of through getutent.
+
+   Usage: t2p_utmp [-r] [-o output] [file]
+
+   -r         convert posix to right time (default right to posix)
+   -o output  write there instead of to the standard output
+
+   A file is mapped privately, the ut_tv of its records are converted in
+   place in blocks, each with one t2p_time2posix_timeval_array call, and
+   the mapping is written out at once.  The standard input is read,
+   converted and written a block at a time.  Empty records (zero time)
+   stay as they are.  An incomplete record at the end is copied
+   unchanged.  The output may not be the input file.  */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "time2posix.h"
+
+/* records converted at once */
+#define BLOCK 16384
+
+/* whether the file at path (or fd if path is NULL) is the regular file
+   of st */
+static int
+same_file (const char *path, int fd, const struct stat *st)
+{
+  struct stat other;
+
+  if (!S_ISREG (st->st_mode) || (path != NULL ? stat (path, &other) : fstat (fd, &other)))
+    return 0;
+  return other.st_dev == st->st_dev && other.st_ino == st->st_ino;
+}
+
+static int
+write_all (int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  ssize_t res;
+
+  while (len)
+    {
+      res = write (fd, p, len);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res < 0)
+        return -1;
+      p += res;
+      len -= res;
+    }
+  return 0;
+}
+
+/* read up to len bytes, less only at the end of the input */
+static ssize_t
+read_all (int fd, void *buf, size_t len)
+{
+  char *p = buf;
+  ssize_t res;
+  size_t done = 0;
+
+  while (done < len)
+    {
+      res = read (fd, p + done, len - done);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res < 0)
+        return -1;
+      if (res == 0)
+        break;
+      done += res;
+    }
+  return done;
+}
+
+/* convert the n records in place */
+static void
+convert (struct utmp *ut, size_t n, int reverse)
+{
+  static struct timeval tv[BLOCK];
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    {
+      tv[i].tv_sec = ut[i].ut_tv.tv_sec;
+      tv[i].tv_usec = ut[i].ut_tv.tv_usec;
+    }
+
+  if (reverse)
+    t2p_posix2time_timeval_array (tv, tv, n, NULL);
+  else
+    t2p_time2posix_timeval_array (tv, tv, n, NULL);
+
+  for (i = 0; i < n; i++)
+    if (ut[i].ut_tv.tv_sec != 0)
+      {
+        ut[i].ut_tv.tv_sec = tv[i].tv_sec;
+        ut[i].ut_tv.tv_usec = tv[i].tv_usec;
+      }
+}
+
+int
+main (int argc, char **argv)
+{
+  static struct utmp block[BLOCK];
+  const char *input = "-", *output = NULL;
+  char *map = NULL;
+  struct stat st;
+  size_t len = 0, n, i;
+  ssize_t res;
+  int opt, in = 0, out = 1, reverse = 0;
+
+  while ((opt = getopt (argc, argv, "ro:")) != -1)
+    switch (opt)
+      {
+      case 'r':
+        reverse = 1;
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      default:
+        fprintf (stderr, "Usage: t2p_utmp [-r] [-o output] [file]\n");
+        exit (2);
+      }
+
+  if (optind < argc)
+    input = argv[optind];
+
+  if (strcmp (input, "-"))
+    {
+      in = open (input, O_RDONLY | O_CLOEXEC);
+      if (in < 0)
+        {
+          perror (input);
+          exit (1);
+        }
+    }
+
+  if (fstat (in, &st))
+    {
+      perror (input);
+      exit (1);
+    }
+
+  /* (before the output is truncated, it would truncate the input) */
+  if (same_file (output, output != NULL ? -1 : out, &st))
+    {
+      fprintf (stderr, "t2p_utmp: %s: The output is the input file\n", input);
+      exit (1);
+    }
+
+  if (S_ISREG (st.st_mode) && st.st_size > 0)
+    {
+      map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, in, 0);
+      if (map == MAP_FAILED)
+        map = NULL;
+      else
+        madvise (map, st.st_size, MADV_SEQUENTIAL);
+    }
+
+  if (output != NULL)
+    {
+      out = open (output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (out < 0)
+        {
+          perror (output);
+          exit (1);
+        }
+    }
+
+  if (map != NULL)
+    {
+      n = st.st_size / sizeof (struct utmp);
+      for (i = 0; i < n; i += BLOCK)
+        convert ((struct utmp *) map + i, n - i < BLOCK ? n - i : BLOCK, reverse);
+      len = st.st_size;
+      if (write_all (out, map, len))
+        {
+          perror (output ? output : "t2p_utmp: write");
+          exit (1);
+        }
+    }
+  else
+    for (;;)
+      {
+        res = read_all (in, block, sizeof block);
+        if (res < 0)
+          {
+            perror (input);
+            exit (1);
+          }
+        if (res == 0)
+          break;
+
+        len = res;
+        convert (block, len / sizeof (struct utmp), reverse);
+        if (write_all (out, block, len))
+          {
+            perror (output ? output : "t2p_utmp: write");
+            exit (1);
+          }
+        if (len < sizeof block)
+          break;
+      }
+
+  if (len % sizeof (struct utmp))
+    fprintf (stderr, "t2p_utmp: %s: Incomplete record at the end copied as it is\n", input);
+
+  if (out != 1 && close (out))
+    {
+      perror (output);
+      exit (1);
+    }
+
+  exit (0);
+}
@@ -1,10 +1,23 @@
 /* 2014 by Marek Behun <kabel@blackhole.sk>
    This file is in public domain */
 
+/* recvmmsg */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 
 #include "time2posix.h"
 
+/* older headers know only the native layouts */
+#ifndef SIOCGSTAMP_OLD
+#define SIOCGSTAMP_OLD SIOCGSTAMP
+#define SIOCGSTAMPNS_OLD SIOCGSTAMPNS
+#endif
+
 time_t (*t2p_orig_time) (time_t *);
 int (*t2p_orig_stime) (const time_t *);
 int (*t2p_orig_clock_gettime) (clockid_t, struct timespec *);
@@ -16,15 +29,50 @@ int (*t2p_orig_adjtimex) (struct timex *);
 int (*t2p_orig_ntp_adjtime) (struct timex *);
 int (*t2p_orig_ntp_gettime) (struct ntptimeval *);
 ssize_t (*t2p_orig_recvmsg) (int, struct msghdr *, int);
+int (*t2p_orig_recvmmsg) (int, struct mmsghdr *, unsigned int, int, struct timespec *);
+int (*t2p_orig_ioctl) (int, unsigned long int, ...);
+
+time_t (*t2p_vdso_time) (time_t *);
+int (*t2p_vdso_clock_gettime) (clockid_t, struct timespec *);
+int (*t2p_vdso_gettimeofday) (struct timeval *, struct timezone *);
+
+#if defined __TIMESIZE && __TIMESIZE == 32
+int (*t2p_orig___clock_gettime64) (clockid_t, struct t2p_timespec64 *);
+int (*t2p_orig___clock_settime64) (clockid_t, const struct t2p_timespec64 *);
+#endif
+
+/* the vDSO returns -errno instead of setting errno */
+static inline int
+vdso_result (int res)
+{
+  if (__builtin_expect (res < 0, 0))
+    {
+      errno = -res;
+      return -1;
+    }
+  return res;
+}
 
 time_t time (time_t *t)
 {
   int state;
-  time_t res = t2p_orig_time (t);
-  if (res == (time_t) -1)
-    return res;
+  time_t res;
+
+  T2P_BIND ();
+  T2P_STAT (time);
+
+  /* (0 unless T2P_COARSE is on) */
+  res = __atomic_load_n (&t2p_coarse.sec, __ATOMIC_RELAXED);
+  if (res == 0)
+    {
+      if (__builtin_expect (__atomic_load_n (&t2p_coarse_stale, __ATOMIC_RELAXED), 0))
+        t2p_coarse_restart ();
+      res = t2p_vdso_time ? t2p_vdso_time (NULL) : t2p_orig_time (NULL);
+      if (res == (time_t) -1)
+        return res;
+      res = t2p_time2posix (res, &state);
+    }
 
-  res = t2p_time2posix (res, &state);
   if (t != NULL)
     *t = res;
   return res;
@@ -33,18 +81,44 @@ time_t time (time_t *t)
 int stime (const time_t *t)
 {
   int state;
-  if (t == NULL)
+
+  T2P_BIND ();
+  T2P_STAT (stime);
+  if (t == NULL && t2p_orig_stime != NULL)
     return t2p_orig_stime (t);
+  if (t == NULL)
+    {
+      errno = EFAULT;
+      return -1;
+    }
 
   time_t right = t2p_posix2time (*t, &state);
-  return t2p_orig_stime (&right);
+  if (t2p_orig_stime != NULL)
+    return t2p_orig_stime (&right);
+
+  /* stime is gone from newer libcs, it is the same as this */
+  struct timespec ts = { right, 0 };
+  return t2p_orig_clock_settime (CLOCK_REALTIME, &ts);
 }
 
 int
 clock_gettime (clockid_t clkid, struct timespec *ts)
 {
-  int res = t2p_orig_clock_gettime (clkid, ts);
-  if (clkid == CLOCK_REALTIME || clkid == CLOCK_REALTIME_COARSE)
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (clock_gettime);
+  if (clkid != CLOCK_REALTIME && clkid != CLOCK_REALTIME_COARSE)
+    return t2p_orig_clock_gettime (clkid, ts);
+
+  if (clkid == CLOCK_REALTIME_COARSE && (res = t2p_coarse_gettime (ts)) <= 0)
+    return res;
+
+  if (t2p_vdso_clock_gettime != NULL)
+    res = vdso_result (t2p_vdso_clock_gettime (clkid, ts));
+  else
+    res = t2p_orig_clock_gettime (clkid, ts);
+  if (res == 0)
     t2p_time2posix_timespec (ts);
   return res;
 }
@@ -52,6 +126,8 @@ clock_gettime (clockid_t clkid, struct timespec *ts)
 int
 clock_settime (clockid_t clkid, const struct timespec *ts)
 {
+  T2P_BIND ();
+  T2P_STAT (clock_settime);
   if (clkid == CLOCK_REALTIME)
     {
       struct timespec myts;
@@ -66,8 +142,15 @@ clock_settime (clockid_t clkid, const struct timespec *ts)
 int
 gettimeofday (struct timeval *tv, struct timezone *tz)
 {
-  int res = t2p_orig_gettimeofday (tv, tz);
-  if (tv != NULL)
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (gettimeofday);
+  if (t2p_vdso_gettimeofday != NULL)
+    res = vdso_result (t2p_vdso_gettimeofday (tv, tz));
+  else
+    res = t2p_orig_gettimeofday (tv, tz);
+  if (res == 0 && tv != NULL)
     t2p_time2posix_timeval (tv);
   return res;
 }
@@ -75,6 +158,8 @@ gettimeofday (struct timeval *tv, struct timezone *tz)
 int
 settimeofday (const struct timeval *tv, const struct timezone *tz)
 {
+  T2P_BIND ();
+  T2P_STAT (settimeofday);
   if (tv != NULL)
     {
       struct timeval mytv;
@@ -91,6 +176,8 @@ adjtimex (struct timex *buf)
 {
   int res, status;
 
+  T2P_BIND ();
+  T2P_STAT (adjtimex);
   if (buf == NULL)
     return t2p_orig_adjtimex (buf);
 
@@ -121,10 +208,12 @@ adjtimex (struct timex *buf)
 int
 clock_adjtime (clockid_t clkid, struct timex *buf)
 {
+  T2P_BIND ();
   if (clkid == CLOCK_REALTIME)
     return adjtimex (buf);
-  else
-    return t2p_orig_clock_adjtime (clkid, buf);
+
+  T2P_STAT (clock_adjtime);
+  return t2p_orig_clock_adjtime (clkid, buf);
 }
 
 /* ntp_adjtime is an alias for adjtimex in glibc */
@@ -137,36 +226,321 @@ ntp_adjtime (struct timex *buf)
 int
 ntp_gettime (struct ntptimeval *buf)
 {
-  int res = t2p_orig_ntp_gettime (buf);
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (ntp_gettime);
+  res = t2p_orig_ntp_gettime (buf);
   if (buf != NULL)
     t2p_time2posix_timeval (&buf->time);
   return res;
 }
 
-ssize_t
-recvmsg (int fd, struct msghdr *msg, int flags)
+#if defined __TIMESIZE && __TIMESIZE == 32
+/* The time64 entry points.  The table is in the native time_t, so the
+   realtime clock is read and set through the wrappers above and the
+   times are only widened or narrowed (EOVERFLOW after 2038, as the
+   native ones).  */
+
+int64_t
+__time64 (int64_t *t)
+{
+  time_t res = time (NULL);
+
+  if (res != (time_t) -1 && t != NULL)
+    *t = res;
+  return res;
+}
+
+int
+__clock_gettime64 (clockid_t clkid, struct t2p_timespec64 *ts)
+{
+  struct timespec nts;
+  int res;
+
+  T2P_BIND ();
+  if (clkid != CLOCK_REALTIME && clkid != CLOCK_REALTIME_COARSE)
+    return t2p_orig___clock_gettime64 (clkid, ts);
+
+  res = clock_gettime (clkid, &nts);
+  if (res == 0)
+    {
+      ts->tv_sec = nts.tv_sec;
+      ts->tv_nsec = nts.tv_nsec;
+    }
+  return res;
+}
+
+int
+__clock_settime64 (clockid_t clkid, const struct t2p_timespec64 *ts)
+{
+  struct timespec nts;
+
+  T2P_BIND ();
+  if (clkid != CLOCK_REALTIME)
+    return t2p_orig___clock_settime64 (clkid, ts);
+
+  nts.tv_sec = ts->tv_sec;
+  nts.tv_nsec = ts->tv_nsec;
+  if (nts.tv_sec != ts->tv_sec)
+    {
+      errno = EOVERFLOW;
+      return -1;
+    }
+  return clock_settime (clkid, &nts);
+}
+
+int
+__gettimeofday64 (struct t2p_timeval64 *tv, void *tz)
+{
+  struct timeval ntv;
+  int res;
+
+  res = gettimeofday (tv != NULL ? &ntv : NULL, tz);
+  if (res == 0 && tv != NULL)
+    {
+      tv->tv_sec = ntv.tv_sec;
+      tv->tv_usec = ntv.tv_usec;
+    }
+  return res;
+}
+
+int
+__settimeofday64 (const struct t2p_timeval64 *tv, const struct timezone *tz)
+{
+  struct timeval ntv;
+
+  if (tv == NULL)
+    return settimeofday (NULL, tz);
+
+  ntv.tv_sec = tv->tv_sec;
+  ntv.tv_usec = tv->tv_usec;
+  if (ntv.tv_sec != tv->tv_sec)
+    {
+      errno = EOVERFLOW;
+      return -1;
+    }
+  return settimeofday (&ntv, tz);
+}
+#endif
+
+/* Received timestamps, gathered from all control messages of a call and
+   converted in one pass.  The kernel passes them in the native timeval
+   and timespec, or with 64-bit fields for sockets which asked for the
+   _NEW (y2038 safe) variants.  */
+#define STAMPS_MAX 64
+
+enum stamp_kind { STAMP_TV, STAMP_TS, STAMP_TV64, STAMP_TS64 };
+
+struct stamps
+{
+  size_t n;
+  struct timespec ts[STAMPS_MAX];
+  unsigned char *data[STAMPS_MAX];
+  unsigned char kind[STAMPS_MAX];
+};
+
+/* convert the gathered timestamps and store them back */
+static void
+stamps_flush (struct stamps *s)
+{
+  struct timeval tv;
+  int64_t v[2];
+  size_t i;
+
+  t2p_time2posix_timespec_array (s->ts, s->ts, s->n, NULL);
+
+  for (i = 0; i < s->n; i++)
+    switch (s->kind[i])
+      {
+      case STAMP_TV:
+        tv.tv_sec = s->ts[i].tv_sec;
+        tv.tv_usec = s->ts[i].tv_nsec / 1000;
+        memcpy (s->data[i], &tv, sizeof (tv));
+        break;
+      case STAMP_TS:
+        memcpy (s->data[i], &s->ts[i], sizeof (struct timespec));
+        break;
+      default:
+        v[0] = s->ts[i].tv_sec;
+        v[1] = s->kind[i] == STAMP_TV64 ? s->ts[i].tv_nsec / 1000 : s->ts[i].tv_nsec;
+        memcpy (s->data[i], v, sizeof (v));
+        break;
+      }
+
+  s->n = 0;
+}
+
+/* the control message data may not be aligned, hence the copies */
+static void
+stamps_add (struct stamps *s, unsigned char *data, int kind)
+{
+  struct timespec *ts = &s->ts[s->n];
+  struct timeval tv;
+  int64_t v[2];
+
+  switch (kind)
+    {
+    case STAMP_TV:
+      memcpy (&tv, data, sizeof (tv));
+      ts->tv_sec = tv.tv_sec;
+      ts->tv_nsec = tv.tv_usec * 1000;
+      break;
+    case STAMP_TS:
+      memcpy (ts, data, sizeof (struct timespec));
+      break;
+    default:
+      memcpy (v, data, sizeof (v));
+      ts->tv_sec = v[0];
+      ts->tv_nsec = kind == STAMP_TV64 ? v[1] * 1000 : v[1];
+      break;
+    }
+
+  /* unused slots of struct scm_timestamping are zero */
+  if (ts->tv_sec == 0 && ts->tv_nsec == 0)
+    return;
+
+  if (__builtin_expect (t2p_fake_clock, 0))
+    t2p_fake_clock_map (ts);
+
+  s->data[s->n] = data;
+  s->kind[s->n] = kind;
+  if (++s->n == STAMPS_MAX)
+    stamps_flush (s);
+}
+
+static void
+stamps_add_msg (struct stamps *s, struct msghdr *msg)
 {
   struct cmsghdr *cmsg;
-  ssize_t res = t2p_orig_recvmsg (fd, msg, flags);
+  int i;
 
-  if (res < 0 || !msg->msg_control || !msg->msg_controllen)
-    return res;
+  if (!msg->msg_control || !msg->msg_controllen)
+    return;
 
   for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
     {
+      if (cmsg->cmsg_level != SOL_SOCKET)
+        continue;
+
       switch (cmsg->cmsg_type)
         {
-        case SCM_TIMESTAMPNS:
-          t2p_time2posix_timespec ((struct timespec *) CMSG_DATA(cmsg));
+        case SO_TIMESTAMP_OLD:
+          stamps_add (s, CMSG_DATA(cmsg), STAMP_TV);
+          break;
+        case SO_TIMESTAMPNS_OLD:
+          stamps_add (s, CMSG_DATA(cmsg), STAMP_TS);
           break;
-        case SCM_TIMESTAMP:
-          t2p_time2posix_timeval ((struct timeval *) CMSG_DATA(cmsg));
+        case SO_TIMESTAMPING_OLD:
+          /* software, (deprecated) and hardware timestamp */
+          for (i = 0; i < 3; i++)
+            stamps_add (s, CMSG_DATA(cmsg) + i * sizeof (struct timespec), STAMP_TS);
           break;
-        default:
-          /* TODO: SCM_TIMESTAMPING */
+#ifdef SO_TIMESTAMP_NEW
+        case SO_TIMESTAMP_NEW:
+          stamps_add (s, CMSG_DATA(cmsg), STAMP_TV64);
           break;
+        case SO_TIMESTAMPNS_NEW:
+          stamps_add (s, CMSG_DATA(cmsg), STAMP_TS64);
+          break;
+        case SO_TIMESTAMPING_NEW:
+          for (i = 0; i < 3; i++)
+            stamps_add (s, CMSG_DATA(cmsg) + i * 2 * sizeof (int64_t), STAMP_TS64);
+          break;
+#endif
         }
     }
+}
+
+ssize_t
+recvmsg (int fd, struct msghdr *msg, int flags)
+{
+  struct stamps s;
+  ssize_t res;
+
+  T2P_BIND ();
+  T2P_STAT (recvmsg);
+  if (!t2p_fd_stamping (fd))
+    return t2p_orig_recvmsg (fd, msg, flags);
+
+  res = t2p_orig_recvmsg (fd, msg, flags);
+  if (res < 0)
+    return res;
+
+  s.n = 0;
+  stamps_add_msg (&s, msg);
+  if (s.n)
+    stamps_flush (&s);
+
+  return res;
+}
+
+int
+recvmmsg (int fd, struct mmsghdr *vmessages, unsigned int vlen, int flags,
+          struct timespec *tmo)
+{
+  struct stamps s;
+  int res, i;
+
+  T2P_BIND ();
+  T2P_STAT (recvmmsg);
+  if (!t2p_fd_stamping (fd))
+    return t2p_orig_recvmmsg (fd, vmessages, vlen, flags, tmo);
+
+  res = t2p_orig_recvmmsg (fd, vmessages, vlen, flags, tmo);
+
+  s.n = 0;
+  for (i = 0; i < res; i++)
+    stamps_add_msg (&s, &vmessages[i].msg_hdr);
+  if (s.n)
+    stamps_flush (&s);
+
+  return res;
+}
+
+/* SIOCGSTAMP and SIOCGSTAMPNS return the timestamp of the last packet */
+int
+ioctl (int fd, unsigned long int request, ...)
+{
+  struct stamps s;
+  va_list ap;
+  void *arg;
+  int res, kind;
+
+  va_start (ap, request);
+  arg = va_arg (ap, void *);
+  va_end (ap);
+
+  T2P_BIND ();
+  T2P_STAT (ioctl);
+  res = t2p_orig_ioctl (fd, request, arg);
+  if (res < 0)
+    return res;
+
+  switch (request)
+    {
+    case SIOCGSTAMP_OLD:
+      kind = STAMP_TV;
+      break;
+    case SIOCGSTAMPNS_OLD:
+      kind = STAMP_TS;
+      break;
+#ifdef SIOCGSTAMP_NEW
+    case SIOCGSTAMP_NEW:
+      kind = STAMP_TV64;
+      break;
+    case SIOCGSTAMPNS_NEW:
+      kind = STAMP_TS64;
+      break;
+#endif
+    default:
+      return res;
+    }
+
+  s.n = 0;
+  stamps_add (&s, arg, kind);
+  if (s.n)
+    stamps_flush (&s);
 
   return res;
 }
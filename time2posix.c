@@ -1,396 +1,1785 @@
 /* 2014 by Marek Behun <kabel@blackhole.sk>
    This file is in public domain */
 
+/* RTLD_NEXT, dlvsym */
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <poll.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/mman.h>
-#include <endian.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <math.h>
 
 #include "time2posix.h"
 
-#define RIGHT_TZ "zoneinfo-leaps/UTC"
-#define LEAP_TZFILE ("/usr/share/" RIGHT_TZ)
+/* we don't need to re-read every time
+   (keep the same table at least for 30 days) */
+#define LEAPS_REREAD (86400*30)
+
+/* first retry after a failed read, doubled up to LEAPS_REREAD */
+#define LEAPS_RETRY 60
+
+/* how often the kernel offset and leap status are read (kernel.c) */
+#define KERNEL_POLL 60
+
+/* t2p_shmd renews the lease of the shared table every SHM_BEAT seconds
+   for SHM_LEASE seconds, after which the processes read their own */
+#define SHM_BEAT 60
+#define SHM_LEASE 300
+
+#define TIME_T_MAX ((time_t) (~0ULL >> (65 - 8*sizeof (time_t))))
+#define TIME_T_MIN (-TIME_T_MAX - 1)
+
+#define NS_PER_SEC 1000000000LL
+
+/* default window of the windowed smear modes and its limits
+   (the windows of two leap seconds must not overlap) */
+#define SMEAR_WINDOW 86400
+#define SMEAR_WINDOW_MIN 16
+#define SMEAR_WINDOW_MAX (86400*7)
+
+/* the cosine curve is interpolated between 2^SMEAR_BITS + 1 points */
+#define SMEAR_BITS 12
+
+/* count the conversions in the statistics, if they are on */
+#define STATS_START(start)						\
+  u_int64_t start = __builtin_expect (t2p_stats != NULL, 0) ? t2p_stat_clock () : 0
+
+#define STATS_DONE(start, n, leaps)					\
+  do									\
+    {									\
+      if (__builtin_expect (start != 0, 0))				\
+        t2p_stat_conversions (n, leaps, start);				\
+    }									\
+  while (0)
+
+/* fire the probe of a conversion, and record it in the tracer if it
+   hit a leap second */
+#define TRACE(probe, kind, in, in_nsec, out, out_nsec, state)		\
+  do									\
+    {									\
+      T2P_PROBE5 (probe, in, in_nsec, out, out_nsec, state);		\
+      if (__builtin_expect (state != 0 && t2p_tracing, 0))		\
+        t2p_trace (T2P_TRACE_##kind, in, in_nsec, out, out_nsec, state); \
+    }									\
+  while (0)
+
+/* Readers never wait or write anything, never see a half written
+   table, and no table is ever freed under them.  */
+static struct t2p_latch t2p_local_latch =
+  { .magic = T2P_LATCH_MAGIC, .size = sizeof (struct t2p_latch) };
+
+/* the latch readers use, the local one or the shared one */
+static struct t2p_latch *t2p_latch = &t2p_local_latch;
+
+/* serializes the writers */
+static pthread_mutex_t t2p_latch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* set by t2p_leaps_set, the local table is not read any more */
+static int t2p_leaps_fixed = 0;
+
+/* set while the table is the embedded one, not yet checked against
+   the file */
+static int t2p_leaps_embedded_used = 0;
+
+/* the table last read, before it was adjusted to the kernel (written by
+   the writers only) */
+static struct t2p_leaps t2p_leaps_loaded;
+
+/* set in t2p_shmd, whose tables have a lease */
+static int t2p_shm_writer = 0;
+
+/* The table is set up on the first conversion, not at exec, as most
+   processes never read the clock.  The file times only load it (see
+   latch_loaded).  TABLE_RESTART is set in the child after fork, whose
+   reloader is started on its first conversion too.  TABLE_DETACH is set
+   when the lease of the shared latch has expired, the process then reads
+   its own table on its next conversion.  */
+#define TABLE_READY 1
+#define TABLE_RESTART 2
+#define TABLE_DETACH 3
+
+static pthread_once_t t2p_table_once = PTHREAD_ONCE_INIT;
+static pthread_once_t t2p_load_once = PTHREAD_ONCE_INIT;
+static int t2p_table_ready = 0;
+
+static void t2p_table_init (void);
+static void t2p_table_load (void);
+static void t2p_table_local (void);
+static void t2p_reloader_start (void);
+
+static void
+latch_setup (void)
+{
+  int restart = TABLE_RESTART, detach = TABLE_DETACH;
+
+  pthread_once (&t2p_table_once, t2p_table_init);
+  if (__atomic_compare_exchange_n (&t2p_table_ready, &restart, TABLE_READY, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    t2p_reloader_start ();
+  else if (__atomic_compare_exchange_n (&t2p_table_ready, &detach, TABLE_READY, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    t2p_table_local ();
+}
+
+/* a right time past the lease of the table, t2p_shmd has stopped (the
+   table is still used for the conversion which found it) */
+static void
+latch_expired (void)
+{
+  int ready = TABLE_READY;
+
+  __atomic_compare_exchange_n (&t2p_table_ready, &ready, TABLE_DETACH, 0,
+                               __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/* the latch the conversions read */
+static inline const struct t2p_latch *
+latch_current (void)
+{
+  if (__builtin_expect (__atomic_load_n (&t2p_table_ready, __ATOMIC_ACQUIRE) != TABLE_READY, 0))
+    latch_setup ();
+  return t2p_latch;
+}
+
+/* the same for the file times, which do not start the threads (the
+   table may be one which nothing keeps up to date until the first
+   clock read) */
+static inline const struct t2p_latch *
+latch_loaded (void)
+{
+  if (__builtin_expect (!__atomic_load_n (&t2p_table_ready, __ATOMIC_ACQUIRE), 0))
+    pthread_once (&t2p_load_once, t2p_table_load);
+  return t2p_latch;
+}
+
+static inline const struct t2p_table *
+table_begin (const struct t2p_latch *latch, unsigned *seq)
+{
+  *seq = __atomic_load_n (&latch->seq, __ATOMIC_ACQUIRE);
+  return &latch->tables[*seq & 1];
+}
+
+static inline int
+table_retry (const struct t2p_latch *latch, unsigned seq)
+{
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  return __atomic_load_n (&latch->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* a reader racing with the writer may see any num before it retries,
+   it still must not run off the table */
+static inline size_t
+table_num (const struct t2p_table *tab)
+{
+  return tab->num < T2P_LEAPS_MAX ? tab->num : T2P_LEAPS_MAX;
+}
+
+/* Number of leap seconds with key <= t.  A branchless binary search over
+   all T2P_LEAPS_MAX padded keys, so it costs the same for any date.  */
+static inline size_t
+table_count (const struct t2p_table *tab, const time_t *keys, time_t t)
+{
+  const time_t *base = keys;
+  size_t n = T2P_LEAPS_MAX, half, res;
+
+  while (n > 1)
+    {
+      half = n / 2;
+      base = base[half] <= t ? base + half : base;
+      n -= half;
+    }
+
+  res = base - keys + (*base <= t);
+  return res < table_num (tab) ? res : table_num (tab);
+}
+
+/* fill the dense lookup keys from the leap second records */
+static void
+table_index (struct t2p_table *tab)
+{
+  size_t i;
+
+  for (i = 0; i < T2P_LEAPS_MAX; i++)
+    if (i < tab->num)
+      {
+        tab->transition[i] = tab->leapsecs[i].transition;
+        tab->posix_transition[i] = tab->leapsecs[i].posix_transition;
+        tab->change[i] = tab->leapsecs[i].change;
+      }
+    else
+      {
+        tab->transition[i] = TIME_T_MAX;
+        tab->posix_transition[i] = TIME_T_MAX;
+        tab->change[i] = 0;
+      }
+
+  /* (filled by table_smear in the windowed modes) */
+  for (i = 0; i < T2P_LEAPS_MAX; i++)
+    {
+      tab->smear_start[i] = TIME_T_MAX;
+      tab->smear_posix_start[i] = TIME_T_MAX;
+    }
+}
+
+/* must be called with t2p_latch_lock held */
+static void
+table_publish (struct t2p_latch *latch, const struct t2p_table *tab)
+{
+  unsigned seq = latch->seq + 1;
+
+  /* readers which still use the copy being overwritten
+     must see the new seq before they see any change in it */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  memcpy (&latch->tables[seq & 1], tab, sizeof (struct t2p_table));
+  __atomic_store_n (&latch->seq, seq, __ATOMIC_RELEASE);
+}
+
+static void
+latch_get (const struct t2p_latch *latch, struct t2p_table *tab)
+{
+  const struct t2p_table *cur;
+  unsigned seq;
+
+  do
+    {
+      cur = table_begin (latch, &seq);
+      memcpy (tab, cur, sizeof (struct t2p_table));
+    }
+  while (table_retry (latch, seq));
+}
+
+/* copy the current table */
+void
+t2p_table_get (struct t2p_table *tab)
+{
+  latch_get (latch_current (), tab);
+}
+
+/* copy the cached span of the current table */
+void
+t2p_span_get (struct t2p_offset_cache *c)
+{
+  const struct t2p_latch *latch = latch_current ();
+  const struct t2p_table *cur;
+  unsigned seq;
+
+  do
+    {
+      cur = table_begin (latch, &seq);
+      memcpy (c, &cur->cache, sizeof (struct t2p_offset_cache));
+    }
+  while (table_retry (latch, seq));
+}
+
+/* set after a failed read, so that the error is reported only once */
+static int t2p_leaps_failing = 0;
+
+#define leaps_error(...)			\
+  do						\
+    {						\
+      if (!t2p_leaps_failing)			\
+        fprintf (stderr, __VA_ARGS__);		\
+      t2p_leaps_failing = 1;			\
+    }						\
+  while (0)
+
+/* compute the span after the first i leap seconds (in the windowed
+   smear modes after the first i windows, the span excludes them) */
+static void
+table_span (const struct t2p_table *tab, size_t i, struct t2p_offset_cache *c)
+{
+  const struct leapsecond *ptr, *next;
+
+  ptr = i > 0 ? tab->leapsecs + i - 1 : NULL;
+  next = i < table_num (tab) ? tab->leapsecs + i : NULL;
+
+  if (T2P_SMEAR_WINDOWED (tab->smear))
+    {
+      c->right_start = ptr ? tab->smears[i-1].right_end : TIME_T_MIN;
+      c->posix_start = ptr ? tab->smears[i-1].posix_end : TIME_T_MIN;
+      c->right_end = next ? tab->smear_start[i] : TIME_T_MAX;
+      c->posix_end = next ? tab->smear_posix_start[i] : TIME_T_MAX;
+      c->daystart = next ? next->daystart : TIME_T_MAX;
+      c->change = ptr ? ptr->change : 0;
+      return;
+    }
+
+  /* the second(s) of the leap itself are left to the slow path */
+  c->right_start = ptr ? ptr->transition + 1 + ptr->type : TIME_T_MIN;
+  c->posix_start = ptr ? ptr->posix_transition + 1 + !ptr->type : TIME_T_MIN;
+  c->right_end = next ? next->transition : TIME_T_MAX;
+  c->posix_end = next ? next->posix_transition : TIME_T_MAX;
+  c->daystart = next ? next->daystart : TIME_T_MAX;
+  c->change = ptr ? ptr->change : 0;
+}
+
+/* the span which contains (or follows) right time t */
+static inline void
+table_span_right (const struct t2p_table *tab, time_t t, struct t2p_offset_cache *c)
+{
+  table_span (tab, table_count (tab, T2P_SMEAR_WINDOWED (tab->smear)
+                                     ? tab->smear_start : tab->transition, t), c);
+}
+
+/* the span which contains (or follows) posix time t */
+static inline void
+table_span_posix (const struct t2p_table *tab, time_t t, struct t2p_offset_cache *c)
+{
+  table_span (tab, table_count (tab, T2P_SMEAR_WINDOWED (tab->smear)
+                                     ? tab->smear_posix_start : tab->posix_transition, t), c);
+}
+
+/* compute the span between leap seconds which contains now (in
+   t2p_shmd it ends at the next renewal of the lease, so that its
+   watcher wakes up for it) */
+static void
+t2p_cache_update (struct t2p_table *tab, time_t now)
+{
+  table_span_right (tab, now, &tab->cache);
+  tab->cache.lease = TIME_T_MAX;
+  if (!t2p_shm_writer)
+    return;
+
+  tab->cache.lease = now + SHM_LEASE;
+  if (tab->cache.right_end > now + SHM_BEAT)
+    {
+      tab->cache.right_end = now + SHM_BEAT;
+      tab->cache.posix_end = now + SHM_BEAT - tab->cache.change;
+    }
+}
+
+/* move the cached span of the current table to now */
+static void
+t2p_cache_refresh (struct t2p_latch *latch, time_t now)
+{
+  struct t2p_table tab;
+
+  pthread_mutex_lock (&t2p_latch_lock);
+  memcpy (&tab, &latch->tables[latch->seq & 1], sizeof (struct t2p_table));
+  t2p_cache_update (&tab, now);
+  table_publish (latch, &tab);
+  pthread_mutex_unlock (&t2p_latch_lock);
+}
+
+/* (1 - cos (pi x)) / 2 in ns, built when a cosine table is set up, so
+   that the conversions in the windows do not call libm */
+static u_int32_t t2p_smear_cosine[(1 << SMEAR_BITS) + 1];
+static pthread_once_t t2p_smear_once = PTHREAD_ONCE_INIT;
+static int t2p_smear_ready = 0;
+
+static void
+smear_cosine_init (void)
+{
+  int i;
+
+  for (i = 0; i <= 1 << SMEAR_BITS; i++)
+    t2p_smear_cosine[i] = (1 - cos (M_PI * i / (1 << SMEAR_BITS))) / 2 * NS_PER_SEC + 0.5;
+
+  __atomic_store_n (&t2p_smear_ready, 1, __ATOMIC_RELEASE);
+}
+
+static void
+smear_cosine_setup (void)
+{
+  pthread_once (&t2p_smear_once, smear_cosine_init);
+}
+
+/* read the smear mode from the environment and compute the windows of
+   the leap seconds (after table_index) */
+static void
+table_smear (struct t2p_table *tab)
+{
+  const char *mode = secure_getenv ("T2P_SMEAR");
+  const char *window = secure_getenv ("T2P_SMEAR_WINDOW");
+  const char *align = secure_getenv ("T2P_SMEAR_ALIGN");
+  const struct leapsecond *ptr;
+  time_t w, midnight, start;
+  size_t i;
+
+  tab->smear = T2P_SMEAR_1S;
+  if (mode == NULL || !strcmp (mode, "1s"))
+    return;
+  else if (!strcmp (mode, "none"))
+    {
+      tab->smear = T2P_SMEAR_NONE;
+      return;
+    }
+  else if (!strcmp (mode, "linear"))
+    tab->smear = T2P_SMEAR_LINEAR;
+  else if (!strcmp (mode, "cosine"))
+    {
+      tab->smear = T2P_SMEAR_COSINE;
+      smear_cosine_setup ();
+    }
+  else
+    {
+      fprintf (stderr, "time2posix warning: Unknown T2P_SMEAR mode %s, using 1s !\n", mode);
+      return;
+    }
+
+  w = window != NULL ? strtol (window, NULL, 10) : SMEAR_WINDOW;
+  if (w < SMEAR_WINDOW_MIN)
+    w = SMEAR_WINDOW_MIN;
+  else if (w > SMEAR_WINDOW_MAX)
+    w = SMEAR_WINDOW_MAX;
 
-struct leapsecond *t2p_leapsecs = NULL;
-size_t t2p_leapsecs_num = 0;
-time_t t2p_last_read = 0;
+  for (i = 0, ptr = tab->leapsecs; i < tab->num; i++, ptr++)
+    {
+      /* posix 00:00:00 after the leap second */
+      midnight = ptr->posix_transition + 1 + !ptr->type;
+
+      if (align != NULL && !strcmp (align, "end"))
+        start = midnight - w;
+      else if (align != NULL && !strcmp (align, "start"))
+        start = midnight;
+      else
+        start = midnight - w/2;
+
+      /* the window is w posix seconds, and w +- 1 right seconds */
+      tab->smear_posix_start[i] = start;
+      tab->smear_start[i] = start + ptr->prev_change;
+      tab->smears[i].posix_end = start + w;
+      tab->smears[i].right_end = start + w + ptr->change;
+      tab->smears[i].inv = ((unsigned __int128) 1 << 96)
+                           / ((u_int64_t) (w + ptr->change - ptr->prev_change) * NS_PER_SEC);
+    }
+}
+
+/* the clock, read by the writers (in t2p_shmd there may have been no
+   wrapper call to bind the original functions yet) */
+static time_t
+leaps_now (void)
+{
+  T2P_BIND ();
+  return t2p_orig_time (NULL);
+}
 
-/* read the leap seconds table */
+/* read the leap seconds table into the local latch
+   (never called from the conversion functions, only from t2p_table_init
+   and the reloader thread) */
 int
 t2p_leaps_read (void)
 {
-  int fd, prev_change;
-  const char *buf;
-  const u_int32_t *lbuf;
-  u_int32_t n, skip, i;
-  struct leapsecond *ptr, *leapsecs;
-  time_t now;
-
-  /* we don't need to re-read every time
-     (keep the same table at least for 30 days) */
-  now = t2p_orig_time (NULL);
-  if (now < (t2p_last_read + 86400*30))
+  if (t2p_leaps_fixed)
     return 0;
+  return t2p_latch_read (&t2p_local_latch);
+}
 
-  /* does O_NONBLOCK need to be here if we are mmapping? */
-  fd = open (LEAP_TZFILE, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
-  if (fd < 0)
+static int latch_read (struct t2p_latch *);
+static void table_build (struct t2p_table *, const time_t *, const int *, size_t);
+
+/* read the leap seconds table and publish it in the latch */
+int
+t2p_latch_read (struct t2p_latch *latch)
+{
+  int res;
+
+  if (latch != &t2p_local_latch)
+    t2p_shm_writer = 1;
+
+  res = latch_read (latch);
+
+  T2P_PROBE2 (reload, res, latch->seq);
+  if (t2p_tracing)
+    t2p_trace (T2P_TRACE_RELOAD, latch->seq, 0, 0, 0, res);
+  if (t2p_stats != NULL)
+    __atomic_fetch_add (res ? &t2p_stats->reload_failures : &t2p_stats->reloads, 1,
+                        __ATOMIC_RELAXED);
+  return res;
+}
+
+/* publish the table (adjusted to the kernel, see kernel.c), unless it
+   was replaced by t2p_leaps_set */
+static void
+latch_publish (struct t2p_latch *latch, const struct t2p_leaps *leaps)
+{
+  struct t2p_leaps adjusted;
+  struct t2p_table tab;
+
+  if (leaps != &t2p_leaps_loaded)
+    memcpy (&t2p_leaps_loaded, leaps, sizeof (struct t2p_leaps));
+
+  if (t2p_kernel_on ())
     {
-      fprintf (stderr, "time2posix error: Cannot open %s !\n", LEAP_TZFILE);
+      memcpy (&adjusted, leaps, sizeof (struct t2p_leaps));
+      t2p_kernel_apply (&adjusted, leaps_now ());
+      leaps = &adjusted;
+    }
+
+  table_build (&tab, leaps->transition, leaps->change, leaps->num);
+
+  pthread_mutex_lock (&t2p_latch_lock);
+  if (latch != &t2p_local_latch || !t2p_leaps_fixed)
+    table_publish (latch, &tab);
+  pthread_mutex_unlock (&t2p_latch_lock);
+}
+
+static int
+latch_read (struct t2p_latch *latch)
+{
+  struct t2p_leaps leaps;
+  struct t2p_leaps_source src;
+
+  if (t2p_leaps_load (&leaps, &src, 1))
+    {
+      /* (better than no table, until a file can be read) */
+      if (latch->tables[latch->seq & 1].num == 0 && t2p_leaps_embedded.num)
+        {
+          leaps_error ("time2posix error: %s %s ! Using the built-in table.\n", src.error, src.path);
+          latch_publish (latch, &t2p_leaps_embedded);
+        }
+      else
+        {
+          leaps_error ("time2posix error: %s %s !%s\n", src.error, src.path,
+                       latch->seq ? " Using old table." : "");
+
+          /* (the kernel may know the offset) */
+          if (latch->seq == 0 && t2p_kernel_on ())
+            latch_publish (latch, &t2p_leaps_embedded);
+        }
       return -1;
     }
 
-  /* right/UTC shouldn't be bigger than 4096B */
-  buf = mmap (NULL, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
-  close (fd);
-  if (buf == MAP_FAILED)
+  latch_publish (latch, &leaps);
+  t2p_leaps_failing = 0;
+  t2p_leaps_embedded_used = 0;
+  return 0;
+}
+
+/* Use the embedded table at startup as it is, without reading any file,
+   if no leap second can have been announced since it was generated (the
+   reloader reads the file right away).  */
+static int
+leaps_read_embedded (void)
+{
+  const struct t2p_leaps *leaps = &t2p_leaps_embedded;
+  const char *env = secure_getenv ("T2P_LEAPS");
+
+  /* (the clock is right time, the expiry posix time after all of the
+     table's leap seconds) */
+  if ((env != NULL && *env) || leaps->num == 0
+      || leaps_now () - leaps->change[leaps->num-1] >= leaps->expires)
+    return -1;
+
+  latch_publish (&t2p_local_latch, &t2p_leaps_embedded);
+  t2p_leaps_embedded_used = 1;
+  return 0;
+}
+
+/* fill the table with the n leap seconds at the right times transitions,
+   after which the total change is changes */
+static void
+table_build (struct t2p_table *tab, const time_t *transitions, const int *changes, size_t n)
+{
+  struct leapsecond *ptr;
+  int prev_change = 0;
+  size_t i;
+
+  for (i = 0, ptr = tab->leapsecs; i < n; i++, ptr++)
+    {
+      time_t transition, daystart, posix_daystart;
+      int change, type;
+
+      transition = transitions[i];
+      change = changes[i];
+      type = change > prev_change;
+
+      /* inserted is always 86400th second of the day,
+         but deleted should be 86399th */
+      daystart = transition - 86400 + !type;
+      posix_daystart = daystart - prev_change;
+
+      ptr->type = type;
+
+      /* and we want to prolong the 23:59:59, not 00:00:00, if inserting
+         (therefore subtracting one second if type == 1) */
+      ptr->transition = transition - type;
+      ptr->posix_transition = ptr->transition - prev_change;
+      ptr->daystart = daystart;
+      ptr->posix_daystart = posix_daystart;
+      ptr->prev_change = prev_change;
+      ptr->change = change;
+
+      prev_change = change;
+    }
+
+  tab->num = n;
+  table_index (tab);
+  table_smear (tab);
+  t2p_cache_update (tab, leaps_now ());
+}
+
+/* Replace the table with the given one (for tests, see table_build),
+   in the local latch, which is not reloaded any more.  */
+int
+t2p_leaps_set (const time_t *transitions, const int *changes, size_t n)
+{
+  struct t2p_table tab;
+
+  if (n > T2P_LEAPS_MAX)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  latch_current ();
+  table_build (&tab, transitions, changes, n);
+
+  pthread_mutex_lock (&t2p_latch_lock);
+  t2p_leaps_fixed = 1;
+  table_publish (&t2p_local_latch, &tab);
+  pthread_mutex_unlock (&t2p_latch_lock);
+  __atomic_store_n (&t2p_latch, &t2p_local_latch, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+/* the part of the leap second (in ns) which has been spread when x ns of
+   window s have passed */
+static inline int64_t
+smear_offset (const struct t2p_table *tab, const struct t2p_smear *s, u_int64_t x)
+{
+  /* the fraction of the window, in 1/2^32 */
+  u_int32_t u = ((unsigned __int128) x * s->inv) >> 64;
+  u_int32_t idx, frac;
+
+  if (tab->smear == T2P_SMEAR_LINEAR)
+    return ((u_int64_t) u * NS_PER_SEC) >> 32;
+
+  /* (only if t2p_shmd switched to cosine after the process attached) */
+  if (__builtin_expect (!__atomic_load_n (&t2p_smear_ready, __ATOMIC_ACQUIRE), 0))
+    smear_cosine_setup ();
+
+  idx = u >> (32 - SMEAR_BITS);
+  frac = u & ((1U << (32 - SMEAR_BITS)) - 1);
+  return t2p_smear_cosine[idx]
+         + (((int64_t) t2p_smear_cosine[idx+1] - t2p_smear_cosine[idx]) * frac >> (32 - SMEAR_BITS));
+}
+
+/* t2p_time2posix_timespec in the windowed smear modes */
+static inline struct timespec
+smear_time2posix (const struct t2p_table *tab, struct timespec ts)
+{
+  const struct t2p_smear *s;
+  size_t i;
+  int64_t ns;
+  int sign;
+
+  i = table_count (tab, tab->smear_start, ts.tv_sec);
+  if (i-- == 0)
+    return ts;
+
+  s = tab->smears + i;
+  if (ts.tv_sec >= s->right_end)
+    {
+      ts.tv_sec -= tab->change[i];
+      return ts;
+    }
+
+  sign = tab->change[i] - tab->leapsecs[i].prev_change;
+  ns = ts.tv_nsec - sign * smear_offset (tab, s, (ts.tv_sec - tab->smear_start[i]) * NS_PER_SEC
+                                                  + ts.tv_nsec);
+  ts.tv_sec -= tab->leapsecs[i].prev_change;
+  if (ns < 0)
+    {
+      ns += NS_PER_SEC;
+      ts.tv_sec--;
+    }
+  else if (ns >= NS_PER_SEC)
     {
-      fprintf (stderr, "time2posix error: Cannot mmap %s !\n", LEAP_TZFILE);
-      return (-1);
+      ns -= NS_PER_SEC;
+      ts.tv_sec++;
     }
+  ts.tv_nsec = ns;
 
-  /* check the header */
-  if (memcmp (buf, (const void *) "TZif", 4))
+  return ts;
+}
+
+/* t2p_posix2time_timespec in the windowed smear modes */
+static inline struct timespec
+smear_posix2time (const struct t2p_table *tab, struct timespec ts)
+{
+  const struct t2p_smear *s;
+  int64_t x, xp, span;
+  size_t i;
+  int sign, k;
+
+  i = table_count (tab, tab->smear_posix_start, ts.tv_sec);
+  if (i-- == 0)
+    return ts;
+
+  s = tab->smears + i;
+  if (ts.tv_sec >= s->posix_end)
     {
-      fprintf (stderr, "time2posix error: Invalid %s header !\n", LEAP_TZFILE);
-      goto err;
+      ts.tv_sec += tab->change[i];
+      return ts;
     }
 
-  lbuf = (const u_int32_t *) buf;
+  /* right = posix + the spread part at right, which changes by at most
+     pi/2 / (window + 1) of the difference in right, so this converges
+     to the ns in a few steps (2 or 3 for the default window) */
+  sign = tab->change[i] - tab->leapsecs[i].prev_change;
+  span = (s->right_end - tab->smear_start[i]) * NS_PER_SEC;
+  xp = (ts.tv_sec - tab->smear_posix_start[i]) * NS_PER_SEC + ts.tv_nsec;
+  for (x = xp, k = 0; k < 16; k++)
+    {
+      int64_t prev = x < 0 ? 0 : x >= span ? span - 1 : x;
+
+      x = xp + sign * smear_offset (tab, s, prev);
+      if (x == prev)
+        break;
+    }
 
-  /* number of leap seconds in database */
-  n = be32toh (lbuf[7]);
-  if (n == 0)
+  ts.tv_sec = tab->smear_start[i] + x / NS_PER_SEC;
+  ts.tv_nsec = x % NS_PER_SEC;
+  if (ts.tv_nsec < 0)
     {
-      fprintf (stderr, "time2posix warning: No leap seconds in %s !%s\n", LEAP_TZFILE,
-               t2p_leapsecs != NULL ? " Using old table." : "");
-      goto end;
+      ts.tv_nsec += NS_PER_SEC;
+      ts.tv_sec--;
     }
 
-  leapsecs = malloc (n * sizeof (struct leapsecond));
-  if (leapsecs == NULL)
+  return ts;
+}
+
+/* t2p_time2posix on the given table */
+static inline time_t
+time2posix_in (const struct t2p_table *tab, time_t t, int *state)
+{
+  const struct leapsecond *ptr;
+  time_t res;
+  size_t i;
+
+  /* fast path: no leap second between t and the current time */
+  if (t >= tab->cache.right_start && t < tab->cache.right_end)
+    {
+      *state = 0;
+      return t - tab->cache.change;
+    }
+
+  if (__builtin_expect (t >= tab->cache.lease, 0))
+    latch_expired ();
+
+  if (T2P_SMEAR_WINDOWED (tab->smear))
+    {
+      struct timespec ts = { t, 0 };
+      *state = 0;
+      return smear_time2posix (tab, ts).tv_sec;
+    }
+
+  i = table_count (tab, tab->transition, t);
+  if (i-- == 0)
+    {
+      *state = 0;
+      return t;
+    }
+
+  res = t - tab->change[i];
+
+  /* not in the leap second itself */
+  if (t - tab->transition[i] > 1)
+    {
+      *state = 0;
+      return res;
+    }
+
+  ptr = tab->leapsecs + i;
+
+  if (ptr->type && t-1 == ptr->transition)
+    *state = 2;
+  else if (ptr->type && t == ptr->transition)
+    {
+      *state = 1;
+      res++;
+    }
+  else if (!ptr->type && t == ptr->transition)
+    {
+      *state = -1;
+      res--;
+    }
+  else
+    *state = 0;
+
+  return res;
+}
+
+/* Convert right timestamp to a posix timestamp.
+   If a leap second is being inserted at t+1, *state is set to 1.
+   If a leap second is being inesrted at t, *state is set to 2.
+   If a leap second is being deleted at t+1, *state is set to -1.
+   Otherwise, *state is set to 0.
+
+   Example:
+
+   time       time2posix state
+   1341100821 1341100797 0
+   1341100822 1341100798 0
+   1341100823 1341100799 1
+   1341100824 1341100799 2
+   1341100825 1341100800 0
+   1341100826 1341100801 0
+   */
+time_t
+t2p_time2posix (time_t t, int *state)
+{
+  const struct t2p_latch *latch = latch_current ();
+  const struct t2p_table *tab;
+  unsigned seq;
+  time_t res;
+  STATS_START (start);
+
+  do
+    {
+      tab = table_begin (latch, &seq);
+      res = time2posix_in (tab, t, state);
+    }
+  while (table_retry (latch, seq));
+
+  STATS_DONE (start, 1, *state != 0);
+  TRACE (time2posix, TIME2POSIX, t, 0, res, 0, *state);
+  return res;
+}
+
+/* t2p_posix2time on the given table */
+static inline time_t
+posix2time_in (const struct t2p_table *tab, time_t t, int *state)
+{
+  const struct leapsecond *ptr;
+  time_t res;
+  size_t i;
+
+  /* fast path: no leap second between t and the current time */
+  if (t >= tab->cache.posix_start && t < tab->cache.posix_end)
+    {
+      *state = 0;
+      return t + tab->cache.change;
+    }
+
+  if (T2P_SMEAR_WINDOWED (tab->smear))
+    {
+      struct timespec ts = { t, 0 };
+      *state = 0;
+      return smear_posix2time (tab, ts).tv_sec;
+    }
+
+  i = table_count (tab, tab->posix_transition, t);
+  if (i-- == 0)
+    {
+      *state = 0;
+      return t;
+    }
+
+  res = t + tab->change[i];
+
+  /* not in the leap second itself */
+  if (t - tab->posix_transition[i] > 1)
+    {
+      *state = 0;
+      return res;
+    }
+
+  ptr = tab->leapsecs + i;
+
+  if (ptr->type && t == ptr->posix_transition)
+    {
+      *state = 1;
+      res--;
+    }
+  else if (!ptr->type && t == ptr->posix_transition)
+    {
+      *state = -1;
+      res++;
+    }
+  else if (!ptr->type && t-1 == ptr->posix_transition)
+    *state = -2;
+  else
+    *state = 0;
+
+  return res;
+}
+
+/* Convert a posix timestamp to a right timestamp.
+   If a leap second is being inserted at t+1, *state is set to 1.
+   If a leap second is being deleted at t+1, *state is set to -1.
+   If a leap second is being deleted at t, *state is set to -2.
+   Otherwise, *state is set to 0.
+
+   Example:
+
+   time       posix2time state
+   1341100797 1341100821 0
+   1341100798 1341100822 0
+   1341100799 1341100823 1
+   1341100800 1341100825 0
+   1341100801 1341100826 0
+   */
+time_t
+t2p_posix2time (time_t t, int *state)
+{
+  const struct t2p_latch *latch = latch_current ();
+  const struct t2p_table *tab;
+  unsigned seq;
+  time_t res;
+  STATS_START (start);
+
+  do
+    {
+      tab = table_begin (latch, &seq);
+      res = posix2time_in (tab, t, state);
+    }
+  while (table_retry (latch, seq));
+
+  STATS_DONE (start, 1, *state != 0);
+  TRACE (posix2time, POSIX2TIME, t, 0, res, 0, *state);
+  return res;
+}
+
+/* normalize struct timeval */
+inline struct timeval *
+t2p_normalize_timeval (struct timeval *tv)
+{
+  while (tv->tv_usec >= 1000000)
+    {
+      tv->tv_usec -= 1000000;
+      tv->tv_sec ++;
+    }
+  return tv;
+}
+
+/* adjust tv_usec after t2p_time2posix returned state */
+static inline struct timeval *
+time2posix_tv (struct timeval *tv, int state)
+{
+  if (state == 1)
+    tv->tv_usec >>= 1;
+  else if (state == 2)
+    tv->tv_usec = (tv->tv_usec + 1000000) >> 1;
+  else if (state == -1)
+    {
+      tv->tv_usec <<= 1;
+      t2p_normalize_timeval (tv);
+    }
+  return tv;
+}
+
+/* adjust tv_usec after t2p_posix2time returned state */
+static inline struct timeval *
+posix2time_tv (struct timeval *tv, int state)
+{
+  if (state == 1)
+    {
+      tv->tv_usec <<= 1;
+      t2p_normalize_timeval (tv);
+    }
+  else if (state == -1)
+    tv->tv_usec >>= 1;
+  else if (state == -2)
+    tv->tv_usec = (tv->tv_usec + 1000000) >> 1;
+  return tv;
+}
+
+/* normalize struct timespec */
+inline struct timespec *
+t2p_normalize_timespec (struct timespec *ts)
+{
+  while (ts->tv_nsec >= 1000000000)
+    {
+      ts->tv_nsec -= 1000000000;
+      ts->tv_sec ++;
+    }
+  return ts;
+}
+
+/* adjust tv_nsec after t2p_time2posix returned state */
+static inline struct timespec *
+time2posix_ts (struct timespec *ts, int state)
+{
+  if (state == 1)
+    ts->tv_nsec >>= 1;
+  else if (state == 2)
+    ts->tv_nsec = (ts->tv_nsec + 1000000000) >> 1;
+  else if (state == -1)
+    {
+      ts->tv_nsec <<= 1;
+      t2p_normalize_timespec (ts);
+    }
+  return ts;
+}
+
+/* adjust tv_nsec after t2p_posix2time returned state */
+static inline struct timespec *
+posix2time_ts (struct timespec *ts, int state)
+{
+  if (state == 1)
+    {
+      ts->tv_nsec <<= 1;
+      t2p_normalize_timespec (ts);
+    }
+  else if (state == -1)
+    ts->tv_nsec >>= 1;
+  else if (state == -2)
+    ts->tv_nsec = (ts->tv_nsec + 1000000000) >> 1;
+  return ts;
+}
+
+/* t2p_time2posix_timeval on the given table */
+static inline struct timeval
+time2posix_tv_in (const struct t2p_table *tab, struct timeval tv, int *state)
+{
+  if (T2P_SMEAR_WINDOWED (tab->smear)
+      && (tv.tv_sec < tab->cache.right_start || tv.tv_sec >= tab->cache.right_end))
+    {
+      struct timespec ts = { tv.tv_sec, tv.tv_usec * 1000 };
+
+      if (__builtin_expect (tv.tv_sec >= tab->cache.lease, 0))
+        latch_expired ();
+      ts = smear_time2posix (tab, ts);
+      tv.tv_sec = ts.tv_sec;
+      tv.tv_usec = ts.tv_nsec / 1000;
+      *state = 0;
+      return tv;
+    }
+
+  tv.tv_sec = time2posix_in (tab, tv.tv_sec, state);
+  return *time2posix_tv (&tv, tab->smear == T2P_SMEAR_1S ? *state : 0);
+}
+
+/* t2p_posix2time_timeval on the given table */
+static inline struct timeval
+posix2time_tv_in (const struct t2p_table *tab, struct timeval tv, int *state)
+{
+  if (T2P_SMEAR_WINDOWED (tab->smear)
+      && (tv.tv_sec < tab->cache.posix_start || tv.tv_sec >= tab->cache.posix_end))
+    {
+      struct timespec ts = { tv.tv_sec, tv.tv_usec * 1000 };
+      ts = smear_posix2time (tab, ts);
+      tv.tv_sec = ts.tv_sec;
+      tv.tv_usec = ts.tv_nsec / 1000;
+      *state = 0;
+      return tv;
+    }
+
+  tv.tv_sec = posix2time_in (tab, tv.tv_sec, state);
+  return *posix2time_tv (&tv, tab->smear == T2P_SMEAR_1S ? *state : 0);
+}
+
+/* t2p_time2posix_timespec on the given table */
+static inline struct timespec
+time2posix_ts_in (const struct t2p_table *tab, struct timespec ts, int *state)
+{
+  if (T2P_SMEAR_WINDOWED (tab->smear)
+      && (ts.tv_sec < tab->cache.right_start || ts.tv_sec >= tab->cache.right_end))
+    {
+      if (__builtin_expect (ts.tv_sec >= tab->cache.lease, 0))
+        latch_expired ();
+      *state = 0;
+      return smear_time2posix (tab, ts);
+    }
+
+  ts.tv_sec = time2posix_in (tab, ts.tv_sec, state);
+  return *time2posix_ts (&ts, tab->smear == T2P_SMEAR_1S ? *state : 0);
+}
+
+/* t2p_posix2time_timespec on the given table */
+static inline struct timespec
+posix2time_ts_in (const struct t2p_table *tab, struct timespec ts, int *state)
+{
+  if (T2P_SMEAR_WINDOWED (tab->smear)
+      && (ts.tv_sec < tab->cache.posix_start || ts.tv_sec >= tab->cache.posix_end))
+    {
+      *state = 0;
+      return smear_posix2time (tab, ts);
+    }
+
+  ts.tv_sec = posix2time_in (tab, ts.tv_sec, state);
+  return *posix2time_ts (&ts, tab->smear == T2P_SMEAR_1S ? *state : 0);
+}
+
+/* Convert a right timeval to a posix timeval.
+   If leap second is being inserted, simulates slowdown of the 23:59:59 second.
+   (That means that 2 second will pass from 23:59:59 to 00:00:00).
+   If a leap second is being deleted, simulates speedup of the 23:59:58 second.
+   (That means that 1 second will pass from 23:59:58 to 00:00:00).
+   In the other smear modes (see T2P_SMEAR_1S) accordingly.  */
+struct timeval *
+t2p_time2posix_timeval (struct timeval *tv)
+{
+  const struct t2p_latch *latch = latch_current ();
+  struct timeval res;
+  unsigned seq;
+  int state;
+  STATS_START (start);
+
+  do
+    res = time2posix_tv_in (table_begin (latch, &seq), *tv, &state);
+  while (table_retry (latch, seq));
+
+  STATS_DONE (start, 1, state != 0);
+  TRACE (time2posix, TIME2POSIX, tv->tv_sec, tv->tv_usec * 1000, res.tv_sec, res.tv_usec * 1000, state);
+  *tv = res;
+  return tv;
+}
+
+/* Inverse to the previous function. */
+struct timeval *
+t2p_posix2time_timeval (struct timeval *tv)
+{
+  const struct t2p_latch *latch = latch_current ();
+  struct timeval res;
+  unsigned seq;
+  int state;
+  STATS_START (start);
+
+  do
+    res = posix2time_tv_in (table_begin (latch, &seq), *tv, &state);
+  while (table_retry (latch, seq));
+
+  STATS_DONE (start, 1, state != 0);
+  TRACE (posix2time, POSIX2TIME, tv->tv_sec, tv->tv_usec * 1000, res.tv_sec, res.tv_usec * 1000, state);
+  *tv = res;
+  return tv;
+}
+
+/* struct timespec version of t2p_time2posix_timeval */
+struct timespec *
+t2p_time2posix_timespec (struct timespec *ts)
+{
+  const struct t2p_latch *latch = latch_current ();
+  struct timespec res;
+  unsigned seq;
+  int state;
+  STATS_START (start);
+
+  do
+    res = time2posix_ts_in (table_begin (latch, &seq), *ts, &state);
+  while (table_retry (latch, seq));
+
+  STATS_DONE (start, 1, state != 0);
+  TRACE (time2posix, TIME2POSIX, ts->tv_sec, ts->tv_nsec, res.tv_sec, res.tv_nsec, state);
+  *ts = res;
+  return ts;
+}
+
+/* struct timespec version of t2p_posix2time_timeval */
+struct timespec *
+t2p_posix2time_timespec (struct timespec *ts)
+{
+  const struct t2p_latch *latch = latch_current ();
+  struct timespec res;
+  unsigned seq;
+  int state;
+  STATS_START (start);
+
+  do
+    res = posix2time_ts_in (table_begin (latch, &seq), *ts, &state);
+  while (table_retry (latch, seq));
+
+  STATS_DONE (start, 1, state != 0);
+  TRACE (posix2time, POSIX2TIME, ts->tv_sec, ts->tv_nsec, res.tv_sec, res.tv_nsec, state);
+  *ts = res;
+  return ts;
+}
+
+/* Convert the n timestamps of a file under a single read of the table.
+   Unless they are older than the last leap second (or the current span),
+   every one of them is a single subtraction on the fast path.  */
+void
+t2p_time2posix_timespecs (struct timespec *const *ts, size_t n)
+{
+  const struct t2p_latch *latch = latch_loaded ();
+  const struct t2p_table *tab;
+  struct timespec res[T2P_STAMPS_MAX];
+  unsigned seq;
+  size_t i, leaps;
+  int states[T2P_STAMPS_MAX];
+  STATS_START (start);
+
+  do
+    {
+      tab = table_begin (latch, &seq);
+      for (i = 0, leaps = 0; i < n; i++)
+        {
+          res[i] = time2posix_ts_in (tab, *ts[i], &states[i]);
+          leaps += states[i] != 0;
+        }
+    }
+  while (table_retry (latch, seq));
+
+  for (i = 0; i < n; i++)
+    {
+      TRACE (time2posix, TIME2POSIX, ts[i]->tv_sec, ts[i]->tv_nsec, res[i].tv_sec, res[i].tv_nsec, states[i]);
+      *ts[i] = res[i];
+    }
+  STATS_DONE (start, n, leaps);
+}
+
+/* inverse to the previous function */
+void
+t2p_posix2time_timespecs (struct timespec *const *ts, size_t n)
+{
+  const struct t2p_latch *latch = latch_loaded ();
+  const struct t2p_table *tab;
+  struct timespec res[T2P_STAMPS_MAX];
+  unsigned seq;
+  size_t i, leaps;
+  int states[T2P_STAMPS_MAX];
+  STATS_START (start);
+
+  do
+    {
+      tab = table_begin (latch, &seq);
+      for (i = 0, leaps = 0; i < n; i++)
+        {
+          res[i] = posix2time_ts_in (tab, *ts[i], &states[i]);
+          leaps += states[i] != 0;
+        }
+    }
+  while (table_retry (latch, seq));
+
+  for (i = 0; i < n; i++)
+    {
+      TRACE (posix2time, POSIX2TIME, ts[i]->tv_sec, ts[i]->tv_nsec, res[i].tv_sec, res[i].tv_nsec, states[i]);
+      *ts[i] = res[i];
+    }
+  STATS_DONE (start, n, leaps);
+}
+
+/* t2p_time2posix_timeval for a scan over many records (wtmp), which are
+   mostly of one span: while they are inside the span of the previous one
+   (and the table has not changed), no lookup is needed.  */
+void
+t2p_time2posix_timeval_scan (struct timeval *tv, struct t2p_scan *scan)
+{
+  const struct t2p_latch *latch = latch_current ();
+  const struct t2p_table *tab;
+  struct timeval res;
+  unsigned seq;
+  int state;
+  STATS_START (start);
+
+  if (__atomic_load_n (&latch->seq, __ATOMIC_ACQUIRE) == scan->seq
+      && tv->tv_sec >= scan->cache.right_start && tv->tv_sec < scan->cache.right_end)
+    {
+      T2P_PROBE5 (time2posix, tv->tv_sec, tv->tv_usec * 1000,
+                  tv->tv_sec - scan->cache.change, tv->tv_usec * 1000, 0);
+      tv->tv_sec -= scan->cache.change;
+      STATS_DONE (start, 1, 0);
+      return;
+    }
+
+  do
+    {
+      tab = table_begin (latch, &seq);
+      res = time2posix_tv_in (tab, *tv, &state);
+      table_span_right (tab, tv->tv_sec, &scan->cache);
+    }
+  while (table_retry (latch, seq));
+
+  scan->seq = seq;
+  STATS_DONE (start, 1, state != 0);
+  TRACE (time2posix, TIME2POSIX, tv->tv_sec, tv->tv_usec * 1000, res.tv_sec, res.tv_usec * 1000, state);
+  *tv = res;
+}
+
+/* t2p_timestatus on the given table */
+static inline int
+timestatus_in (const struct t2p_table *tab, time_t t)
+{
+  const struct leapsecond *ptr;
+  size_t i;
+
+  /* the current span is TIME_OK until the day of the next leap second */
+  if (t > tab->cache.right_start && t < tab->cache.daystart)
+    return TIME_OK;
+
+  i = table_count (tab, tab->transition, t);
+
+  /* the day of the next leap second, or the last one which has begun */
+  if (i < table_num (tab) && t >= tab->leapsecs[i].daystart)
+    ptr = tab->leapsecs + i;
+  else if (i > 0)
+    ptr = tab->leapsecs + i - 1;
+  else
+    return TIME_OK;
+
+  if (ptr->type)
+    {
+      if (t > ptr->transition + 2)
+        return TIME_OK;
+      else if (t > ptr->transition + 1)
+        return TIME_WAIT;
+      else if (t >= ptr->transition)
+        return TIME_OOP;
+      else
+        return TIME_INS;
+    }
+  else
+    {
+      if (t > ptr->transition + 1)
+        return TIME_OK;
+      else if (t > ptr->transition)
+        return TIME_WAIT;
+      else
+        return TIME_DEL;
+    }
+}
+
+/* simulates adjtimex() return value when inserting or deleting a leap second.
+
+   If a leap second will be inserted at the end of the day, return TIME_INS.
+   If a leap second is being inserted now, return TIME_OOP.
+   If a leap second was inserted in the previous second, return TIME_WAIT.
+
+   If a leap second will be deleted at the end of the day, return TIME_DEL.
+   If a leap second was deleted in the previous second, return TIME_WAIT.
+
+   Otherwise return TIME_OK.  */
+int
+t2p_timestatus (time_t t)
+{
+  const struct t2p_latch *latch = latch_current ();
+  const struct t2p_table *tab;
+  unsigned seq;
+  int res;
+  STATS_START (start);
+
+  do
     {
-      fprintf (stderr, "time2posix error: Cannot allocate space for leap seconds table!\n");
-      goto err;
+      tab = table_begin (latch, &seq);
+      res = timestatus_in (tab, t);
     }
+  while (table_retry (latch, seq));
 
-  /* skip unimportant stuff */
-  skip = 5*be32toh (lbuf[8]) + 6*be32toh (lbuf[9]) + be32toh (lbuf[10]);
-  lbuf = (const u_int32_t *) (buf + 44 + skip);
-
-  prev_change = 0;
-  for (i = 0, ptr = leapsecs; i < n; i++, ptr++)
-    {
-      time_t transition, posix_transition, daystart, posix_daystart;
-      int change, type;
+  STATS_DONE (start, 1, res != TIME_OK);
+  T2P_PROBE2 (timestatus, t, res);
+  if (__builtin_expect (res != TIME_OK && t2p_tracing, 0))
+    t2p_trace (T2P_TRACE_TIMESTATUS, t, 0, 0, 0, res);
+  return res;
+}
 
-      transition = (time_t) be32toh (*lbuf++);
-      change = (int) be32toh (*lbuf++);
-      type = change > prev_change;
+/* Batch conversions.  Whole blocks of elements inside the span of the
+   last converted one (for sorted input usually all of them) are shifted
+   by its offset, the blocks are branch-free so that the compiler can
+   vectorize them, and an AVX2 clone is selected at load time on CPUs
+   which have it.  The blocks which leave the span are converted one by
+   one and the following ones are tried in the span of their last element.  */
 
-      /* inserted is always 86400th second of the day,
-         but deleted should be 86399th */
-      daystart = transition - 86400 + !type;
-      posix_daystart = daystart - prev_change;
+#define BATCH_BLOCK 8
 
-      ptr->type = type;
+#if defined (__x86_64__) && defined (__GNUC__)
+#define BATCH_CLONES __attribute__ ((target_clones ("avx2", "default")))
+#else
+#define BATCH_CLONES
+#endif
 
-      /* and we want to prolong the 23:59:59, not 00:00:00, if inserting
-         (therefore subtracting one second if type == 1) */
-      ptr->transition = transition - type;
-      ptr->posix_transition = ptr->transition - prev_change;
-      ptr->daystart = daystart;
-      ptr->posix_daystart = posix_daystart;
-      ptr->prev_change = prev_change;
-      ptr->change = change;
+/* shift the leading blocks of timestamps inside [start, end) by change,
+   returns the number of shifted ones */
+BATCH_CLONES
+static size_t
+batch_shift (time_t *dst, const time_t *src, size_t n,
+             time_t start, time_t end, time_t change)
+{
+  u_int64_t width = (u_int64_t) end - (u_int64_t) start;
+  time_t blk[BATCH_BLOCK];
+  size_t i, j;
+  int out;
 
-      prev_change = change;
+  /* (through a local copy, as dst may be src) */
+  for (i = 0; i + BATCH_BLOCK <= n; i += BATCH_BLOCK)
+    {
+      out = 0;
+      for (j = 0; j < BATCH_BLOCK; j++)
+        {
+          blk[j] = src[i+j];
+          out |= (u_int64_t) blk[j] - (u_int64_t) start >= width;
+        }
+      if (out)
+        break;
+      for (j = 0; j < BATCH_BLOCK; j++)
+        dst[i+j] = blk[j] - change;
     }
 
-  /* this should be protected by some rw lock */
-  if (t2p_leapsecs != NULL)
-    free (t2p_leapsecs);
-  t2p_leapsecs = leapsecs;
-  t2p_leapsecs_num = n;
-  t2p_last_read = now;
+  return i;
+}
 
-end:
-  munmap ((void *) buf, 4096);
-  return 0;
-err:
-  munmap ((void *) buf, 4096);
-  return -1;
+/* the same for struct timeval and timespec (copied field by field,
+   a local copy of the structures would defeat store forwarding) */
+#define def_batch_shift(name, type)					\
+BATCH_CLONES								\
+static size_t								\
+name (type *dst, const type *src, size_t n,				\
+      time_t start, time_t end, time_t change)				\
+{									\
+  u_int64_t width = (u_int64_t) end - (u_int64_t) start;		\
+  size_t i, j;								\
+  int out;								\
+									\
+  for (i = 0; i + BATCH_BLOCK <= n; i += BATCH_BLOCK)			\
+    {									\
+      out = 0;								\
+      for (j = 0; j < BATCH_BLOCK; j++)					\
+        out |= (u_int64_t) src[i+j].tv_sec - (u_int64_t) start >= width; \
+      if (out)								\
+        break;								\
+      for (j = 0; j < BATCH_BLOCK; j++)					\
+        {								\
+          dst[i+j] = src[i+j];						\
+          dst[i+j].tv_sec -= change;					\
+        }								\
+    }									\
+									\
+  return i;								\
 }
 
-/* Convert right timestamp to a posix timestamp.
-   If a leap second is being inserted at t+1, *state is set to 1.
-   If a leap second is being inesrted at t, *state is set to 2.
-   If a leap second is being deleted at t+1, *state is set to -1.
-   Otherwise, *state is set to 0.
+def_batch_shift(batch_shift_tv, struct timeval)
+def_batch_shift(batch_shift_ts, struct timespec)
 
-   Example:
+#define def_batch(name, kind, type, sec, shift, conv, span, cstart, cend, sign) \
+void									\
+name (type *dst, const type *src, size_t n, int *states)		\
+{									\
+  struct t2p_table tab;							\
+  struct t2p_offset_cache c;						\
+  size_t i = 0, k, stop, leaps = 0;					\
+  time_t last = 0;							\
+  int state;								\
+  STATS_START (start);							\
+									\
+  t2p_table_get (&tab);							\
+  c = tab.cache;							\
+									\
+  while (i < n)								\
+    {									\
+      k = shift (dst + i, src + i, n - i, c.cstart, c.cend, sign c.change); \
+      if (states != NULL)						\
+        memset (states + i, 0, k * sizeof (int));			\
+      i += k;								\
+									\
+      for (stop = i + BATCH_BLOCK < n ? i + BATCH_BLOCK : n; i < stop; i++) \
+        {								\
+          last = src[i] sec;						\
+          dst[i] = conv (&tab, src[i], &state);				\
+          leaps += state != 0;						\
+          if (states != NULL)						\
+            states[i] = state;						\
+          if (__builtin_expect (state != 0 && t2p_tracing, 0))		\
+            t2p_trace (T2P_TRACE_##kind, last, 0, dst[i] sec, 0, state); \
+        }								\
+									\
+      span (&tab, last, &c);						\
+    }									\
+									\
+  STATS_DONE (start, n, leaps);						\
+  T2P_PROBE2 (name, n, leaps);						\
+}
 
-   time       time2posix state
-   1341100821 1341100797 0
-   1341100822 1341100798 0
-   1341100823 1341100799 1
-   1341100824 1341100799 2
-   1341100825 1341100800 0
-   1341100826 1341100801 0
-   */
-time_t
-t2p_time2posix (time_t t, int *state)
+def_batch(t2p_time2posix_array, TIME2POSIX, time_t, , batch_shift, time2posix_in,
+          table_span_right, right_start, right_end, )
+def_batch(t2p_posix2time_array, POSIX2TIME, time_t, , batch_shift, posix2time_in,
+          table_span_posix, posix_start, posix_end, -)
+def_batch(t2p_time2posix_timeval_array, TIME2POSIX, struct timeval, .tv_sec, batch_shift_tv,
+          time2posix_tv_in, table_span_right, right_start, right_end, )
+def_batch(t2p_posix2time_timeval_array, POSIX2TIME, struct timeval, .tv_sec, batch_shift_tv,
+          posix2time_tv_in, table_span_posix, posix_start, posix_end, -)
+def_batch(t2p_time2posix_timespec_array, TIME2POSIX, struct timespec, .tv_sec, batch_shift_ts,
+          time2posix_ts_in, table_span_right, right_start, right_end, )
+def_batch(t2p_posix2time_timespec_array, POSIX2TIME, struct timespec, .tv_sec, batch_shift_ts,
+          posix2time_ts_in, table_span_posix, posix_start, posix_end, -)
+
+static int t2p_inotify_fd = -1;
+
+/* Wait at most timeout seconds for a change of the leap seconds file.
+   Returns 1 if the file was (re)created, written or moved into place.  */
+static int
+t2p_leaps_wait (time_t timeout)
 {
-  time_t res = t;
-  size_t i = t2p_leapsecs_num;
-  struct leapsecond *ptr;
+  char buf[4096] __attribute__((aligned (__alignof__ (struct inotify_event))));
+  const struct inotify_event *ev;
+  struct pollfd pfd;
+  ssize_t len, off;
+  int changed = 0;
+
+  pfd.fd = t2p_inotify_fd;
+  pfd.events = POLLIN;
+  if (poll (&pfd, pfd.fd >= 0, timeout > INT_MAX/1000 ? INT_MAX : timeout*1000) <= 0)
+    return 0;
 
-  /* reread leap seconds table sometimes */
-  t2p_leaps_read ();
+  while ((len = read (t2p_inotify_fd, buf, sizeof buf)) > 0)
+    for (off = 0; off < len; off += sizeof (struct inotify_event) + ev->len)
+      {
+        ev = (const struct inotify_event *) (buf + off);
+        if (ev->len && t2p_leaps_watched (ev->name))
+          changed = 1;
+      }
 
-  do
-    if (i-- == 0)
-      return res;
-  while (t < t2p_leapsecs[i].transition);
+  return changed;
+}
 
-  ptr = t2p_leapsecs + i;
+/* Keeps the leap seconds table and the cached span in the latch up to
+   date, so that the conversion functions never read files, allocate or
+   read the clock.  The table is re-read when the file changes or every
+   LEAPS_REREAD seconds, after a failure it is retried with exponential
+   backoff.  With T2P_OFFSET=kernel the kernel is checked every
+   KERNEL_POLL seconds as well.  Never returns.  */
+void
+t2p_leaps_watch (struct t2p_latch *latch)
+{
+  time_t now, next_read, retry = LEAPS_RETRY, wake;
+  struct t2p_table tab;
 
-  res = t - ptr->change;
+  if (latch != &t2p_local_latch)
+    t2p_shm_writer = 1;
 
-  if (ptr->type && t-1 == ptr->transition)
-    *state = 2;
-  else if (ptr->type && t == ptr->transition)
-    {
-      *state = 1;
-      res++;
-    }
-  else if (!ptr->type && t == ptr->transition)
+  /* (the one inherited over fork belongs to the parent) */
+  if (t2p_inotify_fd >= 0)
+    close (t2p_inotify_fd);
+
+  t2p_inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (t2p_inotify_fd >= 0 && t2p_leaps_watch_add (t2p_inotify_fd) == 0)
     {
-      *state = -1;
-      res--;
+      close (t2p_inotify_fd);
+      t2p_inotify_fd = -1;
     }
-  else
-    *state = 0;
 
-  return res;
-}
+  latch_get (latch, &tab);
+  next_read = t2p_leaps_embedded_used ? 0 : leaps_now () + (tab.num ? LEAPS_REREAD : retry);
 
-/* Convert a posix timestamp to a right timestamp.
-   If a leap second is being inserted at t+1, *state is set to 1.
-   If a leap second is being deleted at t+1, *state is set to -1.
-   If a leap second is being deleted at t, *state is set to -2.
-   Otherwise, *state is set to 0.
+  for (;;)
+    {
+      now = leaps_now ();
 
-   Example:
+      if (now >= next_read)
+        {
+          if (t2p_latch_read (latch))
+            {
+              next_read = now + retry;
+              retry = retry*2 < LEAPS_REREAD ? retry*2 : LEAPS_REREAD;
+            }
+          else
+            {
+              next_read = now + LEAPS_REREAD;
+              retry = LEAPS_RETRY;
+            }
+        }
 
-   time       posix2time state
-   1341100797 1341100821 0
-   1341100798 1341100822 0
-   1341100799 1341100823 1
-   1341100800 1341100825 0
-   1341100801 1341100826 0
-   */
-time_t
-t2p_posix2time (time_t t, int *state)
-{
-  time_t res = t;
-  size_t i = t2p_leapsecs_num;
-  struct leapsecond *ptr;
+      /* a leap second announced, or the offset set, in the kernel */
+      else if (t2p_kernel_on () && t2p_kernel_changed ())
+        latch_publish (latch, &t2p_leaps_loaded);
 
-  /* reread leap seconds table sometimes */
-  t2p_leaps_read ();
+      /* a leap second has passed (or the clock was set) */
+      latch_get (latch, &tab);
+      if (now < tab.cache.right_start || now >= tab.cache.right_end)
+        {
+          t2p_cache_refresh (latch, now);
+          latch_get (latch, &tab);
+        }
 
-  do
-    if (i-- == 0)
-      return t;
-  while (t < t2p_leapsecs[i].posix_transition);
+      wake = next_read;
+      if (tab.cache.right_end > now && tab.cache.right_end < wake)
+        wake = tab.cache.right_end;
 
-  ptr = t2p_leapsecs + i;
+      /* (inside a smear window the span starts after it) */
+      if (tab.cache.right_start > now && tab.cache.right_start < wake)
+        wake = tab.cache.right_start;
 
-  res = t + ptr->change;
+      if (t2p_kernel_on () && now + KERNEL_POLL < wake)
+        wake = now + KERNEL_POLL;
 
-  if (ptr->type && t == ptr->posix_transition)
-    {
-      *state = 1;
-      res--;
-    }
-  else if (!ptr->type && t == ptr->posix_transition)
-    {
-      *state = -1;
-      res++;
+      if (t2p_leaps_wait (wake - now))
+        {
+          /* let the writer finish */
+          while (t2p_leaps_wait (1))
+            ;
+          next_read = 0;
+          retry = LEAPS_RETRY;
+        }
     }
-  else if (!ptr->type && t-1 == ptr->posix_transition)
-    *state = -2;
-  else
-    *state = 0;
+}
 
-  return res;
+static void *
+t2p_reloader (void *arg)
+{
+  t2p_leaps_watch (&t2p_local_latch);
+  return arg;
 }
 
-/* normalize struct timeval */
-inline struct timeval *
-t2p_normalize_timeval (struct timeval *tv)
+/* the child must not inherit the writers' lock held by another thread */
+static void
+t2p_fork_prepare (void)
 {
-  while (tv->tv_usec >= 1000000)
-    {
-      tv->tv_usec -= 1000000;
-      tv->tv_sec ++;
-    }
-  return tv;
+  pthread_mutex_lock (&t2p_latch_lock);
 }
 
-/* Convert a right timeval to a posix timeval.
-   If leap second is being inserted, simulates slowdown of the 23:59:59 second.
-   (That means that 2 second will pass from 23:59:59 to 00:00:00).
-   If a leap second is being deleted, simulates speedup of the 23:59:58 second.
-   (That means that 1 second will pass from 23:59:58 to 00:00:00).  */
-struct timeval *
-t2p_time2posix_timeval (struct timeval *tv)
+static void
+t2p_fork_parent (void)
 {
-  int state;
-  tv->tv_sec = t2p_time2posix (tv->tv_sec, &state);
-  if (state == 1)
-    tv->tv_usec >>= 1;
-  else if (state == 2)
-    tv->tv_usec = (tv->tv_usec + 1000000) >> 1;
-  else if (state == -1)
-    {
-      tv->tv_usec <<= 1;
-      t2p_normalize_timeval (tv);
-    }
-  return tv;
+  pthread_mutex_unlock (&t2p_latch_lock);
 }
 
-/* Inverse to the previous function. */
-struct timeval *
-t2p_posix2time_timeval (struct timeval *tv)
+/* (no threads are started here, the child may only exec) */
+static void
+t2p_fork_child (void)
 {
-  int state;
-  tv->tv_sec = t2p_posix2time (tv->tv_sec, &state);
-  if (state == 1)
-    {
-      tv->tv_usec <<= 1;
-      t2p_normalize_timeval (tv);
-    }
-  else if (state == -1)
-    tv->tv_usec >>= 1;
-  else if (state == -2)
-    tv->tv_usec = (tv->tv_usec + 1000000) >> 1;
-  return tv;
+  pthread_mutex_unlock (&t2p_latch_lock);
+  __atomic_store_n (&t2p_table_ready, TABLE_RESTART, __ATOMIC_RELEASE);
 }
 
-/* normalize struct timespec */
-inline struct timespec *
-t2p_normalize_timespec (struct timespec *ts)
+/* start the reloader thread (in the child after fork on its first
+   conversion) */
+static void
+t2p_reloader_start (void)
 {
-  while (ts->tv_nsec >= 1000000000)
-    {
-      ts->tv_nsec -= 1000000000;
-      ts->tv_sec ++;
-    }
-  return ts;
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
+
+  /* signals are for the application threads */
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create (&thread, &attr, t2p_reloader, NULL))
+    fprintf (stderr, "time2posix warning: Cannot start reloader thread, leap seconds table won't be re-read!\n");
+  pthread_attr_destroy (&attr);
+
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
 }
 
-/* struct timespec version of t2p_time2posix_timeval */
-struct timespec *
-t2p_time2posix_timespec (struct timespec *ts)
+/* whether the environment sets up the table differently from the one
+   t2p_shmd builds with its own */
+static int
+shm_overridden (void)
 {
-  int state;
-  ts->tv_sec = t2p_time2posix (ts->tv_sec, &state);
-  if (state == 1)
-    ts->tv_nsec >>= 1;
-  else if (state == 2)
-    ts->tv_nsec = (ts->tv_nsec + 1000000000) >> 1;
-  else if (state == -1)
-    {
-      ts->tv_nsec <<= 1;
-      t2p_normalize_timespec (ts);
-    }
-  return ts;
+  return secure_getenv ("T2P_LEAPS") != NULL || secure_getenv ("T2P_SMEAR") != NULL
+         || secure_getenv ("T2P_SMEAR_WINDOW") != NULL || secure_getenv ("T2P_SMEAR_ALIGN") != NULL
+         || t2p_kernel_on ();
 }
 
-/* struct timespec version of t2p_posix2time_timeval */
-struct timespec *
-t2p_posix2time_timespec (struct timespec *ts)
+/* Use the latch published by t2p_shmd, if there is a valid one.
+   It is then kept up to date by t2p_shmd for all processes.  Only a
+   file of root (or of our own user) which nobody else can write is
+   trusted.  (Called while the table is set up, so nothing here may go
+   through the stat wrappers, which would convert the times with the
+   table.)  */
+static int
+t2p_shm_attach (void)
 {
-  int state;
-  ts->tv_sec = t2p_posix2time (ts->tv_sec, &state);
-  if (state == 1)
+  struct t2p_latch *latch;
+  struct statx stx;
+  int fd;
+
+  if (shm_overridden ())
+    return -1;
+
+  fd = open (T2P_SHM_FILE, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0)
+    return -1;
+
+  if (syscall (SYS_statx, fd, "", AT_EMPTY_PATH, STATX_SIZE | STATX_UID | STATX_MODE, &stx)
+      || stx.stx_size != sizeof (struct t2p_latch)
+      || (stx.stx_uid != 0 && stx.stx_uid != geteuid ())
+      || (stx.stx_mode & (S_IWGRP | S_IWOTH)))
     {
-      ts->tv_nsec <<= 1;
-      t2p_normalize_timespec (ts);
+      close (fd);
+      return -1;
     }
-  else if (state == -1)
-    ts->tv_nsec >>= 1;
-  else if (state == -2)
-    ts->tv_nsec = (ts->tv_nsec + 1000000000) >> 1;
-  return ts;
+
+  latch = mmap (NULL, sizeof (struct t2p_latch), PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (latch == MAP_FAILED)
+    return -1;
+
+  /* a different build (or ABI), nothing published yet, or t2p_shmd
+     has stopped */
+  if (latch->magic != T2P_LATCH_MAGIC || latch->size != sizeof (struct t2p_latch)
+      || __atomic_load_n (&latch->seq, __ATOMIC_ACQUIRE) == 0
+      || latch->tables[latch->seq & 1].cache.lease <= leaps_now ())
+    {
+      munmap (latch, sizeof (struct t2p_latch));
+      return -1;
+    }
+
+  t2p_latch = latch;
+  return 0;
 }
 
-/* simulates adjtimex() return value when inserting or deleting a leap second.
+/* Versions to look up symbols which libc keeps only for old binaries
+   (stime since glibc 2.31), for the architectures' base versions.  */
+static const char *const t2p_compat_versions[] =
+  { "GLIBC_2.2.5", "GLIBC_2.17", "GLIBC_2.2", "GLIBC_2.0", NULL };
 
-   If a leap second will be inserted at the end of the day, return TIME_INS.
-   If a leap second is being inserted now, return TIME_OOP.
-   If a leap second was inserted in the previous second, return TIME_WAIT.
+/* the next definition after this library, libc's or another preload's */
+static void *
+t2p_next_symbol (const char *name)
+{
+  const char *const *version;
+  void *sym = dlsym (RTLD_NEXT, name);
 
-   If a leap second will be deleted at the end of the day, return TIME_DEL.
-   If a leap second was deleted in the previous second, return TIME_WAIT.
+  for (version = t2p_compat_versions; sym == NULL && *version != NULL; version++)
+    sym = dlvsym (RTLD_NEXT, name, *version);
 
-   Otherwise return TIME_OK.  */
-int
-t2p_timestatus (time_t t)
+  return sym;
+}
+
+/* the vDSO function for name, __vdso_name (x86) or __kernel_name (arm64,
+   ppc, s390, riscv) */
+static void *
+t2p_vdso_symbol (void *vdso, const char *name)
 {
-  struct leapsecond *ptr;
+  char buf[64];
+  void *sym;
 
-  for (ptr = t2p_leapsecs + t2p_leapsecs_num - 1; ptr >= t2p_leapsecs; ptr--)
+  if (vdso == NULL)
+    return NULL;
+
+  snprintf (buf, sizeof (buf), "__vdso_%s", name);
+  sym = dlsym (vdso, buf);
+  if (sym == NULL)
     {
-      if (ptr->type)
-        {
-          if (t > ptr->transition + 2)
-            return TIME_OK;
-          else if (t > ptr->transition + 1)
-            return TIME_WAIT;
-          else if (t >= ptr->transition)
-            return TIME_OOP;
-          else if (t >= ptr->daystart)
-            return TIME_INS;
-        }
-      else
-        {
-          if (t > ptr->transition + 1)
-            return TIME_OK;
-          else if (t > ptr->transition)
-            return TIME_WAIT;
-          else if (t >= ptr->daystart)
-            return TIME_DEL;
-        }
+      snprintf (buf, sizeof (buf), "__kernel_%s", name);
+      sym = dlsym (vdso, buf);
     }
 
-  return TIME_OK;
+  return sym;
 }
 
-static void *t2p_libc_handle = NULL;
+static int
+t2p_from_libc (void *sym)
+{
+  Dl_info info;
+
+  return sym != NULL && dladdr (sym, &info) && info.dli_fname != NULL
+         && strstr (info.dli_fname, "/libc.so") != NULL;
+}
+
+/* set once the original functions are bound */
+int t2p_bound = 0;
 
-static void t2p_init (void) __attribute__((constructor));
-static void t2p_fini (void) __attribute__((destructor));
+static pthread_once_t t2p_bind_once = PTHREAD_ONCE_INIT;
 
-/* initialize leap seconds table and original function pointers */
+/* bind the original function pointers */
 static void
-t2p_init (void)
+t2p_bind_symbols (void)
 {
-  t2p_libc_handle = dlopen ("libc.so.6", RTLD_LAZY);
-  if (!t2p_libc_handle)
-    exit (255);
+  void *vdso;
 
 #define fetchsymbol(name) \
-  t2p_orig_##name = dlsym (t2p_libc_handle, #name); \
+  t2p_orig_##name = t2p_next_symbol (#name); \
   if (t2p_orig_##name == NULL) \
-    fprintf (stderr, "time2posix error: Cannot load symbol " #name " from libc.so.6!\n")
+    fprintf (stderr, "time2posix error: Cannot load symbol " #name "!\n")
 
   fetchsymbol(getutent);
   fetchsymbol(getutid);
@@ -409,7 +1798,8 @@ t2p_init (void)
   fetchsymbol(updwtmpx);
 
   fetchsymbol(time);
-  fetchsymbol(stime);
+  /* (emulated with clock_settime if there is none) */
+  t2p_orig_stime = t2p_next_symbol ("stime");
   fetchsymbol(clock_gettime);
   fetchsymbol(clock_settime);
   fetchsymbol(clock_adjtime);
@@ -418,16 +1808,159 @@ t2p_init (void)
   fetchsymbol(adjtimex);
   fetchsymbol(ntp_adjtime);
   fetchsymbol(ntp_gettime);
+#if defined __TIMESIZE && __TIMESIZE == 32
+  t2p_orig___clock_gettime64 = t2p_next_symbol ("__clock_gettime64");
+  t2p_orig___clock_settime64 = t2p_next_symbol ("__clock_settime64");
+#endif
 
   fetchsymbol(recvmsg);
+  fetchsymbol(recvmmsg);
+  fetchsymbol(ioctl);
+
+  fetchsymbol(socket);
+  fetchsymbol(socketpair);
+  fetchsymbol(accept);
+  fetchsymbol(accept4);
+  fetchsymbol(setsockopt);
+  fetchsymbol(close);
+  fetchsymbol(dup);
+  fetchsymbol(dup2);
+  fetchsymbol(dup3);
+  fetchsymbol(fcntl);
+  t2p_orig_close_range = t2p_next_symbol ("close_range");
+  t2p_orig_closefrom = t2p_next_symbol ("closefrom");
+
+  fetchsymbol(stat);
+  fetchsymbol(fstat);
+  fetchsymbol(lstat);
+  fetchsymbol(fstatat);
+  fetchsymbol(stat64);
+  fetchsymbol(fstat64);
+  fetchsymbol(lstat64);
+  fetchsymbol(fstatat64);
+  /* (only in newer libcs, or only in older ones) */
+  t2p_orig_statx = t2p_next_symbol ("statx");
+  t2p_orig___xstat = t2p_next_symbol ("__xstat");
+  t2p_orig___fxstat = t2p_next_symbol ("__fxstat");
+  t2p_orig___lxstat = t2p_next_symbol ("__lxstat");
+  t2p_orig___fxstatat = t2p_next_symbol ("__fxstatat");
+  t2p_orig___xstat64 = t2p_next_symbol ("__xstat64");
+  t2p_orig___fxstat64 = t2p_next_symbol ("__fxstat64");
+  t2p_orig___lxstat64 = t2p_next_symbol ("__lxstat64");
+  t2p_orig___fxstatat64 = t2p_next_symbol ("__fxstatat64");
+
+  fetchsymbol(clock_nanosleep);
+  fetchsymbol(timerfd_create);
+  fetchsymbol(timerfd_settime);
+  fetchsymbol(timer_create);
+  fetchsymbol(timer_settime);
+  fetchsymbol(timer_delete);
+  fetchsymbol(pthread_cond_timedwait);
+  fetchsymbol(pthread_mutex_timedlock);
+  fetchsymbol(pthread_rwlock_timedrdlock);
+  fetchsymbol(pthread_rwlock_timedwrlock);
+  fetchsymbol(pthread_timedjoin_np);
+  fetchsymbol(sem_timedwait);
+  /* (only in newer libcs, in librt before glibc 2.34, in liburing) */
+  t2p_orig_pthread_cond_clockwait = t2p_next_symbol ("pthread_cond_clockwait");
+  t2p_orig_pthread_mutex_clocklock = t2p_next_symbol ("pthread_mutex_clocklock");
+  t2p_orig_pthread_rwlock_clockrdlock = t2p_next_symbol ("pthread_rwlock_clockrdlock");
+  t2p_orig_pthread_rwlock_clockwrlock = t2p_next_symbol ("pthread_rwlock_clockwrlock");
+  t2p_orig_pthread_clockjoin_np = t2p_next_symbol ("pthread_clockjoin_np");
+  t2p_orig_sem_clockwait = t2p_next_symbol ("sem_clockwait");
+  t2p_orig_mq_timedreceive = t2p_next_symbol ("mq_timedreceive");
+  t2p_orig_mq_timedsend = t2p_next_symbol ("mq_timedsend");
+  t2p_orig_io_uring_submit = t2p_next_symbol ("io_uring_submit");
+  t2p_orig_io_uring_submit_and_wait = t2p_next_symbol ("io_uring_submit_and_wait");
+
+  fetchsymbol(utime);
+  fetchsymbol(utimes);
+  fetchsymbol(lutimes);
+  fetchsymbol(futimes);
+  fetchsymbol(futimesat);
+  fetchsymbol(utimensat);
+  fetchsymbol(futimens);
+
+  /* The libc functions may not use the vDSO (or not for every clock), so
+     the realtime clocks are read from it directly.  Only if the next
+     definitions are libc's, not if another preload wraps them too.  */
+  vdso = dlopen ("linux-vdso.so.1", RTLD_LAZY | RTLD_NOLOAD);
+  if (t2p_from_libc (t2p_orig_time))
+    t2p_vdso_time = t2p_vdso_symbol (vdso, "time");
+  if (t2p_from_libc (t2p_orig_clock_gettime))
+    t2p_vdso_clock_gettime = t2p_vdso_symbol (vdso, "clock_gettime");
+  if (t2p_from_libc (t2p_orig_gettimeofday))
+    t2p_vdso_gettimeofday = t2p_vdso_symbol (vdso, "gettimeofday");
+
+  t2p_fake_clock_init ();
+
+  __atomic_store_n (&t2p_bound, 1, __ATOMIC_RELEASE);
+
+  /* (after binding, they call the wrapped close) */
+  t2p_stats_init ();
+  t2p_trace_init ();
+}
+
+/* Called by the wrappers (through T2P_BIND) until the original functions
+   are bound.  Not at exec, so that processes which never call them do
+   not pay for the lookups.  */
+void
+t2p_bind (void)
+{
+  pthread_once (&t2p_bind_once, t2p_bind_symbols);
+}
 
-  if (t2p_leaps_read ())
-    exit (255);
+/* read the table into the local latch */
+static void
+table_read_local (void)
+{
+  if (leaps_read_embedded ())
+    t2p_leaps_read ();
+  __atomic_store_n (&t2p_latch, &t2p_local_latch, __ATOMIC_RELEASE);
+}
+
+/* keep the local table up to date */
+static void
+table_start_local (void)
+{
+  t2p_reloader_start ();
+  pthread_atfork (t2p_fork_prepare, t2p_fork_parent, t2p_fork_child);
+}
+
+/* Read the table into the local latch and keep it up to date, after
+   t2p_shmd has stopped (the shared latch stays mapped, the conversions
+   which have it keep using it until they are done).  */
+static void
+t2p_table_local (void)
+{
+  table_read_local ();
+  table_start_local ();
+}
+
+/* Load the table, the shared one or else the process' own, without
+   starting anything.  Without a leap seconds file the embedded table
+   is used (or if there is none, the table stays empty and the times
+   pass unconverted).  */
+static void
+t2p_table_load (void)
+{
+  if (t2p_shm_attach ())
+    table_read_local ();
+  else if (t2p_latch->tables[t2p_latch->seq & 1].smear == T2P_SMEAR_COSINE)
+    smear_cosine_setup ();
 }
 
+/* Set up the table on the first conversion but those of the file times,
+   and start what keeps it up to date: the reloader, which keeps retrying
+   to read the file, if it is the process' own.  */
 static void
-t2p_fini (void)
+t2p_table_init (void)
 {
-  if (t2p_libc_handle != NULL)
-    dlclose (t2p_libc_handle);
+  pthread_once (&t2p_load_once, t2p_table_load);
+  if (t2p_latch == &t2p_local_latch)
+    table_start_local ();
+
+  t2p_coarse_init ();
+
+  __atomic_store_n (&t2p_table_ready, TABLE_READY, __ATOMIC_RELEASE);
 }
@@ -12,6 +12,12 @@
 #include <sys/time.h>
 #include <sys/timex.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <mqueue.h>
+#include <signal.h>
 
 struct leapsecond
 {
@@ -37,10 +43,105 @@ struct leapsecond
   int prev_change;
 };
 
-extern struct leapsecond *t2p_leapsecs;
-extern size_t t2p_leapsecs_num;
+/* the span between two leap seconds which contains the current time,
+   timestamps inside of it are converted by a single subtraction */
+struct t2p_offset_cache
+{
+  /* right timestamps in [right_start, right_end) are t - change, state 0 */
+  time_t right_start;
+  time_t right_end;
+
+  /* posix timestamps in [posix_start, posix_end) are t + change, state 0 */
+  time_t posix_start;
+  time_t posix_end;
+
+  /* start of the day of the next leap second */
+  time_t daystart;
+
+  /* until when the publisher vouches for the table (the maximal time_t
+     but in the one t2p_shmd publishes, which it renews while it runs) */
+  time_t lease;
+
+  /* difference between right and posix time inside the span */
+  int change;
+};
+
+/* maximum number of leap seconds in the table */
+#define T2P_LEAPS_MAX 64
+
+/* How the leap seconds show in the sub-second parts (T2P_SMEAR in the
+   environment of the process which reads the table):
+   1s      the 23:59:59 second is slowed down (or sped up) 2:1
+   none    posix time steps, as the kernel does it
+   linear  the leap second is spread evenly over a window of
+           T2P_SMEAR_WINDOW posix seconds (24 hours by default)
+   cosine  the same, but the rate changes smoothly (1 - cos) / 2
+   The window is centered on the midnight of the leap second, or ends or
+   starts there (T2P_SMEAR_ALIGN center, end or start).  In the windowed
+   modes posix time never steps and the time_t conversions are the
+   whole seconds of the smeared time.  */
+#define T2P_SMEAR_1S 0
+#define T2P_SMEAR_NONE 1
+#define T2P_SMEAR_LINEAR 2
+#define T2P_SMEAR_COSINE 3
+
+#define T2P_SMEAR_WINDOWED(smear) ((smear) >= T2P_SMEAR_LINEAR)
+
+/* the window of a leap second, right [smear_start, right_end) and posix
+   [smear_posix_start, posix_end) */
+struct t2p_smear
+{
+  time_t right_end;
+  time_t posix_end;
+
+  /* 2^96 / the right length of the window in ns, so that the fraction
+     of the window which has passed is a multiply-shift away */
+  u_int64_t inv;
+};
+
+/* snapshot of the leap seconds table, never modified once published */
+struct t2p_table
+{
+  size_t num;
+  struct t2p_offset_cache cache;
+  int smear;
+
+  /* dense copies of the fields the lookups need,
+     the keys after num are padded with the maximal time_t */
+  time_t transition[T2P_LEAPS_MAX];
+  time_t posix_transition[T2P_LEAPS_MAX];
+  int change[T2P_LEAPS_MAX];
+
+  /* the windows in the windowed smear modes, keys padded as well */
+  time_t smear_start[T2P_LEAPS_MAX];
+  time_t smear_posix_start[T2P_LEAPS_MAX];
+  struct t2p_smear smears[T2P_LEAPS_MAX];
+
+  struct leapsecond leapsecs[T2P_LEAPS_MAX];
+};
+
+/* Readers use tables[seq & 1] and retry if seq has changed meanwhile,
+   the writer fills the other copy and only then increments seq.
+   The process has its own, or maps the one t2p_shmd publishes in
+   T2P_SHM_FILE for all processes on the host (not if T2P_LEAPS,
+   T2P_SMEAR, T2P_SMEAR_WINDOW, T2P_SMEAR_ALIGN or T2P_OFFSET=kernel is
+   set for the process, which then reads its own table).  */
+struct t2p_latch
+{
+  u_int32_t magic;
+  u_int32_t size;
+  unsigned seq;
+  struct t2p_table tables[2];
+};
+
+#define T2P_LATCH_MAGIC 0x4c503254
+#define T2P_SHM_DIR "/run/time2posix"
+#define T2P_SHM_FILE T2P_SHM_DIR "/latch"
 
 int t2p_leaps_read (void);
+int t2p_latch_read (struct t2p_latch *);
+void t2p_leaps_watch (struct t2p_latch *);
+void t2p_table_get (struct t2p_table *);
 time_t t2p_time2posix (time_t, int *);
 time_t t2p_posix2time (time_t, int *);
 struct timeval *t2p_normalize_timeval (struct timeval *);
@@ -51,34 +152,481 @@ struct timespec *t2p_time2posix_timespec (struct timespec *);
 struct timespec *t2p_posix2time_timespec (struct timespec *);
 int t2p_timestatus (time_t);
 
+/* Replace the table by n leap seconds at the right times in transitions
+   with the total changes after them, as in the TZif files (for tests, it
+   is not reloaded or shared any more).  */
+int t2p_leaps_set (const time_t *, const int *, size_t);
+
+/* The fake clock (fakeclock.c), for tests.  The realtime clocks read,
+   and set, a right time which starts at right and runs rate times as
+   fast as the real one (stands still at 0, moved only by
+   t2p_fake_clock_step or by setting the clock).  Socket timestamps are
+   moved the same way.  It is on from the start with T2P_FAKE_CLOCK
+   set to <right seconds>[.<fraction>][x<rate>].  Nothing is passed to
+   the kernel clock then, adjtimex does not change it.  */
+int t2p_fake_clock_set (const struct timespec *, double);
+void t2p_fake_clock_step (int64_t);
+
+/* Convert n elements of src to dst (which may be the same array, but must
+   not overlap otherwise).  If states is not NULL, the state of each
+   element (see t2p_time2posix and t2p_posix2time) is stored there.  */
+void t2p_time2posix_array (time_t *, const time_t *, size_t, int *);
+void t2p_posix2time_array (time_t *, const time_t *, size_t, int *);
+void t2p_time2posix_timeval_array (struct timeval *, const struct timeval *, size_t, int *);
+void t2p_posix2time_timeval_array (struct timeval *, const struct timeval *, size_t, int *);
+void t2p_time2posix_timespec_array (struct timespec *, const struct timespec *, size_t, int *);
+void t2p_posix2time_timespec_array (struct timespec *, const struct timespec *, size_t, int *);
+
+/* The original functions, bound to the next definition after this
+   library.  Hidden, so they are loaded without a GOT indirection.  */
+#define T2P_HIDDEN __attribute__ ((visibility ("hidden")))
+
+/* every wrapper binds them on its first call */
+extern T2P_HIDDEN int t2p_bound;
+extern T2P_HIDDEN void t2p_bind (void);
+
+#define T2P_BIND()							\
+  do									\
+    {									\
+      if (__builtin_expect (!__atomic_load_n (&t2p_bound, __ATOMIC_ACQUIRE), 0)) \
+        t2p_bind ();							\
+    }									\
+  while (0)
+
 /* utmp.c */
-extern struct utmp *(*t2p_orig_getutent) (void);
-extern struct utmp *(*t2p_orig_getutid) (const struct utmp *);
-extern struct utmp *(*t2p_orig_getutline) (const struct utmp *);
-extern struct utmp *(*t2p_orig_pututline) (const struct utmp *);
-extern void (*t2p_orig_updwtmp) (const char *, const struct utmp *);
-
-extern int (*t2p_orig_getutent_r) (struct utmp *, struct utmp **);
-extern int (*t2p_orig_getutid_r) (const struct utmp *, struct utmp *, struct utmp **);
-extern int (*t2p_orig_getutline_r) (const struct utmp *, struct utmp *, struct utmp **);
-
-extern struct utmpx *(*t2p_orig_getutxent) (void);
-extern struct utmpx *(*t2p_orig_getutxid) (const struct utmpx *);
-extern struct utmpx *(*t2p_orig_getutxline) (const struct utmpx *);
-extern struct utmpx *(*t2p_orig_pututxline) (const struct utmpx *);
-extern void (*t2p_orig_updwtmpx) (const char *, const struct utmpx *);
+extern T2P_HIDDEN struct utmp *(*t2p_orig_getutent) (void);
+extern T2P_HIDDEN struct utmp *(*t2p_orig_getutid) (const struct utmp *);
+extern T2P_HIDDEN struct utmp *(*t2p_orig_getutline) (const struct utmp *);
+extern T2P_HIDDEN struct utmp *(*t2p_orig_pututline) (const struct utmp *);
+extern T2P_HIDDEN void (*t2p_orig_updwtmp) (const char *, const struct utmp *);
+
+extern T2P_HIDDEN int (*t2p_orig_getutent_r) (struct utmp *, struct utmp **);
+extern T2P_HIDDEN int (*t2p_orig_getutid_r) (const struct utmp *, struct utmp *, struct utmp **);
+extern T2P_HIDDEN int (*t2p_orig_getutline_r) (const struct utmp *, struct utmp *, struct utmp **);
+
+extern T2P_HIDDEN struct utmpx *(*t2p_orig_getutxent) (void);
+extern T2P_HIDDEN struct utmpx *(*t2p_orig_getutxid) (const struct utmpx *);
+extern T2P_HIDDEN struct utmpx *(*t2p_orig_getutxline) (const struct utmpx *);
+extern T2P_HIDDEN struct utmpx *(*t2p_orig_pututxline) (const struct utmpx *);
+extern T2P_HIDDEN void (*t2p_orig_updwtmpx) (const char *, const struct utmpx *);
+
+/* (in time2posix.c) the span of the previous record of a scan, valid
+   while the table has sequence number seq */
+struct t2p_scan
+{
+  struct t2p_offset_cache cache;
+  unsigned seq;
+};
+
+extern T2P_HIDDEN void t2p_time2posix_timeval_scan (struct timeval *, struct t2p_scan *);
 
 /* time.c */
-extern time_t (*t2p_orig_time) (time_t *);
-extern int (*t2p_orig_stime) (const time_t *);
-extern int (*t2p_orig_clock_gettime) (clockid_t, struct timespec *);
-extern int (*t2p_orig_clock_settime) (clockid_t, const struct timespec *);
-extern int (*t2p_orig_clock_adjtime) (clockid_t, struct timex *);
-extern int (*t2p_orig_gettimeofday) (struct timeval *, struct timezone *);
-extern int (*t2p_orig_settimeofday) (const struct timeval *, const struct timezone *);
-extern int (*t2p_orig_adjtimex) (struct timex *);
-extern int (*t2p_orig_ntp_adjtime) (struct timex *);
-extern int (*t2p_orig_ntp_gettime) (struct ntptimeval *);
-extern ssize_t (*t2p_orig_recvmsg) (int, struct msghdr *, int);
+extern T2P_HIDDEN time_t (*t2p_orig_time) (time_t *);
+extern T2P_HIDDEN int (*t2p_orig_stime) (const time_t *);
+extern T2P_HIDDEN int (*t2p_orig_clock_gettime) (clockid_t, struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_clock_settime) (clockid_t, const struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_clock_adjtime) (clockid_t, struct timex *);
+extern T2P_HIDDEN int (*t2p_orig_gettimeofday) (struct timeval *, struct timezone *);
+extern T2P_HIDDEN int (*t2p_orig_settimeofday) (const struct timeval *, const struct timezone *);
+extern T2P_HIDDEN int (*t2p_orig_adjtimex) (struct timex *);
+extern T2P_HIDDEN int (*t2p_orig_ntp_adjtime) (struct timex *);
+extern T2P_HIDDEN int (*t2p_orig_ntp_gettime) (struct ntptimeval *);
+extern T2P_HIDDEN ssize_t (*t2p_orig_recvmsg) (int, struct msghdr *, int);
+struct mmsghdr;
+extern T2P_HIDDEN int (*t2p_orig_recvmmsg) (int, struct mmsghdr *, unsigned int, int, struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_ioctl) (int, unsigned long int, ...);
+
+/* The time64 entry points of the 32-bit targets (glibc 2.34), which
+   programs built with _TIME_BITS=64 call, with their 64-bit layouts.  */
+#if defined __TIMESIZE && __TIMESIZE == 32
+struct t2p_timespec64
+{
+  int64_t tv_sec;
+#if __BYTE_ORDER == __BIG_ENDIAN
+  int32_t : 32;
+  int32_t tv_nsec;
+#else
+  int32_t tv_nsec;
+  int32_t : 32;
+#endif
+};
+
+struct t2p_timeval64
+{
+  int64_t tv_sec;
+  int64_t tv_usec;
+};
+
+extern T2P_HIDDEN int (*t2p_orig___clock_gettime64) (clockid_t, struct t2p_timespec64 *);
+extern T2P_HIDDEN int (*t2p_orig___clock_settime64) (clockid_t, const struct t2p_timespec64 *);
+#endif
+
+/* the vDSO clock readers (NULL if there are none), used instead of the
+   libc wrappers around them for the realtime clocks */
+extern T2P_HIDDEN time_t (*t2p_vdso_time) (time_t *);
+extern T2P_HIDDEN int (*t2p_vdso_clock_gettime) (clockid_t, struct timespec *);
+extern T2P_HIDDEN int (*t2p_vdso_gettimeofday) (struct timeval *, struct timezone *);
+
+/* fakeclock.c */
+
+/* (the original functions are replaced while the fake clock is on) */
+extern T2P_HIDDEN int t2p_fake_clock;
+extern T2P_HIDDEN void t2p_fake_clock_init (void);
+extern T2P_HIDDEN void t2p_fake_clock_map (struct timespec *);
+extern T2P_HIDDEN void t2p_fake_clock_unmap (struct timespec *);
+
+/* socket.c */
+
+/* older headers know only the native layouts */
+#ifndef SO_TIMESTAMP_OLD
+#define SO_TIMESTAMP_OLD SO_TIMESTAMP
+#define SO_TIMESTAMPNS_OLD SO_TIMESTAMPNS
+#define SO_TIMESTAMPING_OLD SO_TIMESTAMPING
+#endif
+
+extern T2P_HIDDEN int (*t2p_orig_socket) (int, int, int);
+extern T2P_HIDDEN int (*t2p_orig_socketpair) (int, int, int, int *);
+extern T2P_HIDDEN int (*t2p_orig_accept) (int, __SOCKADDR_ARG, socklen_t *);
+extern T2P_HIDDEN int (*t2p_orig_accept4) (int, __SOCKADDR_ARG, socklen_t *, int);
+extern T2P_HIDDEN int (*t2p_orig_setsockopt) (int, int, int, const void *, socklen_t);
+extern T2P_HIDDEN int (*t2p_orig_close) (int);
+extern T2P_HIDDEN int (*t2p_orig_dup) (int);
+extern T2P_HIDDEN int (*t2p_orig_dup2) (int, int);
+extern T2P_HIDDEN int (*t2p_orig_dup3) (int, int, int);
+extern T2P_HIDDEN int (*t2p_orig_fcntl) (int, int, ...);
+extern T2P_HIDDEN int (*t2p_orig_close_range) (unsigned int, unsigned int, int);
+extern T2P_HIDDEN void (*t2p_orig_closefrom) (int);
+
+/* Two bits per fd below T2P_FD_MAX, 0 if it is not known yet, T2P_FD_KNOWN
+   for a socket without timestamping (or no socket), T2P_FD_STAMPING for
+   one with timestamping, T2P_FD_REALTIME for a timerfd on a realtime
+   clock (see deadline.c).  */
+#define T2P_FD_MAX 65536
+#define T2P_FD_KNOWN 1UL
+#define T2P_FD_REALTIME 2UL
+#define T2P_FD_STAMPING 3UL
+
+extern T2P_HIDDEN unsigned long t2p_fd_state[];
+extern T2P_HIDDEN int t2p_fd_probe (int);
+
+static inline void
+t2p_fd_set_state (int fd, unsigned long state)
+{
+  int shift = fd % (4 * sizeof (unsigned long)) * 2;
+
+  if ((unsigned) fd >= T2P_FD_MAX)
+    return;
+
+  __atomic_and_fetch (&t2p_fd_state[fd / (4 * sizeof (unsigned long))],
+                      ~(T2P_FD_STAMPING << shift), __ATOMIC_RELAXED);
+  if (state)
+    __atomic_or_fetch (&t2p_fd_state[fd / (4 * sizeof (unsigned long))],
+                       state << shift, __ATOMIC_RELAXED);
+}
+
+/* whether messages received on fd may carry timestamps */
+static inline int
+t2p_fd_stamping (int fd)
+{
+  unsigned long state;
+
+  if ((unsigned) fd >= T2P_FD_MAX)
+    return 1;
+
+  state = __atomic_load_n (&t2p_fd_state[fd / (4 * sizeof (unsigned long))], __ATOMIC_RELAXED)
+          >> fd % (4 * sizeof (unsigned long)) * 2 & T2P_FD_STAMPING;
+  if (__builtin_expect (state == 0, 0))
+    return t2p_fd_probe (fd);
+  return state == T2P_FD_STAMPING;
+}
+
+/* stat.c */
+extern T2P_HIDDEN int (*t2p_orig_stat) (const char *, struct stat *);
+extern T2P_HIDDEN int (*t2p_orig_fstat) (int, struct stat *);
+extern T2P_HIDDEN int (*t2p_orig_lstat) (const char *, struct stat *);
+extern T2P_HIDDEN int (*t2p_orig_fstatat) (int, const char *, struct stat *, int);
+struct stat64;
+extern T2P_HIDDEN int (*t2p_orig_stat64) (const char *, struct stat64 *);
+extern T2P_HIDDEN int (*t2p_orig_fstat64) (int, struct stat64 *);
+extern T2P_HIDDEN int (*t2p_orig_lstat64) (const char *, struct stat64 *);
+extern T2P_HIDDEN int (*t2p_orig_fstatat64) (int, const char *, struct stat64 *, int);
+struct statx;
+extern T2P_HIDDEN int (*t2p_orig_statx) (int, const char *, int, unsigned int, struct statx *);
+
+/* what the stat functions were before glibc 2.33, still called by
+   binaries built against older ones */
+extern T2P_HIDDEN int (*t2p_orig___xstat) (int, const char *, struct stat *);
+extern T2P_HIDDEN int (*t2p_orig___fxstat) (int, int, struct stat *);
+extern T2P_HIDDEN int (*t2p_orig___lxstat) (int, const char *, struct stat *);
+extern T2P_HIDDEN int (*t2p_orig___fxstatat) (int, int, const char *, struct stat *, int);
+extern T2P_HIDDEN int (*t2p_orig___xstat64) (int, const char *, struct stat64 *);
+extern T2P_HIDDEN int (*t2p_orig___fxstat64) (int, int, struct stat64 *);
+extern T2P_HIDDEN int (*t2p_orig___lxstat64) (int, const char *, struct stat64 *);
+extern T2P_HIDDEN int (*t2p_orig___fxstatat64) (int, int, const char *, struct stat64 *, int);
+
+extern T2P_HIDDEN int (*t2p_orig_utime) (const char *, const struct utimbuf *);
+extern T2P_HIDDEN int (*t2p_orig_utimes) (const char *, const struct timeval [2]);
+extern T2P_HIDDEN int (*t2p_orig_lutimes) (const char *, const struct timeval [2]);
+extern T2P_HIDDEN int (*t2p_orig_futimes) (int, const struct timeval [2]);
+extern T2P_HIDDEN int (*t2p_orig_futimesat) (int, const char *, const struct timeval [2]);
+extern T2P_HIDDEN int (*t2p_orig_utimensat) (int, const char *, const struct timespec [2], int);
+extern T2P_HIDDEN int (*t2p_orig_futimens) (int, const struct timespec [2]);
+
+/* (in time2posix.c) convert the at most T2P_STAMPS_MAX timestamps of a
+   file under a single read of the table */
+#define T2P_STAMPS_MAX 4
+
+extern T2P_HIDDEN void t2p_time2posix_timespecs (struct timespec *const *, size_t);
+extern T2P_HIDDEN void t2p_posix2time_timespecs (struct timespec *const *, size_t);
+
+/* deadline.c */
+extern T2P_HIDDEN int (*t2p_orig_clock_nanosleep) (clockid_t, int, const struct timespec *, struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_timerfd_create) (int, int);
+struct itimerspec;
+extern T2P_HIDDEN int (*t2p_orig_timerfd_settime) (int, int, const struct itimerspec *, struct itimerspec *);
+extern T2P_HIDDEN int (*t2p_orig_timer_create) (clockid_t, struct sigevent *, timer_t *);
+extern T2P_HIDDEN int (*t2p_orig_timer_settime) (timer_t, int, const struct itimerspec *, struct itimerspec *);
+extern T2P_HIDDEN int (*t2p_orig_timer_delete) (timer_t);
+
+extern T2P_HIDDEN int (*t2p_orig_pthread_cond_timedwait) (pthread_cond_t *, pthread_mutex_t *, const struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_pthread_mutex_timedlock) (pthread_mutex_t *, const struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_pthread_rwlock_timedrdlock) (pthread_rwlock_t *, const struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_pthread_rwlock_timedwrlock) (pthread_rwlock_t *, const struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_pthread_timedjoin_np) (pthread_t, void **, const struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_sem_timedwait) (sem_t *, const struct timespec *);
+extern T2P_HIDDEN ssize_t (*t2p_orig_mq_timedreceive) (mqd_t, char *, size_t, unsigned int *, const struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_mq_timedsend) (mqd_t, const char *, size_t, unsigned int, const struct timespec *);
+
+/* with an explicit clock, only in newer libcs (glibc 2.30, 2.31) */
+extern T2P_HIDDEN int (*t2p_orig_pthread_cond_clockwait) (pthread_cond_t *, pthread_mutex_t *, clockid_t, const struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_pthread_mutex_clocklock) (pthread_mutex_t *, clockid_t, const struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_pthread_rwlock_clockrdlock) (pthread_rwlock_t *, clockid_t, const struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_pthread_rwlock_clockwrlock) (pthread_rwlock_t *, clockid_t, const struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_pthread_clockjoin_np) (pthread_t, void **, clockid_t, const struct timespec *);
+extern T2P_HIDDEN int (*t2p_orig_sem_clockwait) (sem_t *, clockid_t, const struct timespec *);
+
+/* liburing, if the program uses it */
+struct io_uring;
+extern T2P_HIDDEN int (*t2p_orig_io_uring_submit) (struct io_uring *);
+extern T2P_HIDDEN int (*t2p_orig_io_uring_submit_and_wait) (struct io_uring *, unsigned);
+
+/* leaps.c */
+
+/* The table is read from the file in T2P_LEAPS, or else from the first
+   of the default sources which has leap seconds, through the binary cache
+   in T2P_LEAPS_CACHE (or T2P_LEAPS_CACHE_FILE) if t2p_leaps -c made it
+   from that file as it is now.  */
+#define T2P_LEAPS_CACHE_FILE "/var/cache/time2posix/leaps"
+
+/* the table as the sources give it (see t2p_leaps_set) */
+struct t2p_leaps
+{
+  size_t num;
+  time_t transition[T2P_LEAPS_MAX];
+  int change[T2P_LEAPS_MAX];
+
+  /* the posix time until which no other leap second can happen,
+     0 if the source does not tell */
+  time_t expires;
+};
+
+/* a file, as it was when the table was read from it */
+struct t2p_leaps_stat
+{
+  u_int64_t dev;
+  u_int64_t ino;
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+/* the file a table was read from (or which failed last) */
+struct t2p_leaps_source
+{
+  const char *path;
+  struct t2p_leaps_stat st;
+
+  /* read from the cache */
+  int cached;
+
+  /* why it failed, to be followed by the path */
+  const char *error;
+};
+
+/* generated at build time from the file the build machine has
+   (leaps_embedded.c) */
+extern T2P_HIDDEN const struct t2p_leaps t2p_leaps_embedded;
+
+extern T2P_HIDDEN const char *t2p_leaps_parse (const char *, size_t, struct t2p_leaps *);
+extern T2P_HIDDEN int t2p_leaps_load (struct t2p_leaps *, struct t2p_leaps_source *, int);
+extern T2P_HIDDEN int t2p_leaps_cache_write (const struct t2p_leaps *, const struct t2p_leaps_source *);
+extern T2P_HIDDEN int t2p_leaps_watch_add (int);
+extern T2P_HIDDEN int t2p_leaps_watched (const char *);
+
+/* coarse.c */
+
+/* With T2P_COARSE=1, the time of time() (a load of sec), and the span
+   for CLOCK_REALTIME_COARSE, stored by a ticker thread at every posix
+   second (seq as in the latch).  sec is 0 while it is not ticking (in
+   a child after fork until its first reader restarts the ticker).  */
+struct t2p_coarse_page
+{
+  unsigned seq;
+  time_t sec;
+  time_t right_start;
+  time_t right_end;
+  int change;
+} __attribute__ ((aligned (64)));
+
+extern T2P_HIDDEN struct t2p_coarse_page t2p_coarse;
+extern T2P_HIDDEN int t2p_coarse_stale;
+extern T2P_HIDDEN void t2p_coarse_init (void);
+extern T2P_HIDDEN void t2p_coarse_restart (void);
+extern T2P_HIDDEN int t2p_coarse_gettime (struct timespec *);
+
+/* copy the cached span of the current table (time2posix.c) */
+extern T2P_HIDDEN void t2p_span_get (struct t2p_offset_cache *);
+
+/* kernel.c */
+
+/* With T2P_OFFSET=kernel (default table) the table is adjusted to the
+   TAI offset and the leap second announced in the kernel.  */
+extern T2P_HIDDEN int t2p_kernel_on (void);
+extern T2P_HIDDEN int t2p_kernel_changed (void);
+extern T2P_HIDDEN void t2p_kernel_apply (struct t2p_leaps *, time_t);
+
+/* stats.c */
+
+/* Statistics, if T2P_STATS is set in the environment.  Every process
+   keeps its counters in T2P_STATS_FILE.<pid>, which t2p_stats reads
+   (and which is removed at exit unless T2P_STATS is keep).  The threads
+   count in T2P_STATS_SHARDS shards of a cache line or more each, so they
+   do not contend for the counters.  The conversions are counted for the
+   interposed function the thread called last, the functions which only
+   call another one (ntp_adjtime, clock_adjtime of the realtime clock)
+   are counted as that one, and the variants of the stat and utmp
+   functions as their family.  */
+#define T2P_STATS_FILE "/dev/shm/time2posix-stats"
+#define T2P_STATS_MAGIC 0x53503254
+#define T2P_STATS_SHARDS 16
+
+#define T2P_STATS_FUNCTIONS(f)						\
+  f(other) f(time) f(stime) f(clock_gettime) f(clock_settime)		\
+  f(clock_adjtime) f(gettimeofday) f(settimeofday) f(adjtimex)		\
+  f(ntp_gettime) f(recvmsg) f(recvmmsg) f(ioctl) f(stat) f(statx)	\
+  f(utimes) f(getutent) f(getutid) f(pututline) f(updwtmp)		\
+  f(clock_nanosleep) f(timerfd_settime) f(timer_settime) f(timedwait)	\
+  f(io_uring_submit)
+
+#define T2P_STATS_ENUM(name) T2P_FN_##name,
+enum { T2P_STATS_FUNCTIONS(T2P_STATS_ENUM) T2P_FN_MAX };
+#undef T2P_STATS_ENUM
+
+struct t2p_stat_counters
+{
+  u_int64_t calls;
+  u_int64_t conversions;
+
+  /* the conversions which hit a leap second (state != 0) */
+  u_int64_t leaps;
+
+  /* time spent in the conversions */
+  u_int64_t ns;
+};
+
+struct t2p_stats_shard
+{
+  struct t2p_stat_counters fn[T2P_FN_MAX];
+} __attribute__ ((aligned (64)));
+
+struct t2p_stats
+{
+  u_int32_t magic;
+  u_int32_t size;
+  int32_t pid;
+
+  /* the leap seconds table read (by this process), and the failures */
+  u_int64_t reloads;
+  u_int64_t reload_failures;
+
+  struct t2p_stats_shard shards[T2P_STATS_SHARDS];
+};
+
+/* NULL unless the statistics are on */
+extern T2P_HIDDEN struct t2p_stats *t2p_stats;
+extern T2P_HIDDEN void t2p_stats_init (void);
+extern T2P_HIDDEN void t2p_stat_call (int);
+extern T2P_HIDDEN u_int64_t t2p_stat_clock (void);
+extern T2P_HIDDEN void t2p_stat_conversions (u_int64_t, u_int64_t, u_int64_t);
+
+/* the function the thread called last (while statistics or tracing
+   are on) */
+extern T2P_HIDDEN __thread int t2p_stat_fn __attribute__ ((tls_model ("initial-exec")));
+
+/* count a call of the interposed function (after T2P_BIND) */
+#define T2P_STAT(name)							\
+  do									\
+    {									\
+      if (__builtin_expect (t2p_stats != NULL || t2p_tracing, 0))	\
+        t2p_stat_call (T2P_FN_##name);					\
+    }									\
+  while (0)
+
+/* trace.c */
+
+/* With T2P_TRACE set to a path prefix, the conversions which hit a leap
+   second (state != 0), the t2p_timestatus results other than TIME_OK and
+   the reloads of the table are recorded in a ring of the thread, and the
+   rings are written to <T2P_TRACE>.<pid> at exit, on t2p_trace_dump, or
+   on the signal in T2P_TRACE_SIGNAL.  */
+#define T2P_TRACE_EVENTS 256
+
+enum
+{
+  T2P_TRACE_TIME2POSIX,
+  T2P_TRACE_POSIX2TIME,
+  T2P_TRACE_TIMESTATUS,
+  T2P_TRACE_RELOAD
+};
+
+struct t2p_trace_event
+{
+  /* CLOCK_MONOTONIC */
+  u_int64_t ns;
+  int64_t in_sec;
+  int64_t out_sec;
+  u_int32_t in_nsec;
+  u_int32_t out_nsec;
+  int16_t kind;
+  int16_t fn;
+
+  /* the state of the conversion, the result of t2p_timestatus, or of the
+     reload */
+  int32_t state;
+};
+
+extern T2P_HIDDEN int t2p_tracing;
+extern T2P_HIDDEN void t2p_trace_init (void);
+extern T2P_HIDDEN void t2p_trace (int, int64_t, u_int32_t, int64_t, u_int32_t, int);
+
+/* write the events recorded so far to fd (async-signal-safe) */
+extern void t2p_trace_dump (int);
+
+/* USDT probes of the provider time2posix, for perf and bpftrace, unless
+   <sys/sdt.h> is missing or T2P_NO_SDT is defined */
+#if !defined (T2P_NO_SDT) && defined (__has_include)
+# if __has_include (<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define T2P_SDT 1
+# endif
+#endif
+
+#ifdef T2P_SDT
+# define T2P_PROBE2(name, a, b) STAP_PROBE2 (time2posix, name, a, b)
+# define T2P_PROBE5(name, a, b, c, d, e) STAP_PROBE5 (time2posix, name, a, b, c, d, e)
+#else
+# define T2P_PROBE2(name, a, b) do { } while (0)
+# define T2P_PROBE5(name, a, b, c, d, e) do { } while (0)
+#endif
 
 #endif /* !HAVE_TIME2POSIX_H */
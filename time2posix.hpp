@@ -0,0 +1,394 @@
+/* This file is in public domain */
+
+/* The conversions as std::chrono clocks, header only.
+
+   right_clock is the kernel's realtime clock, which runs in right time
+   (read by the system call, so that it is not converted even when the
+   program has time2posix.so), posix_clock is the same converted to
+   posix time, on the epoch of system_clock.  Both have to_sys and
+   from_sys, so std::chrono::clock_cast (C++20) converts between them
+   and any other clock.
+
+   The conversions are constexpr on the table embedded at build time
+   (t2p_leaps -x, from the tzdata), so those of known dates fold at
+   compile time.  At run time they use the table time2posix.so has
+   loaded, if the program is linked with it or preloads it (taken on
+   first use and by t2p::reload), else the embedded one, or the one
+   given to t2p::set_leaps, kept in a latch as in the library.  As
+   t2p_time2posix and t2p_posix2time do, an inserted leap second is the
+   23:59:59 posix second again, and the fraction of the second is kept
+   (as with T2P_SMEAR=none).  */
+
+#ifndef HAVE_TIME2POSIX_HPP
+#define HAVE_TIME2POSIX_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <type_traits>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+extern "C"
+{
+#include "time2posix.h"
+
+/* (NULL if the program does not have the library) */
+void t2p_table_get (struct t2p_table *) __attribute__ ((weak));
+}
+
+#include "time2posix_leaps.hpp"
+
+namespace t2p
+{
+
+/* the table with the keys of both directions, as struct t2p_table has
+   them (transition is the right time of the 23:59:59 of an insertion) */
+struct table
+{
+  std::size_t num = 0;
+  std::int64_t transition[T2P_LEAPS_MAX] = {};
+  std::int64_t posix_transition[T2P_LEAPS_MAX] = {};
+  int change[T2P_LEAPS_MAX] = {};
+  bool insert[T2P_LEAPS_MAX] = {};
+
+  constexpr table () = default;
+
+  constexpr table (const t2p_leaps &leaps)
+  {
+    int prev = 0;
+
+    num = leaps.num < T2P_LEAPS_MAX ? leaps.num : T2P_LEAPS_MAX;
+    for (std::size_t i = 0; i < num; i++)
+      {
+        insert[i] = leaps.change[i] > prev;
+        transition[i] = leaps.transition[i] - insert[i];
+        posix_transition[i] = transition[i] - prev;
+        change[i] = leaps.change[i];
+        prev = change[i];
+      }
+  }
+
+  /* the number of keys up to t */
+  constexpr std::size_t
+  count (const std::int64_t *keys, std::int64_t t) const
+  {
+    std::size_t lo = 0, hi = num;
+
+    while (lo < hi)
+      {
+        std::size_t mid = (lo + hi) / 2;
+
+        if (keys[mid] <= t)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+    return lo;
+  }
+
+  /* t2p_time2posix, with the same states */
+  constexpr std::int64_t
+  time2posix (std::int64_t t, int &state) const
+  {
+    std::size_t i = count (transition, t);
+
+    state = 0;
+    if (i-- == 0)
+      return t;
+
+    std::int64_t res = t - change[i];
+    if (t - transition[i] > 1)
+      return res;
+
+    if (insert[i] && t - 1 == transition[i])
+      state = 2;
+    else if (insert[i] && t == transition[i])
+      {
+        state = 1;
+        res++;
+      }
+    else if (!insert[i] && t == transition[i])
+      {
+        state = -1;
+        res--;
+      }
+    return res;
+  }
+
+  /* t2p_posix2time, with the same states */
+  constexpr std::int64_t
+  posix2time (std::int64_t t, int &state) const
+  {
+    std::size_t i = count (posix_transition, t);
+
+    state = 0;
+    if (i-- == 0)
+      return t;
+
+    std::int64_t res = t + change[i];
+    if (t - posix_transition[i] > 1)
+      return res;
+
+    if (insert[i] && t == posix_transition[i])
+      {
+        state = 1;
+        res--;
+      }
+    else if (!insert[i] && t == posix_transition[i])
+      {
+        state = -1;
+        res++;
+      }
+    else if (!insert[i] && t - 1 == posix_transition[i])
+      state = -2;
+    return res;
+  }
+
+  constexpr std::int64_t
+  time2posix (std::int64_t t) const
+  {
+    int state = 0;
+    return time2posix (t, state);
+  }
+
+  constexpr std::int64_t
+  posix2time (std::int64_t t) const
+  {
+    int state = 0;
+    return posix2time (t, state);
+  }
+};
+
+inline constexpr table embedded_table { embedded_leaps };
+
+namespace detail
+{
+
+/* Readers use tables[seq & 1] and retry if seq has changed meanwhile,
+   the writer fills the other copy and only then increments seq (0
+   until the first table is set).  */
+struct latch
+{
+  std::atomic<unsigned> seq { 0 };
+  table tables[2];
+};
+
+inline latch current;
+inline std::mutex writer;
+
+inline void
+publish (const table &tab)
+{
+  std::lock_guard<std::mutex> lock (writer);
+  unsigned seq = current.seq.load (std::memory_order_relaxed);
+
+  current.tables[(seq + 1) & 1] = tab;
+  current.seq.store (seq + 1, std::memory_order_release);
+}
+
+}
+
+/* replace the table of the run time conversions */
+inline void
+set_leaps (const t2p_leaps &leaps)
+{
+  detail::publish (table (leaps));
+}
+
+/* take the table time2posix.so has now (it is not followed afterwards,
+   call again when the files are updated), false if the program does
+   not have the library */
+inline bool
+reload ()
+{
+  t2p_table tab;
+  t2p_leaps leaps {};
+
+  if (t2p_table_get == nullptr)
+    return false;
+
+  t2p_table_get (&tab);
+  leaps.num = tab.num;
+  for (std::size_t i = 0; i < tab.num && i < T2P_LEAPS_MAX; i++)
+    {
+      leaps.transition[i] = tab.leapsecs[i].transition + tab.leapsecs[i].type;
+      leaps.change[i] = tab.leapsecs[i].change;
+    }
+  set_leaps (leaps);
+  return true;
+}
+
+namespace detail
+{
+
+/* the first run time conversion */
+inline void
+setup ()
+{
+  if (reload ())
+    return;
+
+  std::lock_guard<std::mutex> lock (writer);
+  if (current.seq.load (std::memory_order_relaxed) == 0)
+    {
+      current.tables[1] = embedded_table;
+      current.seq.store (1, std::memory_order_release);
+    }
+}
+
+template <typename F>
+inline std::int64_t
+read (F conv)
+{
+  unsigned seq;
+  std::int64_t res;
+
+  if (__builtin_expect (current.seq.load (std::memory_order_acquire) == 0, 0))
+    setup ();
+
+  do
+    {
+      seq = current.seq.load (std::memory_order_acquire);
+      res = conv (current.tables[seq & 1]);
+      std::atomic_thread_fence (std::memory_order_acquire);
+    }
+  while (current.seq.load (std::memory_order_relaxed) != seq);
+  return res;
+}
+
+}
+
+/* table::time2posix and posix2time on the embedded table at compile
+   time, on the current one at run time */
+#ifdef __cpp_lib_is_constant_evaluated
+# define T2P_CONSTEXPR constexpr
+#else
+# define T2P_CONSTEXPR inline
+#endif
+
+T2P_CONSTEXPR std::int64_t
+time2posix (std::int64_t t, int &state)
+{
+#ifdef __cpp_lib_is_constant_evaluated
+  if (std::is_constant_evaluated ())
+    return embedded_table.time2posix (t, state);
+#endif
+  int s = 0;
+  std::int64_t res = detail::read ([t, &s] (const table &tab) { return tab.time2posix (t, s); });
+
+  state = s;
+  return res;
+}
+
+T2P_CONSTEXPR std::int64_t
+posix2time (std::int64_t t, int &state)
+{
+#ifdef __cpp_lib_is_constant_evaluated
+  if (std::is_constant_evaluated ())
+    return embedded_table.posix2time (t, state);
+#endif
+  int s = 0;
+  std::int64_t res = detail::read ([t, &s] (const table &tab) { return tab.posix2time (t, s); });
+
+  state = s;
+  return res;
+}
+
+T2P_CONSTEXPR std::int64_t
+time2posix (std::int64_t t)
+{
+  int state = 0;
+  return time2posix (t, state);
+}
+
+T2P_CONSTEXPR std::int64_t
+posix2time (std::int64_t t)
+{
+  int state = 0;
+  return posix2time (t, state);
+}
+
+#undef T2P_CONSTEXPR
+
+struct right_clock
+{
+  typedef std::chrono::nanoseconds duration;
+  typedef duration::rep rep;
+  typedef duration::period period;
+  typedef std::chrono::time_point<right_clock> time_point;
+
+  static constexpr bool is_steady = false;
+
+  static time_point
+  now () noexcept
+  {
+    struct timespec ts;
+
+    syscall (SYS_clock_gettime, CLOCK_REALTIME, &ts);
+    return time_point (std::chrono::seconds (ts.tv_sec) + std::chrono::nanoseconds (ts.tv_nsec));
+  }
+
+  template <typename Duration>
+  static constexpr std::chrono::time_point<std::chrono::system_clock,
+                                           std::common_type_t<Duration, std::chrono::seconds>>
+  to_sys (const std::chrono::time_point<right_clock, Duration> &t)
+  {
+    auto sec = std::chrono::floor<std::chrono::seconds> (t.time_since_epoch ());
+    auto posix = std::chrono::seconds (t2p::time2posix (sec.count ()));
+
+    return std::chrono::time_point<std::chrono::system_clock,
+                                   std::common_type_t<Duration, std::chrono::seconds>>
+      (posix + (t.time_since_epoch () - sec));
+  }
+
+  template <typename Duration>
+  static constexpr std::chrono::time_point<right_clock,
+                                           std::common_type_t<Duration, std::chrono::seconds>>
+  from_sys (const std::chrono::time_point<std::chrono::system_clock, Duration> &t)
+  {
+    auto sec = std::chrono::floor<std::chrono::seconds> (t.time_since_epoch ());
+    auto right = std::chrono::seconds (t2p::posix2time (sec.count ()));
+
+    return std::chrono::time_point<right_clock,
+                                   std::common_type_t<Duration, std::chrono::seconds>>
+      (right + (t.time_since_epoch () - sec));
+  }
+};
+
+/* (system_clock without the leap seconds, whatever the kernel runs) */
+struct posix_clock
+{
+  typedef std::chrono::nanoseconds duration;
+  typedef duration::rep rep;
+  typedef duration::period period;
+  typedef std::chrono::time_point<posix_clock> time_point;
+
+  static constexpr bool is_steady = false;
+
+  static time_point
+  now () noexcept
+  {
+    return time_point (right_clock::to_sys (right_clock::now ()).time_since_epoch ());
+  }
+
+  template <typename Duration>
+  static constexpr std::chrono::time_point<std::chrono::system_clock, Duration>
+  to_sys (const std::chrono::time_point<posix_clock, Duration> &t)
+  {
+    return std::chrono::time_point<std::chrono::system_clock, Duration> (t.time_since_epoch ());
+  }
+
+  template <typename Duration>
+  static constexpr std::chrono::time_point<posix_clock, Duration>
+  from_sys (const std::chrono::time_point<std::chrono::system_clock, Duration> &t)
+  {
+    return std::chrono::time_point<posix_clock, Duration> (t.time_since_epoch ());
+  }
+};
+
+}
+
+#endif
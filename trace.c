@@ -0,0 +1,279 @@
+/* This file is in public domain */
+
+/* The leap second tracer (see T2P_TRACE_EVENTS).  Every thread records
+   its events in a ring of its own, allocated on its first event, so
+   outside of leap seconds nothing is allocated or written.  The rings
+   are never freed and are linked in a list, which the dump walks without
+   locks, so it can run in a signal handler.  An event being written
+   while it is dumped may come out torn.  */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "time2posix.h"
+
+struct trace_ring
+{
+  struct trace_ring *next;
+  pid_t tid;
+
+  /* the number of events ever recorded, written by the thread only */
+  u_int64_t head;
+
+  struct t2p_trace_event ev[T2P_TRACE_EVENTS];
+};
+
+int t2p_tracing = 0;
+
+static struct trace_ring *t2p_trace_rings = NULL;
+static __thread struct trace_ring *t2p_trace_ring __attribute__ ((tls_model ("initial-exec")));
+static const char *t2p_trace_prefix;
+static char t2p_trace_path[256];
+
+#define T2P_TRACE_NAME(name) #name,
+static const char *const trace_fns[] = { T2P_STATS_FUNCTIONS(T2P_TRACE_NAME) };
+#undef T2P_TRACE_NAME
+
+static const char *const trace_kinds[] = { "time2posix", "posix2time", "timestatus", "reload" };
+
+static const char *const trace_status[] = { "TIME_OK", "TIME_INS", "TIME_DEL", "TIME_OOP",
+                                            "TIME_WAIT", "TIME_ERROR" };
+
+static struct trace_ring *
+trace_ring_new (void)
+{
+  struct trace_ring *ring;
+
+  ring = mmap (NULL, sizeof (struct trace_ring), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED)
+    return NULL;
+
+  ring->tid = syscall (SYS_gettid);
+  ring->next = __atomic_load_n (&t2p_trace_rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&t2p_trace_rings, &ring->next, ring, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  return ring;
+}
+
+/* record an event in the ring of the thread */
+void
+t2p_trace (int kind, int64_t in_sec, u_int32_t in_nsec,
+           int64_t out_sec, u_int32_t out_nsec, int state)
+{
+  struct trace_ring *ring = t2p_trace_ring;
+  struct t2p_trace_event *ev;
+
+  if (ring == NULL)
+    {
+      ring = trace_ring_new ();
+      if (ring == NULL)
+        return;
+      t2p_trace_ring = ring;
+    }
+
+  ev = &ring->ev[ring->head % T2P_TRACE_EVENTS];
+  ev->ns = t2p_stat_clock ();
+  ev->in_sec = in_sec;
+  ev->in_nsec = in_nsec;
+  ev->out_sec = out_sec;
+  ev->out_nsec = out_nsec;
+  ev->kind = kind;
+  ev->fn = t2p_stat_fn;
+  ev->state = state;
+  __atomic_store_n (&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* the formatting for the dump, without stdio */
+struct trace_buf
+{
+  char buf[4096];
+  size_t len;
+  int fd;
+};
+
+static void
+trace_flush (struct trace_buf *b)
+{
+  size_t done = 0;
+  ssize_t res;
+
+  while (done < b->len)
+    {
+      res = write (b->fd, b->buf + done, b->len - done);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res <= 0)
+        break;
+      done += res;
+    }
+  b->len = 0;
+}
+
+static void
+trace_str (struct trace_buf *b, const char *s)
+{
+  for (; *s; s++)
+    b->buf[b->len++] = *s;
+}
+
+static void
+trace_num (struct trace_buf *b, u_int64_t x, int width)
+{
+  char tmp[24];
+  int n = 0;
+
+  do
+    {
+      tmp[n++] = '0' + x % 10;
+      x /= 10;
+    }
+  while (x || n < width);
+
+  while (n)
+    b->buf[b->len++] = tmp[--n];
+}
+
+static void
+trace_int (struct trace_buf *b, int64_t x)
+{
+  if (x < 0)
+    {
+      b->buf[b->len++] = '-';
+      trace_num (b, -(u_int64_t) x, 0);
+    }
+  else
+    trace_num (b, x, 0);
+}
+
+static void
+trace_time (struct trace_buf *b, int64_t sec, u_int32_t nsec)
+{
+  trace_int (b, sec);
+  b->buf[b->len++] = '.';
+  trace_num (b, nsec, 9);
+}
+
+static void
+trace_event (struct trace_buf *b, pid_t tid, const struct t2p_trace_event *ev)
+{
+  unsigned kind = ev->kind, fn = ev->fn;
+
+  /* (a line is well under 256 bytes) */
+  if (b->len > sizeof (b->buf) - 256)
+    trace_flush (b);
+
+  trace_int (b, tid);
+  b->buf[b->len++] = '\t';
+  trace_time (b, ev->ns / 1000000000, ev->ns % 1000000000);
+  b->buf[b->len++] = '\t';
+  trace_str (b, kind <= T2P_TRACE_RELOAD ? trace_kinds[kind] : "?");
+  b->buf[b->len++] = '\t';
+  trace_str (b, fn < T2P_FN_MAX ? trace_fns[fn] : "?");
+  b->buf[b->len++] = '\t';
+  trace_time (b, ev->in_sec, ev->in_nsec);
+  b->buf[b->len++] = '\t';
+  trace_time (b, ev->out_sec, ev->out_nsec);
+  b->buf[b->len++] = '\t';
+  if (kind == T2P_TRACE_TIMESTATUS && (unsigned) ev->state <= TIME_ERROR)
+    trace_str (b, trace_status[ev->state]);
+  else
+    trace_int (b, ev->state);
+  b->buf[b->len++] = '\n';
+}
+
+void
+t2p_trace_dump (int fd)
+{
+  const struct trace_ring *ring;
+  struct trace_buf b;
+  u_int64_t head, i;
+
+  b.fd = fd;
+  b.len = 0;
+  trace_str (&b, "# tid\tns\tevent\tfunction\tin\tout\tstate\n");
+
+  for (ring = __atomic_load_n (&t2p_trace_rings, __ATOMIC_ACQUIRE); ring != NULL;
+       ring = ring->next)
+    {
+      head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+      i = head > T2P_TRACE_EVENTS ? head - T2P_TRACE_EVENTS : 0;
+      for (; i < head; i++)
+        trace_event (&b, ring->tid, &ring->ev[i % T2P_TRACE_EVENTS]);
+    }
+
+  trace_flush (&b);
+}
+
+/* dump to <T2P_TRACE>.<pid>, if anything was recorded */
+static void
+trace_dump_file (void)
+{
+  int fd;
+
+  if (__atomic_load_n (&t2p_trace_rings, __ATOMIC_ACQUIRE) == NULL)
+    return;
+
+  fd = open (t2p_trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return;
+  t2p_trace_dump (fd);
+  close (fd);
+}
+
+static void
+trace_signal (int sig __attribute__ ((unused)))
+{
+  int saved = errno;
+
+  trace_dump_file ();
+  errno = saved;
+}
+
+/* the child traces only itself */
+static void
+trace_fork_child (void)
+{
+  snprintf (t2p_trace_path, sizeof (t2p_trace_path), "%s.%d", t2p_trace_prefix, (int) getpid ());
+  t2p_trace_rings = NULL;
+  t2p_trace_ring = NULL;
+}
+
+/* called once, when the original functions are bound */
+void
+t2p_trace_init (void)
+{
+  const char *sig = secure_getenv ("T2P_TRACE_SIGNAL");
+  struct sigaction sa;
+
+  t2p_trace_prefix = secure_getenv ("T2P_TRACE");
+  if (t2p_trace_prefix == NULL || *t2p_trace_prefix == '\0')
+    return;
+
+  snprintf (t2p_trace_path, sizeof (t2p_trace_path), "%s.%d", t2p_trace_prefix, (int) getpid ());
+  atexit (trace_dump_file);
+  pthread_atfork (NULL, NULL, trace_fork_child);
+
+  if (sig != NULL && atoi (sig) > 0)
+    {
+      memset (&sa, 0, sizeof sa);
+      sa.sa_handler = trace_signal;
+      sa.sa_flags = SA_RESTART;
+      sigemptyset (&sa.sa_mask);
+      if (sigaction (atoi (sig), &sa, NULL))
+        fprintf (stderr, "time2posix warning: Cannot catch signal %s for tracing!\n", sig);
+    }
+
+  __atomic_store_n (&t2p_tracing, 1, __ATOMIC_RELEASE);
+}
@@ -19,6 +19,17 @@ struct utmpx *(*t2p_orig_getutxline) (const struct utmpx *);
 struct utmpx *(*t2p_orig_pututxline) (const struct utmpx *);
 void (*t2p_orig_updwtmpx) (const char *, const struct utmpx *);
 
+/* The records read are converted in the span of the previous one, so a
+   sequential scan of a large wtmp does a lookup only when it crosses a
+   leap second.  */
+static __thread struct t2p_scan t2p_utmp_scan;
+
+static inline void
+t2p_time2posix_utmp_timeval (struct timeval *tv)
+{
+  t2p_time2posix_timeval_scan (tv, &t2p_utmp_scan);
+}
+
 #define def_conv(conv, type)		\
 static inline struct type *		\
 conv##_##type (struct type *ut)		\
@@ -34,25 +45,29 @@ conv##_##type (struct type *ut)		\
   return ut;				\
 }
 
-def_conv(time2posix, utmp)
+def_conv(time2posix_utmp, utmp)
 def_conv(posix2time, utmp)
-def_conv(time2posix, utmpx)
+def_conv(time2posix_utmp, utmpx)
 def_conv(posix2time, utmpx)
 
 #define def_getent(type,name)				\
 struct type *						\
 name (void)						\
 {							\
-  return time2posix_##type (t2p_orig_##name ());	\
+  T2P_BIND ();						\
+  T2P_STAT (getutent);					\
+  return time2posix_utmp_##type (t2p_orig_##name ());	\
 }
 
-#define def_getput(type,name)				\
+#define def_getput(type,name,stat)			\
 struct type *						\
 name (const struct type *p)				\
 {							\
   struct type ut = *p;					\
+  T2P_BIND ();						\
+  T2P_STAT (stat);					\
   posix2time_##type (&ut);				\
-  return time2posix_##type (t2p_orig_##name (&ut));	\
+  return time2posix_utmp_##type (t2p_orig_##name (&ut));	\
 }
 
 #define def_upd(type,name)			\
@@ -60,28 +75,34 @@ void						\
 name (const char *file, const struct type *p)	\
 {						\
   struct type ut = *p;				\
+  T2P_BIND ();					\
+  T2P_STAT (updwtmp);				\
   posix2time_##type (&ut);			\
   t2p_orig_##name (file, &ut);			\
 }
 
 def_getent(utmp,getutent)
-def_getput(utmp,getutid)
-def_getput(utmp,getutline)
-def_getput(utmp,pututline)
+def_getput(utmp,getutid,getutid)
+def_getput(utmp,getutline,getutid)
+def_getput(utmp,pututline,pututline)
 def_upd(utmp,updwtmp)
 
 def_getent(utmpx,getutxent)
-def_getput(utmpx,getutxid)
-def_getput(utmpx,getutxline)
-def_getput(utmpx,pututxline)
+def_getput(utmpx,getutxid,getutid)
+def_getput(utmpx,getutxline,getutid)
+def_getput(utmpx,pututxline,pututline)
 def_upd(utmpx,updwtmpx)
 
 int
 getutent_r (struct utmp *ubuf, struct utmp **ubufp)
 {
-  int res = t2p_orig_getutent_r (ubuf, ubufp);
+  int res;
+
+  T2P_BIND ();
+  T2P_STAT (getutent);
+  res = t2p_orig_getutent_r (ubuf, ubufp);
   if (!res)
-    time2posix_utmp (ubuf);
+    time2posix_utmp_utmp (ubuf);
   return res;
 }
 
@@ -91,10 +112,12 @@ name (const struct utmp *p, struct utmp *ubuf, struct utmp **ubufp)	\
 {									\
   struct utmp ut = *p;							\
   int res;								\
+  T2P_BIND ();								\
+  T2P_STAT (getutid);							\
   posix2time_utmp (&ut);						\
   res = t2p_orig_##name (&ut, ubuf, ubufp);				\
   if (!res)								\
-    time2posix_utmp (ubuf);						\
+    time2posix_utmp_utmp (ubuf);						\
   return res;								\
 }
 